@@ -0,0 +1,2896 @@
+#pragma once
+#ifndef EPL_BASICKDTREE_H_
+#define EPL_BASICKDTREE_H_
+
+#include "stdafx.h"
+#include "mappedfile.h"
+#include "workerpool.h"
+
+/// @{
+/// Helper Macros for Dynamic Index Precision
+/// NOTE: these helpers must all be changed to add/remove an index precision
+#define KD_TREE_EMPTY_ARGUMENT
+#define KD_TREE_FOREACH_IDX_SIZE(macro) \
+	macro(8) \
+	macro(16) \
+	macro(32) \
+	macro(64)
+#define KD_TREE_FOREACH_IDX_SIZE_ARG1(macro, arg) \
+	macro(8, arg) \
+	macro(16, arg) \
+	macro(32, arg) \
+	macro(64, arg)
+#define KD_TREE_FOREACH_IDX_SIZE_ARG2(macro, arg1, arg2) \
+	macro(8, arg1, arg2) \
+	macro(16, arg1, arg2) \
+	macro(32, arg1, arg2) \
+	macro(64, arg1, arg2)
+/// @}
+
+/// @{
+/// Invalid Index
+template <typename uint_t>
+struct InvalidIndex {
+	static const uint_t value = 0;
+};
+
+#define KD_TREE_INVALID_IDX(bits) \
+	template <> \
+	struct InvalidIndex<uint##bits##_t> { \
+		static const uint##bits##_t value = UINT##bits##_MAX; \
+	};
+
+KD_TREE_FOREACH_IDX_SIZE(KD_TREE_INVALID_IDX)
+/// @}
+
+// Splitting Plane Axis
+// NOTE: trees with more than three dimensions split on axes past Z_AXIS too
+enum KDTreeAxis
+{
+	X_AXIS = 0,
+	Y_AXIS = 1,
+	Z_AXIS = 2
+};
+
+/// Largest dimension of a tree with fixed size points
+static const int KD_TREE_MAX_DIM = 32;
+
+/// @{
+/// Unrolled Per-Axis Loop
+/// Calls func(axis) for each axis in [AXIS, DIM) without a loop counter.
+template <int AXIS, int DIM>
+struct KDTreeUnroll
+{
+	template <typename func_t>
+	static void forEachAxis(func_t& func)
+	{
+		func(AXIS);
+		KDTreeUnroll<AXIS+1, DIM>::forEachAxis(func);
+	}
+};
+
+template <int DIM>
+struct KDTreeUnroll<DIM, DIM>
+{
+	template <typename func_t>
+	static void forEachAxis(func_t&) {}
+};
+
+template <int DIM, typename func_t>
+static inline void
+forEachAxis(func_t func)
+{
+	KDTreeUnroll<0, DIM>::forEachAxis(func);
+}
+/// @}
+
+/// Fixed Size Point
+/// Used for dimensions without an Imath vector type.
+template <int DIM, typename real_t>
+class KDTreeVec
+{
+public: // types
+	typedef real_t BaseType;
+
+public: // methods
+	KDTreeVec() {}
+	explicit KDTreeVec(real_t value) { fill(m_coords, m_coords + DIM, value); }
+
+	real_t&			operator[](int axis)       { return m_coords[axis]; }
+	const real_t&	operator[](int axis) const { return m_coords[axis]; }
+
+	bool operator==(const KDTreeVec& rhs) const
+	{
+		return equal(m_coords, m_coords + DIM, rhs.m_coords);
+	}
+
+	static unsigned int dimensions() { return DIM; }
+
+private: // members
+	real_t m_coords[DIM];
+};
+
+template <int DIM, typename real_t>
+ostream&
+operator<<(ostream& out, const KDTreeVec<DIM, real_t>& point)
+{
+	out << "(";
+	for (int axis = 0; axis < DIM; ++axis)
+		out << (axis == 0 ? "" : " ") << point[axis];
+	return out << ")";
+}
+
+/// @{
+/// Point Type of a Tree with DIM real_t Coordinates
+template <int DIM, typename real_t>
+struct KDTreePointTraits
+{
+	static_assert(DIM > 0 && DIM <= KD_TREE_MAX_DIM,
+		"unsupported KD tree dimension");
+	typedef KDTreeVec<DIM, real_t> point_t;
+};
+
+template <typename real_t>
+struct KDTreePointTraits<2, real_t>
+{
+	typedef Vec2<real_t> point_t;
+};
+
+template <typename real_t>
+struct KDTreePointTraits<3, real_t>
+{
+	typedef Vec3<real_t> point_t;
+};
+
+template <typename real_t>
+struct KDTreePointTraits<4, real_t>
+{
+	typedef Vec4<real_t> point_t;
+};
+/// @}
+
+/// Squared Distance Between Two Points
+/// NOTE: summed in axis order, packet queries rely on matching it exactly
+template <int DIM, typename point_t>
+static inline typename point_t::BaseType
+getDistance2(const point_t& lhs, const point_t& rhs)
+{
+	typedef typename point_t::BaseType real_t;
+	real_t distance2 = 0;
+	forEachAxis<DIM>([&](int axis) {
+		real_t diff = lhs[axis] - rhs[axis];
+		distance2 += diff * diff;
+	});
+	return distance2;
+}
+
+// Result of KDTree::getClosestPointTo()
+template <typename point_t>
+struct BasicKDTreeClosestPoint
+{
+	typedef typename point_t::BaseType real_t;
+	static const size_t IDX_NONE = static_cast<size_t>(-1);
+
+	point_t point;
+	real_t distance2;
+	size_t idxNode; // tree node holding point, for warm-started queries
+
+	BasicKDTreeClosestPoint()
+		: point(numeric_limits<real_t>::max())
+		, distance2(numeric_limits<real_t>::max())
+		, idxNode(IDX_NONE)
+	{}
+};
+
+/// KD Tree Node
+template <typename uint_t>
+class KDTreeNode
+{
+public: // types
+	typedef vector<KDTreeNode<uint_t> > KDTreeNodeList;
+
+public: // methods
+	KDTreeNode(
+		uint_t idxPoint,
+		uint_t idxLeft,
+		uint_t idxRight,
+		int axis);
+
+	uint_t		getIdxPoint()  const { return m_idxPoint; }
+	int			getAxis()      const { return m_axis; }
+	uint_t		getIdxLeft()   const { return m_idxLeft; }
+	uint_t		getIdxRight()  const { return m_idxRight; }
+
+	uint_t		getSize(const KDTreeNode<uint_t>* arrNodes) const;
+	bool		isBalanced(const KDTreeNode<uint_t>* arrNodes) const;
+
+	void		dumpAxis(ostream& out) const;
+	template <typename point_t>
+	void		dump(const point_t& nodePoint, ostream& out) const;
+
+private: // members
+	uint_t m_idxPoint;
+	uint_t m_idxLeft;
+	uint_t m_idxRight;
+	uint8_t m_axis;
+};
+
+/// @{
+/// SIMD Lanes for Packet Queries and Scans
+/// Builds with AVX2 enabled (/arch:AVX2) use 256 bit registers, others SSE2.
+template <typename real_t>
+struct KDTreeSimd;
+
+#ifdef __AVX2__
+template <>
+struct KDTreeSimd<double>
+{
+	typedef __m256d reg_t;
+	static const size_t WIDTH = 4;
+
+	static reg_t load(const double* p)        { return _mm256_loadu_pd(p); }
+	static void  store(double* p, reg_t a)    { _mm256_storeu_pd(p, a); }
+	static reg_t set1(double value)           { return _mm256_set1_pd(value); }
+	static reg_t add(reg_t a, reg_t b)        { return _mm256_add_pd(a, b); }
+	static reg_t sub(reg_t a, reg_t b)        { return _mm256_sub_pd(a, b); }
+	static reg_t mul(reg_t a, reg_t b)        { return _mm256_mul_pd(a, b); }
+	static int   lessThan(reg_t a, reg_t b)
+		{ return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+	static int   lessEqual(reg_t a, reg_t b)
+		{ return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ)); }
+
+	// Each half holds two points laid out as in the SSE2 version
+	static void loadPoints3(const double* p, reg_t* out_axes)
+	{
+		reg_t r0 = _mm256_insertf128_pd(
+			_mm256_castpd128_pd256(_mm_loadu_pd(p)), _mm_loadu_pd(p + 6), 1);
+		reg_t r1 = _mm256_insertf128_pd(
+			_mm256_castpd128_pd256(_mm_loadu_pd(p + 2)), _mm_loadu_pd(p + 8), 1);
+		reg_t r2 = _mm256_insertf128_pd(
+			_mm256_castpd128_pd256(_mm_loadu_pd(p + 4)), _mm_loadu_pd(p + 10), 1);
+		out_axes[0] = _mm256_shuffle_pd(r0, r1, 0xA);
+		out_axes[1] = _mm256_shuffle_pd(r0, r2, 0x5);
+		out_axes[2] = _mm256_shuffle_pd(r1, r2, 0xA);
+	}
+};
+
+template <>
+struct KDTreeSimd<float>
+{
+	typedef __m256 reg_t;
+	static const size_t WIDTH = 8;
+
+	static reg_t load(const float* p)         { return _mm256_loadu_ps(p); }
+	static void  store(float* p, reg_t a)     { _mm256_storeu_ps(p, a); }
+	static reg_t set1(float value)            { return _mm256_set1_ps(value); }
+	static reg_t add(reg_t a, reg_t b)        { return _mm256_add_ps(a, b); }
+	static reg_t sub(reg_t a, reg_t b)        { return _mm256_sub_ps(a, b); }
+	static reg_t mul(reg_t a, reg_t b)        { return _mm256_mul_ps(a, b); }
+	static int   lessThan(reg_t a, reg_t b)
+		{ return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+	static int   lessEqual(reg_t a, reg_t b)
+		{ return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+
+	// Each half holds four points laid out as in the SSE2 version
+	static void loadPoints3(const float* p, reg_t* out_axes)
+	{
+		reg_t r0 = _mm256_insertf128_ps(
+			_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+		reg_t r1 = _mm256_insertf128_ps(
+			_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+		reg_t r2 = _mm256_insertf128_ps(
+			_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+		out_axes[0] = _mm256_shuffle_ps(r0, 
+			_mm256_shuffle_ps(r1, r2, _MM_SHUFFLE(0, 1, 0, 2)), 
+			_MM_SHUFFLE(2, 0, 3, 0));
+		out_axes[1] = _mm256_shuffle_ps(
+			_mm256_shuffle_ps(r0, r1, _MM_SHUFFLE(0, 0, 0, 1)),
+			_mm256_shuffle_ps(r1, r2, _MM_SHUFFLE(0, 2, 0, 3)),
+			_MM_SHUFFLE(2, 0, 2, 0));
+		out_axes[2] = _mm256_shuffle_ps(
+			_mm256_shuffle_ps(r0, r1, _MM_SHUFFLE(0, 1, 0, 2)), r2,
+			_MM_SHUFFLE(3, 0, 2, 0));
+	}
+};
+#else
+template <>
+struct KDTreeSimd<double>
+{
+	typedef __m128d reg_t;
+	static const size_t WIDTH = 2;
+
+	static reg_t load(const double* p)        { return _mm_loadu_pd(p); }
+	static void  store(double* p, reg_t a)    { _mm_storeu_pd(p, a); }
+	static reg_t set1(double value)           { return _mm_set1_pd(value); }
+	static reg_t add(reg_t a, reg_t b)        { return _mm_add_pd(a, b); }
+	static reg_t sub(reg_t a, reg_t b)        { return _mm_sub_pd(a, b); }
+	static reg_t mul(reg_t a, reg_t b)        { return _mm_mul_pd(a, b); }
+	static int   lessThan(reg_t a, reg_t b)
+		{ return _mm_movemask_pd(_mm_cmplt_pd(a, b)); }
+	static int   lessEqual(reg_t a, reg_t b)
+		{ return _mm_movemask_pd(_mm_cmple_pd(a, b)); }
+
+	// Deinterleaves WIDTH packed 3D points into one register per axis,
+	// [x0 y0] [z0 x1] [y1 z1] becomes [x0 x1] [y0 y1] [z0 z1]
+	static void loadPoints3(const double* p, reg_t* out_axes)
+	{
+		reg_t r0 = _mm_loadu_pd(p);
+		reg_t r1 = _mm_loadu_pd(p + 2);
+		reg_t r2 = _mm_loadu_pd(p + 4);
+		out_axes[0] = _mm_shuffle_pd(r0, r1, 0x2);
+		out_axes[1] = _mm_shuffle_pd(r0, r2, 0x1);
+		out_axes[2] = _mm_shuffle_pd(r1, r2, 0x2);
+	}
+};
+
+template <>
+struct KDTreeSimd<float>
+{
+	typedef __m128 reg_t;
+	static const size_t WIDTH = 4;
+
+	static reg_t load(const float* p)         { return _mm_loadu_ps(p); }
+	static void  store(float* p, reg_t a)     { _mm_storeu_ps(p, a); }
+	static reg_t set1(float value)            { return _mm_set1_ps(value); }
+	static reg_t add(reg_t a, reg_t b)        { return _mm_add_ps(a, b); }
+	static reg_t sub(reg_t a, reg_t b)        { return _mm_sub_ps(a, b); }
+	static reg_t mul(reg_t a, reg_t b)        { return _mm_mul_ps(a, b); }
+	static int   lessThan(reg_t a, reg_t b)
+		{ return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+	static int   lessEqual(reg_t a, reg_t b)
+		{ return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+
+	// [x0 y0 z0 x1] [y1 z1 x2 y2] [z2 x3 y3 z3] becomes one register per
+	// axis, each gathered from two half-filled shuffles
+	static void loadPoints3(const float* p, reg_t* out_axes)
+	{
+		reg_t r0 = _mm_loadu_ps(p);
+		reg_t r1 = _mm_loadu_ps(p + 4);
+		reg_t r2 = _mm_loadu_ps(p + 8);
+		out_axes[0] = _mm_shuffle_ps(r0, 
+			_mm_shuffle_ps(r1, r2, _MM_SHUFFLE(0, 1, 0, 2)), 
+			_MM_SHUFFLE(2, 0, 3, 0));
+		out_axes[1] = _mm_shuffle_ps(
+			_mm_shuffle_ps(r0, r1, _MM_SHUFFLE(0, 0, 0, 1)),
+			_mm_shuffle_ps(r1, r2, _MM_SHUFFLE(0, 2, 0, 3)),
+			_MM_SHUFFLE(2, 0, 2, 0));
+		out_axes[2] = _mm_shuffle_ps(
+			_mm_shuffle_ps(r0, r1, _MM_SHUFFLE(0, 1, 0, 2)), r2,
+			_MM_SHUFFLE(3, 0, 2, 0));
+	}
+};
+#endif
+/// @}
+
+/// @{
+/// Loads WIDTH consecutive points into one register per axis. Packed 3D
+/// points are shuffled into place from whole registers, other layouts are
+/// gathered lane by lane, which is hardly faster than scalar code.
+template <int DIM, typename real_t>
+struct KDTreeSimdGather
+{
+	typedef KDTreeSimd<real_t> Simd;
+	typedef typename Simd::reg_t reg_t;
+
+	static void load(const char* pPoints, size_t byteStride, reg_t* out_axes)
+	{
+		real_t lanes[Simd::WIDTH];
+		forEachAxis<DIM>([&](int axis) {
+			for (size_t lane = 0; lane < Simd::WIDTH; ++lane) {
+				lanes[lane] = reinterpret_cast<const real_t*>(
+					pPoints + lane * byteStride)[axis];
+			}
+			out_axes[axis] = Simd::load(lanes);
+		});
+	}
+};
+
+template <int DIM, typename real_t>
+struct KDTreeSimdPoints : public KDTreeSimdGather<DIM, real_t>
+{
+};
+
+template <typename real_t>
+struct KDTreeSimdPoints<3, real_t>
+{
+	typedef KDTreeSimd<real_t> Simd;
+	typedef typename Simd::reg_t reg_t;
+
+	static void load(const char* pPoints, size_t byteStride, reg_t* out_axes)
+	{
+		if (byteStride == 3 * sizeof(real_t)) {
+			Simd::loadPoints3(
+				reinterpret_cast<const real_t*>(pPoints), out_axes);
+		} else {
+			KDTreeSimdGather<3, real_t>::load(pPoints, byteStride, out_axes);
+		}
+	}
+};
+/// @}
+
+/// Exhaustive SIMD Scan
+/// Finds the closest of numPoints points starting at pPoints, byteStride
+/// bytes apart, without a tree. Registers are loaded from WIDTH consecutive
+/// points and only lanes beating the best distance fall back to scalar
+/// code. Distances are summed in axis order like getDistance2(), so a scan
+/// and a tree agree exactly on every distance.
+template <int DIM, typename point_t>
+bool
+getClosestPointByScan(
+	const char* pPoints,
+	size_t byteStride,
+	size_t numPoints,
+	const point_t& point,
+	BasicKDTreeClosestPoint<point_t>& result)
+{
+	typedef typename point_t::BaseType real_t;
+	typedef KDTreeSimd<real_t> Simd;
+	typedef typename Simd::reg_t reg_t;
+	static const size_t WIDTH = Simd::WIDTH;
+
+	result = BasicKDTreeClosestPoint<point_t>();
+	if (numPoints == 0)
+		return false;
+
+	auto getPoint = [&](size_t idx) -> const point_t& {
+		return *reinterpret_cast<const point_t*>(pPoints + idx * byteStride);
+	};
+
+	reg_t query[DIM];
+	forEachAxis<DIM>([&](int axis) {
+		query[axis] = Simd::set1(point[axis]);
+	});
+
+	size_t idxClosest = 0;
+	reg_t coords[DIM];
+	real_t lanes[WIDTH];
+	size_t idx = 0;
+	for (; idx + WIDTH <= numPoints; idx += WIDTH) {
+		KDTreeSimdPoints<DIM, real_t>::load(
+			pPoints + idx * byteStride, byteStride, coords);
+		reg_t distance2 = Simd::set1(0);
+		forEachAxis<DIM>([&](int axis) {
+			reg_t diff = Simd::sub(query[axis], coords[axis]);
+			distance2 = Simd::add(distance2, Simd::mul(diff, diff));
+		});
+
+		if (Simd::lessThan(distance2, Simd::set1(result.distance2)) == 0)
+			continue;
+		Simd::store(lanes, distance2);
+		for (size_t lane = 0; lane < WIDTH; ++lane) {
+			if (lanes[lane] < result.distance2) {
+				result.distance2 = lanes[lane];
+				idxClosest = idx + lane;
+			}
+		}
+	}
+	for (; idx < numPoints; ++idx) {
+		real_t distance2 = getDistance2<DIM>(point, getPoint(idx));
+		if (distance2 < result.distance2) {
+			result.distance2 = distance2;
+			idxClosest = idx;
+		}
+	}
+
+	result.point = getPoint(idxClosest);
+	return true;
+}
+
+/// Number of queries getClosestPointsTo() traverses together by default,
+/// a whole number of registers of either coordinate type
+#ifdef __AVX2__
+static const size_t KD_TREE_PACKET_SIZE = 8;
+#else
+static const size_t KD_TREE_PACKET_SIZE = 4;
+#endif
+
+/// Coherent Query Packet
+/// Query coordinates are stored per axis so each lane can be compared with a
+/// node's splitting plane using SIMD, and the results are updated in place.
+/// NOTE: SIZE must be a multiple of the lanes in a KDTreeSimd register, lane
+/// masks are ints so at most 16 queries make up a packet
+template <int DIM, typename real_t, size_t SIZE = KD_TREE_PACKET_SIZE>
+struct KDTreeQueryPacket
+{
+	typedef typename KDTreePointTraits<DIM, real_t>::point_t point_t;
+	static_assert(SIZE % KDTreeSimd<real_t>::WIDTH == 0,
+		"packet size must be a multiple of the SIMD width");
+	static_assert(SIZE > 0 && SIZE <= 16, "packet size out of range");
+	static const int ALL_LANES = (1 << SIZE) - 1;
+
+	real_t coords[DIM][SIZE];
+	real_t distance2[SIZE];
+	BasicKDTreeClosestPoint<point_t> results[SIZE];
+	int laneMask;
+};
+
+/// Shared Packet Traversal Stack Entry
+/// bound2 holds each lane's squared distance to the subtree, lanes with a
+/// closer result than that are dropped when the entry is popped.
+template <typename uint_t, typename real_t, size_t SIZE = KD_TREE_PACKET_SIZE>
+struct KDTreePacketStackEntry
+{
+	uint_t idxNode;
+	int laneMask;
+	real_t bound2[SIZE];
+};
+
+/// @{
+/// On-Disk Tree Format
+/// A header, the nodes and the points, each section aligned so a mapped file
+/// can be queried in place. Refit trees add the extents of every node's
+/// children after the points, trees with erased points then add a bit per
+/// point, set for the erased ones. The header records the layout the file was
+/// written with, files from another index width, dimension, coordinate type
+/// or byte order are rejected rather than converted.
+static const char KD_TREE_FILE_MAGIC[8] = { 'K', 'D', 'T', 'R', 'E', 'E', 0, 0 };
+static const uint32_t KD_TREE_FILE_VERSION = 3;
+static const uint32_t KD_TREE_FILE_BYTE_ORDER = 0x01020304;
+static const uint64_t KD_TREE_FILE_ALIGNMENT = 64;
+
+enum KDTreeOpenFlags
+{
+	KD_TREE_OPEN_VERIFY   = 1 << 0, // compare the checksum before use
+	KD_TREE_OPEN_PREFETCH = 1 << 1, // fault in every page up front
+};
+
+enum KDTreeFileFlags
+{
+	KD_TREE_FILE_SPLIT_BOUNDS = 1 << 0, // boundsOffset holds refit extents
+	KD_TREE_FILE_TOMBSTONES   = 1 << 1, // erasedOffset holds erased points
+	KD_TREE_FILE_ALL_FLAGS    = KD_TREE_FILE_SPLIT_BOUNDS 
+		| KD_TREE_FILE_TOMBSTONES,
+};
+
+struct KDTreeFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t headerSize;
+	uint32_t idxBits;
+	uint32_t dim;
+	uint32_t realSize;
+	uint32_t nodeSize;
+	uint32_t flags;
+	uint64_t numNodes;
+	uint64_t numPoints;
+	uint64_t nodesOffset;
+	uint64_t pointsOffset;
+	uint64_t boundsOffset;
+	uint64_t erasedOffset;
+	uint64_t fileSize;
+	uint64_t checksum;
+};
+
+inline uint64_t
+getAlignedFileOffset(uint64_t offset)
+{
+	return (offset + KD_TREE_FILE_ALIGNMENT - 1) & ~(KD_TREE_FILE_ALIGNMENT - 1);
+}
+
+/// Bytes of the tombstone section, bit idx%8 of byte idx/8 is point idx
+inline uint64_t
+getErasedBitsSize(uint64_t numPoints)
+{
+	return (numPoints + 7) / 8;
+}
+
+/// 64 bit FNV-1a over whole words, then the trailing bytes
+inline uint64_t
+getKDTreeChecksum(const char* pData, size_t size, 
+	uint64_t hash = 14695981039346656037ULL)
+{
+	static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+	size_t numWords = size / sizeof(uint64_t);
+	for (size_t idx = 0; idx < numWords; ++idx) {
+		uint64_t word;
+		memcpy(&word, pData + idx * sizeof(uint64_t), sizeof(uint64_t));
+		hash = (hash ^ word) * FNV_PRIME;
+	}
+	for (size_t idx = numWords * sizeof(uint64_t); idx < size; ++idx)
+		hash = (hash ^ static_cast<uint8_t>(pData[idx])) * FNV_PRIME;
+	return hash;
+}
+
+/// Reads and checks the layout independent part of a mapped tree's header
+inline bool
+readKDTreeFileHeader(const MappedFile& file, KDTreeFileHeader& header)
+{
+	if (file.getSize() < sizeof(KDTreeFileHeader))
+		return false;
+	memcpy(&header, file.getData(), sizeof(KDTreeFileHeader));
+
+	return memcmp(header.magic, KD_TREE_FILE_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == KD_TREE_FILE_VERSION
+		&& header.byteOrder == KD_TREE_FILE_BYTE_ORDER
+		&& header.headerSize == sizeof(KDTreeFileHeader)
+		&& (header.flags & ~KD_TREE_FILE_ALL_FLAGS) == 0
+		&& header.fileSize <= file.getSize();
+}
+/// @}
+
+/// Extent of a Refit Node's Children along its Axis
+template <typename real_t>
+struct KDTreeSplitBounds
+{
+	real_t leftMax;
+	real_t rightMin;
+};
+
+/// Mean overlap of refit siblings, relative to their parent's extent, at
+/// which refit() rebuilds the tree instead
+static const double KD_TREE_REFIT_THRESHOLD = 0.1;
+
+/// Erased fraction at which a tree owning its points rebuilds from the rest
+static const double KD_TREE_COMPACTION_THRESHOLD = 0.25;
+
+/// Uninitialised Storage for a Tree's Points and Nodes
+/// Allocated through alloc_t, which may hand out large pages, without 
+/// touching the bytes. The tree constructs its points and nodes in place,
+/// both are trivially destructible so releasing the storage ends them.
+template <typename alloc_t>
+class KDTreeArena : public Uncopyable
+{
+public: // methods
+	KDTreeArena() : m_pData(NULL), m_size(0) {}
+	explicit KDTreeArena(size_t size) 
+		: m_pData(size != 0 ? m_alloc.allocate(size) : NULL)
+		, m_size(size)
+	{
+	}
+	~KDTreeArena()
+	{
+		if (m_pData != NULL)
+			m_alloc.deallocate(m_pData, m_size);
+	}
+
+	bool	empty() const { return m_size == 0; }
+	size_t	size()  const { return m_size; }
+	char*	data()        { return m_pData; }
+
+	void swap(KDTreeArena& other)
+	{
+		std::swap(m_alloc, other.m_alloc);
+		std::swap(m_pData, other.m_pData);
+		std::swap(m_size, other.m_size);
+	}
+
+private: // members
+	alloc_t m_alloc;
+	char* m_pData;
+	size_t m_size;
+};
+
+/// Build and Closest Point Walk Shared by the Trees
+/// tree_t derives from this privately, befriends it and reaches its nodes
+/// and points through getNode(idxNode), getCoord(idxPoint, axis),
+/// getIdxPointAt(idxOrder), chooseSplitAxis(idxBegin, idxEnd),
+/// partitionAroundMedian(idxBegin, idxEnd, axis), addNode(node),
+/// updateClosestPoint(idxNode, point, result), isSubtreeErased(idxNode) and
+/// getDistanceToSide2(node, idxSide, point). Trees of static and runtime
+/// dimension thus build and search the same way.
+template <typename tree_t, typename uint_t>
+class KDTreeTraversal
+{
+protected: // methods
+	uint_t buildTree(uint_t idxBegin, uint_t idxEnd);
+
+	template <typename query_t>
+	uint_t getIdxNextNode(const KDTreeNode<uint_t>& node,
+		const query_t& point) const;
+	template <typename query_t>
+	void walkToLeafNode(vector<uint_t>& nodeIdxStack,
+		const query_t& point) const;
+	template <typename query_t, typename result_t>
+	void searchSubtree(vector<uint_t>& nodeIdxStack, const query_t& point,
+		result_t& result) const;
+
+private: // methods
+	tree_t& getTree() { return static_cast<tree_t&>(*this); }
+	const tree_t& getTree() const 
+		{ return static_cast<const tree_t&>(*this); }
+};
+
+/// Statically Typed KD Tree
+/// All queries are resolved at compile time against the index type,
+/// dimension and coordinate type, so they can inline into the caller.
+/// 2D, 3D and 4D trees use Imath vectors, other dimensions up to
+/// KD_TREE_MAX_DIM use KDTreeVec. See BasicDynamicPointKDTree for a
+/// dimension chosen at runtime. Owned nodes and points are allocated
+/// through alloc_t, rebound to each element type, e.g.
+/// KDTreeLargePageAllocator to back big trees with large pages.
+template <typename uint_t, int DIM = 3, typename real_t = fpreal,
+	typename alloc_t = allocator<char> >
+class BasicPointKDTree : public Uncopyable,
+	private KDTreeTraversal<BasicPointKDTree<uint_t, DIM, real_t, alloc_t>,
+		uint_t>
+{
+public: // types
+	typedef KDTreeTraversal<BasicPointKDTree, uint_t> Traversal;
+	typedef typename KDTreePointTraits<DIM, real_t>::point_t point_t;
+	typedef BasicKDTreeClosestPoint<point_t> ClosestPoint;
+	typedef typename alloc_t::template rebind<KDTreeNode<uint_t> >::other
+		node_alloc_t;
+	typedef typename alloc_t::template rebind<point_t>::other point_alloc_t;
+	typedef vector<KDTreeNode<uint_t>, node_alloc_t> KDTreeNodeList;
+	typedef vector<point_t, point_alloc_t> PointList;
+	typedef typename alloc_t::template rebind<uint_t>::other idx_alloc_t;
+	typedef vector<uint_t, idx_alloc_t> IdxList;
+	typedef typename alloc_t::template rebind<char>::other arena_alloc_t;
+	typedef KDTreeArena<arena_alloc_t> Arena;
+	typedef KDTreeSimd<real_t> Simd;
+
+public: // static members
+	static const uint_t IDX_NONE = InvalidIndex<uint_t>::value;
+
+public: // methods
+	// Copies the points into one block sized up front for them and their
+	// nodes, and partitions them there. Nothing else is allocated, so the
+	// build peaks at the tree's final size.
+	BasicPointKDTree(const vector<point_t>& arrPoints);
+	BasicPointKDTree(vector<point_t>&& arrPoints);
+
+	// Indexes numPoints external points without copying them. Point i has
+	// its DIM coordinates at (const char*)pCoords + i*byteStride, so the
+	// points may be interleaved with other vertex attributes. The buffer is
+	// left untouched and must outlive the tree.
+	BasicPointKDTree(const real_t* pCoords, size_t byteStride,
+		size_t numPoints);
+
+	size_t getNumPoints() const { return m_numPoints; }
+	const point_t& getPoint(size_t idxPoint) const;
+
+	// Nodes in post-order, the root is the last node
+	size_t getNumNodes() const { return m_numNodes; }
+	const KDTreeNode<uint_t>& getNode(size_t idxNode) const
+		{ assert(idxNode < m_numNodes); return m_pNodes[idxNode]; }
+
+	using Traversal::buildTree;
+	bool isBalanced() const;
+
+	// Tombstones the points inside the box, from then on queries skip them
+	// and subtrees without live points. Once the erased fraction passes the
+	// compaction threshold a tree owning its points is rebuilt from the
+	// live ones, which renumbers points and nodes. save() writes the
+	// tombstones along. Returns the number of points erased.
+	size_t eraseInBox(const point_t& boxMin, const point_t& boxMax);
+	size_t getNumLivePoints() const { return m_numPoints - m_numErased; }
+	bool isErased(size_t idxPoint) const
+		{ return m_numErased != 0 && m_arrErased[idxPoint]; }
+	void setCompactionThreshold(double fraction)
+		{ m_compactionThreshold = fraction; }
+	bool compact();
+
+	// Keeps the topology after points moved and only updates the extent of
+	// every node's children, bottom-up and in parallel. Queries then prune
+	// by those extents. Trees over external points re-read their buffer,
+	// refit(arrPositions) replaces owned points by the positions at their
+	// construction indices. Once siblings overlap by more than the refit
+	// threshold on average the tree is rebuilt. Returns false for mapped
+	// trees, which cannot move.
+	bool refit();
+	bool refit(const point_t* arrPositions);
+
+	// Index an owned point had in the array the tree was constructed from,
+	// kept through rebuilds and compaction. Merged trees number their
+	// points in getPoint() order. External and mapped points keep their
+	// index anyway.
+	size_t getIdxInputPoint(size_t idxPoint) const
+		{ return m_pInputOrder != NULL ? 
+			static_cast<size_t>(m_pInputOrder[idxPoint]) : idxPoint; }
+	void setRefitThreshold(double overlap) { m_refitThreshold = overlap; }
+	double getRefitOverlap() const { return m_refitOverlap; }
+
+	// Combines two trees into one owning copies of their live points. If
+	// the trees overlap along some axis by at most the refit threshold of
+	// their joint extent, both are grafted under a new root and keep their
+	// partitions, queries then prune by child extents as after refit().
+	// Otherwise, or if either tree has erased points, the result is built
+	// from scratch.
+	template <typename uint_a_t, typename uint_b_t>
+	static unique_ptr<BasicPointKDTree> merge(
+		const BasicPointKDTree<uint_a_t, DIM, real_t, alloc_t>& a,
+		const BasicPointKDTree<uint_b_t, DIM, real_t, alloc_t>& b);
+
+	bool getClosestPointTo(const point_t& point, ClosestPoint& result) const;
+	bool getClosestPointTo(const point_t& point, const ClosestPoint& hint,
+		ClosestPoint& result) const;
+	bool getClosestPointsTo(const point_t* arrQueries, size_t numQueries,
+		ClosestPoint* arrResults) const;
+	// As above, traversing SIZE queries at a time
+	template <size_t SIZE>
+	bool getClosestPointsTo(const point_t* arrQueries, size_t numQueries,
+		ClosestPoint* arrResults) const;
+	void dump(ostream& out = cerr) const;
+
+	// Writes the tree to path in the on-disk format, see open(). Refit
+	// extents and tombstones are kept, so the opened tree has this tree's
+	// point and node indices and results of either serve as hints to the
+	// other. Call compact() first to leave erased points out of the file.
+	bool save(const string& path) const;
+
+	// Maps a tree written by save() and queries it in place, nothing is 
+	// rebuilt or copied. Tombstones are unpacked, a bit and a live count
+	// per point. Returns NULL if the file is missing or was written by a
+	// tree of another type. flags is a combination of KDTreeOpenFlags.
+	static unique_ptr<BasicPointKDTree> open(const string& path,
+		int flags = 0);
+	static unique_ptr<BasicPointKDTree> open(
+		const shared_ptr<MappedFile>& pFile, int flags = 0);
+
+	// The bytes save() writes, for placing a tree in other storage such as
+	// a shared memory segment. All offsets are relative to the image start.
+	size_t getImageSize() const;
+	void writeImage(char* pImage) const;
+
+private: // methods
+	template <typename, int, typename, typename>
+	friend class BasicPointKDTree;
+
+	BasicPointKDTree(const shared_ptr<MappedFile>& pFile,
+		const KDTreeFileHeader& header);
+	BasicPointKDTree(PointList&& arrPoints, KDTreeNodeList&& arrNodes);
+
+	static void takePoints(vector<point_t>& arrFrom, vector<point_t>& arrTo);
+	template <typename list_t>
+	static void takePoints(vector<point_t>& arrFrom, list_t& arrTo);
+
+	template <typename uint_src_t>
+	static uint_t convertIdx(uint_src_t idx, size_t offset);
+	template <typename uint_src_t>
+	static void appendLivePoints(
+		const BasicPointKDTree<uint_src_t, DIM, real_t, alloc_t>& tree,
+		PointList& arrPoints);
+	template <typename uint_src_t>
+	static void appendNodes(
+		const BasicPointKDTree<uint_src_t, DIM, real_t, alloc_t>& tree,
+		size_t idxFirstNode, size_t pointOffset, KDTreeNodeList& arrNodes);
+	template <typename uint_low_t, typename uint_high_t>
+	static unique_ptr<BasicPointKDTree> graft(
+		const BasicPointKDTree<uint_low_t, DIM, real_t, alloc_t>& low,
+		const BasicPointKDTree<uint_high_t, DIM, real_t, alloc_t>& high,
+		int axis);
+	void getBounds(point_t& out_min, point_t& out_max) const;
+
+	void init();
+	point_t* allocateArena();
+	size_t getArenaNodesOffset() const;
+	KDTreeNode<uint_t>* getArenaNodes();
+	uint_t* getArenaInputOrder();
+	void numberInputOrder();
+	point_t* getOwnedPoints();
+	uint_t addNode(const KDTreeNode<uint_t>& node);
+	void initFileHeader(KDTreeFileHeader& header) const;
+	void getErasedBits(vector<uint8_t>& out_bits) const;
+	uint64_t getChecksum() const;
+	template <typename write_t>
+	void writeSections(write_t write) const;
+
+	uint_t getIdxPointAt(uint_t idxOrder) const;
+	bool isSubtreeErased(uint_t idxNode) const
+		{ return m_numErased != 0 
+			&& m_arrLiveCounts[static_cast<size_t>(idxNode)] == 0; }
+	void updateLiveCounts();
+	void rebuild();
+	void refitNodes(size_t idxBegin, size_t idxEnd, point_t* arrMins,
+		point_t* arrMaxs, double& out_overlap, size_t& out_numSplits);
+	uint_t getIdxFirstNode(uint_t idxNode) const;
+	int chooseSplitAxis(uint_t idxBegin, uint_t idxEnd) const;
+
+	friend class KDTreeTraversal<BasicPointKDTree, uint_t>;
+	using Traversal::getIdxNextNode;
+	using Traversal::walkToLeafNode;
+	using Traversal::searchSubtree;
+
+	void initClosestPointStack(vector<uint_t>& nodeIdxStack) const;
+	const KDTreeNode<uint_t>* getRootNode() const;
+	uint_t getIdxRootNode() const;
+	const KDTreeNode<uint_t>& getCurrentNode(
+		vector<uint_t>& nodeIdxStack) const;
+	real_t getCoord(uint_t idxPoint, int axis) const
+		{ return getPoint(static_cast<size_t>(idxPoint))[axis]; }
+	bool updateClosestPoint(
+		vector<uint_t>& nodeIdxStack,
+		const point_t& point,
+		ClosestPoint& result) const;
+	bool updateClosestPoint(
+		uint_t idxNode,
+		const point_t& point,
+		ClosestPoint& result) const;
+	bool getPathToNode(uint_t idxNode, vector<uint_t>& nodeIdxPath) const;
+	real_t getDistanceToSide2(const KDTreeNode<uint_t>& node, uint_t idxSide,
+		const point_t& point) const;
+
+	template <size_t SIZE>
+	void searchPacket(KDTreeQueryPacket<DIM, real_t, SIZE>& packet) const;
+	template <size_t SIZE>
+	void searchSubtreeForLane(uint_t idxNode, size_t lane,
+		KDTreeQueryPacket<DIM, real_t, SIZE>& packet) const;
+	template <size_t SIZE>
+	void updateClosestPointPacket(const KDTreeNode<uint_t>& node,
+		int laneMask, KDTreeQueryPacket<DIM, real_t, SIZE>& packet) const;
+	template <size_t SIZE>
+	int getPacketLeftMask(const KDTreeNode<uint_t>& node,
+		const KDTreeQueryPacket<DIM, real_t, SIZE>& packet,
+		real_t* out_plane2) const;
+
+	uint_t partitionAroundMedian(uint_t idxBegin, uint_t idxEnd, int axis);
+	void selectOwnedPoint(size_t idxBegin, size_t idxNth, size_t idxEnd,
+		int axis);
+
+private: // members
+	// Nodes built by this tree, queries read nodes through m_pNodes which
+	// may instead point into a mapped file
+	KDTreeNodeList m_arrNodes;
+	const KDTreeNode<uint_t>* m_pNodes;
+	size_t m_numNodes;
+
+	// Owned points are partitioned in place, external points are reached
+	// through m_arrOrder while building and nodes index them directly
+	PointList m_arrPoints;
+	vector<uint_t> m_arrOrder;
+
+	// Construction index of every owned point in getPoint() order, swapped
+	// along while partitioning. m_pInputOrder points into m_arrInputOrder
+	// or the arena and is NULL for external and mapped points.
+	IdxList m_arrInputOrder;
+	uint_t* m_pInputOrder;
+
+	// Points copied in, followed by one node and one construction index
+	// per point. Used instead of m_arrNodes, m_arrPoints and
+	// m_arrInputOrder when not empty.
+	Arena m_arena;
+
+	// Point storage seen by queries, owned or external
+	const char* m_pPoints;
+	size_t m_pointStride;
+	size_t m_numPoints;
+
+	// Tombstones per point and live points per subtree, allocated by the
+	// first erase
+	vector<bool> m_arrErased;
+	vector<uint_t> m_arrLiveCounts;
+	size_t m_numErased;
+	double m_compactionThreshold;
+
+	// Children extents of a refit tree, empty until the first refit().
+	// Queries read them through m_pSplitBounds, which may instead point 
+	// into a mapped file and is NULL for trees that were never refit.
+	vector<KDTreeSplitBounds<real_t> > m_arrSplitBounds;
+	const KDTreeSplitBounds<real_t>* m_pSplitBounds;
+	double m_refitThreshold;
+	double m_refitOverlap;
+
+	// Keeps the storage of an opened tree mapped
+	shared_ptr<MappedFile> m_pFile;
+};
+
+#define KD_TREE_TEMPLATE \
+	template <typename uint_t, int DIM, typename real_t, typename alloc_t>
+#define KD_TREE_CLASS BasicPointKDTree<uint_t, DIM, real_t, alloc_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// KDTreeNode Methods
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename uint_t>
+KDTreeNode<uint_t>::KDTreeNode(
+	uint_t idxPoint,
+	uint_t idxLeft,
+	uint_t idxRight,
+	int axis)
+	: m_idxPoint(idxPoint)
+	, m_idxLeft(idxLeft)
+	, m_idxRight(idxRight)
+	, m_axis(static_cast<uint8_t>(axis))
+{
+	assert(m_idxPoint != InvalidIndex<uint_t>::value);
+	assert(axis >= 0 && axis <= UINT8_MAX);
+}
+
+template <typename uint_t>
+static string
+getIdxString(uint_t idx)
+{
+	if (idx == InvalidIndex<uint_t>::value)
+		return "NONE";
+
+	stringstream ss;
+	ss << static_cast<size_t>(idx);
+	return ss.str();
+}
+
+template <typename uint_t>
+void
+KDTreeNode<uint_t>::dumpAxis(ostream& out) const
+{
+	switch (m_axis) {
+	case X_AXIS: out << "X AXIS"; break;
+	case Y_AXIS: out << "Y AXIS"; break;
+	case Z_AXIS: out << "Z AXIS"; break;
+	default: out << "AXIS " << static_cast<int>(m_axis); break;
+	}
+}
+
+template <typename uint_t>
+template <typename point_t>
+void
+KDTreeNode<uint_t>::dump(const point_t& nodePoint, ostream& out) const
+{
+	dumpAxis(out);
+	size_t idxPoint = static_cast<size_t>(m_idxPoint);
+	out << ", POINT " << idxPoint << ": " << nodePoint << "\n";
+	out << "  CHILDREN: " << getIdxString(m_idxLeft) << " "
+		<< getIdxString(m_idxRight) << "\n";
+}
+
+template <typename uint_t>
+static inline uint_t
+getChildSize(
+	const KDTreeNode<uint_t>* arrNodes,
+	uint_t idx)
+{
+	size_t idxNode = static_cast<size_t>(idx);
+	return (idx == InvalidIndex<uint_t>::value) ?
+		0 : arrNodes[idxNode].getSize(arrNodes);
+}
+
+template <typename uint_t>
+static inline bool
+sizesAreBalanced(uint_t leftSize, uint_t rightSize)
+{
+	return leftSize <= rightSize+1 && rightSize <= leftSize+1;
+}
+
+template <typename uint_t>
+static inline bool
+subtreeIsBalanced(
+	uint_t size,
+	uint_t idx,
+	const KDTreeNode<uint_t>* arrNodes)
+{
+	size_t idxNode = static_cast<size_t>(idx);
+	return (size == 0) ? true : arrNodes[idxNode].isBalanced(arrNodes);
+}
+
+template <typename uint_t>
+bool
+KDTreeNode<uint_t>::isBalanced(const KDTreeNode<uint_t>* arrNodes) const
+{
+	uint_t leftSize = getChildSize(arrNodes, m_idxLeft);
+	uint_t rightSize = getChildSize(arrNodes, m_idxRight);
+	if (!sizesAreBalanced(leftSize, rightSize))
+		return false;
+
+	return subtreeIsBalanced(leftSize, m_idxLeft, arrNodes)
+		&& subtreeIsBalanced(rightSize, m_idxRight, arrNodes);
+}
+
+template <typename uint_t>
+uint_t
+KDTreeNode<uint_t>::getSize(const KDTreeNode<uint_t>* arrNodes) const
+{
+	return 1 + getChildSize(arrNodes, m_idxLeft)
+		+ getChildSize(arrNodes, m_idxRight);
+}
+
+template <typename uint_t>
+static inline bool
+isLeafNode(const KDTreeNode<uint_t>& node)
+{
+	return node.getIdxLeft() == InvalidIndex<uint_t>::value
+		&& node.getIdxRight() == InvalidIndex<uint_t>::value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// KDTreeTraversal Methods
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename uint_t>
+static inline void
+pop(uint_t& idxLastNode, vector<uint_t>& nodeIdxStack)
+{
+	assert(!nodeIdxStack.empty());
+	idxLastNode = nodeIdxStack.back();
+	nodeIdxStack.pop_back();
+}
+
+template <typename uint_t>
+static uint_t
+getIdxOppositeSide(uint_t idxLastNode, const KDTreeNode<uint_t>& node)
+{
+	assert(idxLastNode != InvalidIndex<uint_t>::value);
+	uint_t idxLeft = node.getIdxLeft();
+	uint_t idxRight = node.getIdxRight();
+	assert(idxLastNode == idxLeft || idxLastNode == idxRight);
+	return (idxLastNode == idxLeft) ? idxRight : idxLeft;
+}
+
+template <typename tree_t, typename uint_t>
+uint_t
+KDTreeTraversal<tree_t, uint_t>::buildTree(
+	uint_t idxPtBegin,
+	uint_t idxPtEnd)
+{
+	if (idxPtBegin >= idxPtEnd)
+		return InvalidIndex<uint_t>::value;
+
+	tree_t& tree = getTree();
+	int axis = tree.chooseSplitAxis(idxPtBegin, idxPtEnd);
+
+	// Build Leaf Node
+	uint_t size = idxPtEnd - idxPtBegin;
+	if (size == 1) {
+		return tree.addNode(KDTreeNode<uint_t>(tree.getIdxPointAt(idxPtBegin),
+			InvalidIndex<uint_t>::value, InvalidIndex<uint_t>::value, axis));
+	}
+
+	// Recurse
+	uint_t idxPtMedian = tree.partitionAroundMedian(idxPtBegin, idxPtEnd, axis);
+	uint_t idxNodeLeft = buildTree(idxPtBegin, idxPtMedian);
+	uint_t idxNodeRight = buildTree(idxPtMedian+1, idxPtEnd);
+
+	// Build Internal Node
+	return tree.addNode(KDTreeNode<uint_t>(
+		tree.getIdxPointAt(idxPtMedian), idxNodeLeft, idxNodeRight, axis));
+}
+
+template <typename tree_t, typename uint_t>
+template <typename query_t>
+uint_t
+KDTreeTraversal<tree_t, uint_t>::getIdxNextNode(
+	const KDTreeNode<uint_t>& node,
+	const query_t& point) const
+{
+	assert(!isLeafNode(node));
+	uint_t idxLeft = node.getIdxLeft();
+	uint_t idxRight = node.getIdxRight();
+
+	if (idxLeft == InvalidIndex<uint_t>::value)
+		return idxRight;
+	if (idxRight == InvalidIndex<uint_t>::value)
+		return idxLeft;
+
+	int axis = node.getAxis();
+	return (point[axis] <= getTree().getCoord(node.getIdxPoint(), axis)) ?
+		idxLeft : idxRight;
+}
+
+template <typename tree_t, typename uint_t>
+template <typename query_t>
+void
+KDTreeTraversal<tree_t, uint_t>::walkToLeafNode(
+	vector<uint_t>& nodeIdxStack,
+	const query_t& point) const
+{
+	for (;;) {
+		const KDTreeNode<uint_t>& node = 
+			getTree().getNode(static_cast<size_t>(nodeIdxStack.back()));
+		if (isLeafNode(node))
+			return;
+		nodeIdxStack.push_back(getIdxNextNode(node, point));
+	}
+}
+
+template <typename tree_t, typename uint_t>
+template <typename query_t, typename result_t>
+void
+KDTreeTraversal<tree_t, uint_t>::searchSubtree(
+	vector<uint_t>& nodeIdxStack,
+	const query_t& point,
+	result_t& result) const
+{
+	const tree_t& tree = getTree();
+	assert(!nodeIdxStack.empty());
+	size_t stackBase = nodeIdxStack.size() - 1;
+	walkToLeafNode(nodeIdxStack, point);
+	tree.updateClosestPoint(nodeIdxStack.back(), point, result);
+
+	uint_t idxLastNode = InvalidIndex<uint_t>::value;
+	pop(idxLastNode, nodeIdxStack);
+	while (nodeIdxStack.size() > stackBase) {
+		// Coming back up from the far side means both sides are done
+		uint_t idxNode = nodeIdxStack.back();
+		const KDTreeNode<uint_t>& node = 
+			tree.getNode(static_cast<size_t>(idxNode));
+		if (idxLastNode != getIdxNextNode(node, point)) {
+			pop(idxLastNode, nodeIdxStack);
+			continue;
+		}
+
+		tree.updateClosestPoint(idxNode, point, result);
+		uint_t idxOppositeSide = getIdxOppositeSide(idxLastNode, node);
+		if (idxOppositeSide == InvalidIndex<uint_t>::value 
+			|| tree.isSubtreeErased(idxOppositeSide)
+			|| tree.getDistanceToSide2(node, idxOppositeSide, point)
+				>= result.distance2) {
+			pop(idxLastNode, nodeIdxStack);
+			continue;
+		}
+
+		nodeIdxStack.push_back(idxOppositeSide);
+		walkToLeafNode(nodeIdxStack, point);
+		tree.updateClosestPoint(nodeIdxStack.back(), point, result);
+		pop(idxLastNode, nodeIdxStack);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicPointKDTree(
+	const vector<point_t>& arrPoints)
+	: m_pNodes(NULL)
+	, m_numNodes(0)
+	, m_pInputOrder(NULL)
+	, m_pPoints(NULL)
+	, m_pointStride(sizeof(point_t))
+	, m_numPoints(arrPoints.size())
+	, m_numErased(0)
+	, m_compactionThreshold(KD_TREE_COMPACTION_THRESHOLD)
+	, m_pSplitBounds(NULL)
+	, m_refitThreshold(KD_TREE_REFIT_THRESHOLD)
+	, m_refitOverlap(0)
+{
+	uninitialized_copy(begin(arrPoints), end(arrPoints), allocateArena());
+	numberInputOrder();
+	init();
+}
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicPointKDTree(
+	vector<point_t>&& arrPoints)
+	: m_pNodes(NULL)
+	, m_numNodes(0)
+	, m_pInputOrder(NULL)
+	, m_pPoints(NULL)
+	, m_pointStride(sizeof(point_t))
+	, m_numPoints(arrPoints.size())
+	, m_numErased(0)
+	, m_compactionThreshold(KD_TREE_COMPACTION_THRESHOLD)
+	, m_pSplitBounds(NULL)
+	, m_refitThreshold(KD_TREE_REFIT_THRESHOLD)
+	, m_refitOverlap(0)
+{
+	takePoints(arrPoints, m_arrPoints);
+	numberInputOrder();
+	init();
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::takePoints(vector<point_t>& arrFrom, vector<point_t>& arrTo)
+{
+	arrTo.swap(arrFrom);
+}
+
+KD_TREE_TEMPLATE
+template <typename list_t>
+void
+KD_TREE_CLASS::takePoints(vector<point_t>& arrFrom, list_t& arrTo)
+{
+	// Storage from another allocator cannot be adopted, only copied
+	arrTo.assign(begin(arrFrom), end(arrFrom));
+	vector<point_t>().swap(arrFrom);
+}
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicPointKDTree(
+	const real_t* pCoords,
+	size_t byteStride,
+	size_t numPoints)
+	: m_pNodes(NULL)
+	, m_numNodes(0)
+	, m_pInputOrder(NULL)
+	, m_pPoints(reinterpret_cast<const char*>(pCoords))
+	, m_pointStride(byteStride)
+	, m_numPoints(numPoints)
+	, m_numErased(0)
+	, m_compactionThreshold(KD_TREE_COMPACTION_THRESHOLD)
+	, m_pSplitBounds(NULL)
+	, m_refitThreshold(KD_TREE_REFIT_THRESHOLD)
+	, m_refitOverlap(0)
+{
+	static_assert(sizeof(point_t) == DIM * sizeof(real_t),
+		"points must be laid out as DIM packed coordinates");
+	assert(byteStride >= sizeof(point_t) || numPoints <= 1);
+	assert(pCoords != NULL || numPoints == 0);
+
+	rebuild();
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::init()
+{
+	if (const point_t* pPoints = getOwnedPoints()) {
+		m_pPoints = reinterpret_cast<const char*>(pPoints);
+		m_pInputOrder = m_arena.empty() ? 
+			&m_arrInputOrder[0] : getArenaInputOrder();
+	}
+
+	uint_t numPoints = static_cast<uint_t>(m_numPoints);
+	if (m_arena.empty())
+		m_arrNodes.reserve(m_numPoints);
+	m_numNodes = 0;
+	buildTree(0, numPoints);
+
+	if (!m_arena.empty()) {
+		m_pNodes = getArenaNodes();
+		return;
+	}
+	m_pNodes = m_arrNodes.empty() ? NULL : &m_arrNodes[0];
+	m_numNodes = m_arrNodes.size();
+}
+
+KD_TREE_TEMPLATE
+typename KD_TREE_CLASS::point_t*
+KD_TREE_CLASS::allocateArena()
+{
+	// Every point heads exactly one node, so the node count is known before
+	// building. The storage is left uninitialised, the caller constructs
+	// the points and construction indices and addNode() the nodes.
+	static_assert(is_trivially_destructible<point_t>::value
+		&& is_trivially_destructible<KDTreeNode<uint_t> >::value,
+		"arena objects are never destroyed");
+	size_t tailSize = m_numPoints 
+		* (sizeof(KDTreeNode<uint_t>) + sizeof(uint_t));
+	Arena(m_numPoints != 0 ? getArenaNodesOffset() + tailSize : 0)
+		.swap(m_arena);
+	return reinterpret_cast<point_t*>(m_arena.data());
+}
+
+KD_TREE_TEMPLATE
+size_t
+KD_TREE_CLASS::getArenaNodesOffset() const
+{
+	// The allocator aligns the arena for any fundamental type, so nodes 
+	// only need an offset aligned for them
+	static const size_t NODE_ALIGNMENT = 
+		alignment_of<KDTreeNode<uint_t> >::value;
+	return (m_numPoints * sizeof(point_t) + NODE_ALIGNMENT - 1) 
+		/ NODE_ALIGNMENT * NODE_ALIGNMENT;
+}
+
+KD_TREE_TEMPLATE
+KDTreeNode<uint_t>*
+KD_TREE_CLASS::getArenaNodes()
+{
+	assert(!m_arena.empty());
+	return reinterpret_cast<KDTreeNode<uint_t>*>(
+		m_arena.data() + getArenaNodesOffset());
+}
+
+KD_TREE_TEMPLATE
+uint_t*
+KD_TREE_CLASS::getArenaInputOrder()
+{
+	// Nodes hold uint_t members, so indices need no padding after them
+	assert(!m_arena.empty());
+	return reinterpret_cast<uint_t*>(m_arena.data() + getArenaNodesOffset()
+		+ m_numPoints * sizeof(KDTreeNode<uint_t>));
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::numberInputOrder()
+{
+	// Owned points start out in construction order
+	if (m_numPoints == 0)
+		return;
+	if (m_arena.empty()) {
+		m_arrInputOrder.resize(m_numPoints);
+		m_pInputOrder = &m_arrInputOrder[0];
+	} else {
+		m_pInputOrder = getArenaInputOrder();
+	}
+	for (size_t idx = 0; idx < m_numPoints; ++idx)
+		m_pInputOrder[idx] = static_cast<uint_t>(idx);
+}
+
+KD_TREE_TEMPLATE
+typename KD_TREE_CLASS::point_t*
+KD_TREE_CLASS::getOwnedPoints()
+{
+	// NULL for external, mapped and empty trees
+	if (!m_arena.empty())
+		return reinterpret_cast<point_t*>(m_arena.data());
+	if (!m_arrPoints.empty() && m_arrPoints.size() == m_numPoints)
+		return &m_arrPoints[0];
+	return NULL;
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::addNode(const KDTreeNode<uint_t>& node)
+{
+	if (m_arena.empty()) {
+		m_arrNodes.push_back(node);
+		return static_cast<uint_t>(m_arrNodes.size()-1);
+	}
+
+	assert(m_numNodes < m_numPoints);
+	new (getArenaNodes() + m_numNodes) KDTreeNode<uint_t>(node);
+	return static_cast<uint_t>(m_numNodes++);
+}
+
+KD_TREE_TEMPLATE
+const typename KD_TREE_CLASS::point_t&
+KD_TREE_CLASS::getPoint(size_t idxPoint) const
+{
+	assert(idxPoint < m_numPoints);
+	return *reinterpret_cast<const point_t*>(
+		m_pPoints + idxPoint * m_pointStride);
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::getIdxPointAt(uint_t idxOrder) const
+{
+	return m_arrOrder.empty() ? 
+		idxOrder : m_arrOrder[static_cast<size_t>(idxOrder)];
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::partitionAroundMedian(
+	uint_t idxBegin,
+	uint_t idxEnd,
+	int axis)
+{
+	uint_t halfSize = (idxEnd - idxBegin) / 2;
+	uint_t idxMedian = idxBegin + halfSize;
+
+	if (m_arrOrder.empty()) {
+		selectOwnedPoint(static_cast<size_t>(idxBegin), 
+			static_cast<size_t>(idxMedian), static_cast<size_t>(idxEnd), axis);
+	} else {
+		auto itGlobalBegin = begin(m_arrOrder);
+		auto itBegin = itGlobalBegin + static_cast<size_t>(idxBegin);
+		auto itMedian = itGlobalBegin + static_cast<size_t>(idxMedian);
+		auto itEnd = itGlobalBegin + static_cast<size_t>(idxEnd);
+		nth_element(itBegin, itMedian, itEnd,
+			[=](uint_t lhs, uint_t rhs) -> bool {
+			return getPoint(static_cast<size_t>(lhs))[axis] 
+				< getPoint(static_cast<size_t>(rhs))[axis];
+		});
+	}
+
+	return idxMedian;
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::selectOwnedPoint(
+	size_t idxBegin,
+	size_t idxNth,
+	size_t idxEnd,
+	int axis)
+{
+	// nth_element() cannot swap the construction indices along, so this is
+	// a quickselect around the median of three that does. Ranges which 
+	// keep splitting badly are finished through a permutation instead.
+	static const size_t MAX_SORTED_SIZE = 8;
+	point_t* pPoints = getOwnedPoints();
+	auto coordAt = [&](size_t idx) -> real_t { return pPoints[idx][axis]; };
+	auto swapPoints = [&](size_t lhs, size_t rhs) {
+		swap(pPoints[lhs], pPoints[rhs]);
+		swap(m_pInputOrder[lhs], m_pInputOrder[rhs]);
+	};
+
+	size_t numSplitsLeft = 0;
+	for (size_t size = idxEnd - idxBegin; size > 1; size >>= 1)
+		numSplitsLeft += 2;
+	while (idxEnd - idxBegin > MAX_SORTED_SIZE) {
+		if (numSplitsLeft-- == 0) {
+			vector<size_t> arrOrder(idxEnd - idxBegin);
+			for (size_t idx = 0; idx < arrOrder.size(); ++idx)
+				arrOrder[idx] = idxBegin + idx;
+			nth_element(begin(arrOrder), begin(arrOrder) + (idxNth - idxBegin),
+				end(arrOrder), [&](size_t lhs, size_t rhs) -> bool {
+				return coordAt(lhs) < coordAt(rhs);
+			});
+			vector<point_t> arrPoints(arrOrder.size());
+			vector<uint_t> arrInputOrder(arrOrder.size());
+			for (size_t idx = 0; idx < arrOrder.size(); ++idx) {
+				arrPoints[idx] = pPoints[arrOrder[idx]];
+				arrInputOrder[idx] = m_pInputOrder[arrOrder[idx]];
+			}
+			copy(begin(arrPoints), end(arrPoints), pPoints + idxBegin);
+			copy(begin(arrInputOrder), end(arrInputOrder), 
+				m_pInputOrder + idxBegin);
+			return;
+		}
+
+		// The median of the first, middle and last point is the pivot and
+		// moves to the front, every scan then stops inside the range
+		size_t idxMiddle = idxBegin + (idxEnd - idxBegin) / 2;
+		size_t idxLast = idxEnd - 1;
+		if (coordAt(idxMiddle) < coordAt(idxBegin))
+			swapPoints(idxMiddle, idxBegin);
+		if (coordAt(idxLast) < coordAt(idxMiddle)) {
+			swapPoints(idxLast, idxMiddle);
+			if (coordAt(idxMiddle) < coordAt(idxBegin))
+				swapPoints(idxMiddle, idxBegin);
+		}
+		swapPoints(idxBegin, idxMiddle);
+		real_t pivot = coordAt(idxBegin);
+
+		// Hoare partition, points up to idxHigh are at most the pivot and
+		// the ones after it at least
+		size_t idxLow = idxBegin;
+		size_t idxHigh = idxEnd;
+		for (;;) {
+			while (coordAt(idxLow) < pivot)
+				++idxLow;
+			while (pivot < coordAt(--idxHigh))
+				;
+			if (idxLow >= idxHigh)
+				break;
+			swapPoints(idxLow++, idxHigh);
+		}
+		if (idxNth <= idxHigh)
+			idxEnd = idxHigh + 1;
+		else
+			idxBegin = idxHigh + 1;
+	}
+
+	for (size_t idx = idxBegin + 1; idx < idxEnd; ++idx) {
+		for (size_t idxSwap = idx; idxSwap > idxBegin 
+			&& coordAt(idxSwap) < coordAt(idxSwap - 1); --idxSwap)
+		{
+			swapPoints(idxSwap, idxSwap - 1);
+		}
+	}
+}
+
+KD_TREE_TEMPLATE
+int
+KD_TREE_CLASS::chooseSplitAxis(
+	uint_t idxBegin,
+	uint_t idxEnd) const
+{
+	assert(idxBegin < idxEnd);
+
+	if (idxBegin+1 == idxEnd)
+		return X_AXIS;
+
+	point_t boundsMin = getPoint(getIdxPointAt(idxBegin));
+	point_t boundsMax = boundsMin;
+
+	for (uint_t idx = idxBegin+1; idx < idxEnd; ++idx) {
+		const point_t& point = getPoint(getIdxPointAt(idx));
+		forEachAxis<DIM>([&](int axis) {
+			boundsMin[axis] = min<real_t>(point[axis], boundsMin[axis]);
+			boundsMax[axis] = max<real_t>(point[axis], boundsMax[axis]);
+		});
+	}
+
+	// Split the widest axis, ties go to the lowest axis
+	int splitAxis = X_AXIS;
+	real_t splitSize = boundsMax[X_AXIS] - boundsMin[X_AXIS];
+	forEachAxis<DIM>([&](int axis) {
+		real_t size = boundsMax[axis] - boundsMin[axis];
+		if (size > splitSize) {
+			splitAxis = axis;
+			splitSize = size;
+		}
+	});
+	return splitAxis;
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::dump(ostream& out) const
+{
+	out << "== KD TREE IMPLEMENTATION ====\n";
+	out << "POINT COUNT: " << m_numPoints << "\n";
+	out << "NODE COUNT: " << m_numNodes << "\n\n";
+
+	out << "-- NODES ----\n";
+	auto itBegin = m_pNodes;
+	auto itEnd = m_pNodes + m_numNodes;
+	int idxNode = 0;
+	for_each(itBegin, itEnd, [&](const KDTreeNode<uint_t>& node) {
+		out << idxNode << ": ";
+		node.dump(getPoint(static_cast<size_t>(node.getIdxPoint())), out);
+		++idxNode;
+	});
+
+	out.flush();
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::isBalanced() const
+{
+	if (m_numNodes <= 2)
+		return true;
+
+	const KDTreeNode<uint_t>* pRoot = getRootNode();
+	assert(pRoot != NULL);
+	return pRoot->isBalanced(m_pNodes);
+}
+
+KD_TREE_TEMPLATE
+size_t
+KD_TREE_CLASS::eraseInBox(const point_t& boxMin, const point_t& boxMax)
+{
+	if (getNumLivePoints() == 0)
+		return 0;
+
+	if (m_numErased == 0) {
+		m_arrErased.assign(m_numPoints, false);
+		m_arrLiveCounts.resize(m_numNodes);
+	}
+
+	// Left subtrees lie at or below their node's plane, right subtrees at
+	// or above it, so only sides overlapping the box are visited. A refit
+	// tree's sides may cross the plane and are bounded by their extents.
+	size_t numErased = 0;
+	vector<uint_t> nodeIdxStack(1, getIdxRootNode());
+	while (!nodeIdxStack.empty()) {
+		uint_t idxNode = nodeIdxStack.back();
+		nodeIdxStack.pop_back();
+		if (isSubtreeErased(idxNode))
+			continue;
+
+		const KDTreeNode<uint_t>& node = m_pNodes[static_cast<size_t>(idxNode)];
+		size_t idxPoint = static_cast<size_t>(node.getIdxPoint());
+		const point_t& nodePoint = getPoint(idxPoint);
+		bool isInside = true;
+		forEachAxis<DIM>([&](int axis) {
+			isInside &= boxMin[axis] <= nodePoint[axis] 
+				&& nodePoint[axis] <= boxMax[axis];
+		});
+		if (isInside && !m_arrErased[idxPoint]) {
+			m_arrErased[idxPoint] = true;
+			++numErased;
+		}
+
+		int axis = node.getAxis();
+		real_t leftMax = nodePoint[axis];
+		real_t rightMin = nodePoint[axis];
+		if (m_pSplitBounds != NULL) {
+			leftMax = m_pSplitBounds[static_cast<size_t>(idxNode)].leftMax;
+			rightMin = m_pSplitBounds[static_cast<size_t>(idxNode)].rightMin;
+		}
+		if (node.getIdxLeft() != IDX_NONE && boxMin[axis] <= leftMax)
+			nodeIdxStack.push_back(node.getIdxLeft());
+		if (node.getIdxRight() != IDX_NONE && boxMax[axis] >= rightMin)
+			nodeIdxStack.push_back(node.getIdxRight());
+	}
+
+	if (numErased == 0)
+		return 0;
+
+	m_numErased += numErased;
+	updateLiveCounts();
+	if (getNumLivePoints() < m_numPoints * (1.0 - m_compactionThreshold))
+		compact();
+	return numErased;
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::updateLiveCounts()
+{
+	// Nodes are in post-order, children are counted before their parents
+	for (size_t idxNode = 0; idxNode < m_numNodes; ++idxNode) {
+		const KDTreeNode<uint_t>& node = m_pNodes[idxNode];
+		uint_t liveCount = m_arrErased[node.getIdxPoint()] ? 0 : 1;
+		if (node.getIdxLeft() != IDX_NONE)
+			liveCount += m_arrLiveCounts[node.getIdxLeft()];
+		if (node.getIdxRight() != IDX_NONE)
+			liveCount += m_arrLiveCounts[node.getIdxRight()];
+		m_arrLiveCounts[idxNode] = liveCount;
+	}
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::compact()
+{
+	// External and mapped points cannot be rebuilt, they keep tombstones
+	const point_t* pPoints = getOwnedPoints();
+	if (m_numErased == 0 || pPoints == NULL)
+		return false;
+
+	// The live points and their construction indices move to storage of
+	// their own size, an arena is replaced by a smaller one
+	size_t numLivePoints = getNumLivePoints();
+	size_t numPoints = m_numPoints;
+	Arena arena;
+	PointList arrLivePoints;
+	IdxList arrLiveInputOrder;
+	point_t* pLivePoints = NULL;
+	uint_t* pLiveInputOrder = NULL;
+	if (m_arena.empty()) {
+		arrLivePoints.resize(numLivePoints);
+		arrLiveInputOrder.resize(numLivePoints);
+		if (numLivePoints != 0) {
+			pLivePoints = &arrLivePoints[0];
+			pLiveInputOrder = &arrLiveInputOrder[0];
+		}
+	} else {
+		arena.swap(m_arena);
+		m_numPoints = numLivePoints;
+		pLivePoints = allocateArena();
+		if (numLivePoints != 0)
+			pLiveInputOrder = getArenaInputOrder();
+	}
+	for (size_t idxPoint = 0; idxPoint < numPoints; ++idxPoint) {
+		if (!m_arrErased[idxPoint]) {
+			new (pLivePoints++) point_t(pPoints[idxPoint]);
+			*pLiveInputOrder++ = m_pInputOrder[idxPoint];
+		}
+	}
+
+	m_arrPoints.swap(arrLivePoints);
+	PointList().swap(arrLivePoints);
+	m_arrInputOrder.swap(arrLiveInputOrder);
+	IdxList().swap(arrLiveInputOrder);
+	Arena().swap(arena);
+	vector<bool>().swap(m_arrErased);
+	vector<uint_t>().swap(m_arrLiveCounts);
+	m_numErased = 0;
+
+	m_arrNodes.clear();
+	vector<KDTreeSplitBounds<real_t> >().swap(m_arrSplitBounds);
+	m_pSplitBounds = NULL;
+	m_refitOverlap = 0;
+	m_pPoints = NULL;
+	m_pInputOrder = NULL;
+	m_numPoints = numLivePoints;
+	init();
+	return true;
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::rebuild()
+{
+	// Owned points lose their tombstones' positions when partitioned again
+	if (m_numErased != 0 && getOwnedPoints() != NULL) {
+		compact();
+		return;
+	}
+
+	m_arrNodes.clear();
+	vector<KDTreeSplitBounds<real_t> >().swap(m_arrSplitBounds);
+	m_pSplitBounds = NULL;
+	m_refitOverlap = 0;
+	if (getOwnedPoints() != NULL) {
+		init();
+		return;
+	}
+
+	// External points are built over a permutation, nodes refer to points
+	// directly afterwards so it is only kept while building
+	m_arrOrder.resize(m_numPoints);
+	for (size_t idx = 0; idx < m_numPoints; ++idx)
+		m_arrOrder[idx] = static_cast<uint_t>(idx);
+	init();
+	vector<uint_t>().swap(m_arrOrder);
+
+	if (m_numErased != 0) {
+		m_arrLiveCounts.resize(m_numNodes);
+		updateLiveCounts();
+	}
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::getIdxFirstNode(uint_t idxNode) const
+{
+	// In post-order a subtree starts at its leftmost leaf
+	for (;;) {
+		const KDTreeNode<uint_t>& node = m_pNodes[static_cast<size_t>(idxNode)];
+		if (node.getIdxLeft() != IDX_NONE)
+			idxNode = node.getIdxLeft();
+		else if (node.getIdxRight() != IDX_NONE)
+			idxNode = node.getIdxRight();
+		else
+			return idxNode;
+	}
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::refitNodes(
+	size_t idxBegin,
+	size_t idxEnd,
+	point_t* arrMins,
+	point_t* arrMaxs,
+	double& out_overlap,
+	size_t& out_numSplits)
+{
+	// Children come before their parents, so one pass in node order sees
+	// every child's bounds before its parent needs them
+	for (size_t idxNode = idxBegin; idxNode < idxEnd; ++idxNode) {
+		const KDTreeNode<uint_t>& node = m_pNodes[idxNode];
+		const point_t& nodePoint = getPoint(node.getIdxPoint());
+		point_t& boundsMin = arrMins[idxNode];
+		point_t& boundsMax = arrMaxs[idxNode];
+		boundsMin = nodePoint;
+		boundsMax = nodePoint;
+
+		KDTreeSplitBounds<real_t>& bounds = m_arrSplitBounds[idxNode];
+		bounds.leftMax = -numeric_limits<real_t>::max();
+		bounds.rightMin = numeric_limits<real_t>::max();
+		int axis = node.getAxis();
+
+		uint_t idxChildren[2] = { node.getIdxLeft(), node.getIdxRight() };
+		for (int side = 0; side < 2; ++side) {
+			if (idxChildren[side] == IDX_NONE)
+				continue;
+			size_t idxChild = static_cast<size_t>(idxChildren[side]);
+			forEachAxis<DIM>([&](int idxAxis) {
+				boundsMin[idxAxis] = 
+					min<real_t>(boundsMin[idxAxis], arrMins[idxChild][idxAxis]);
+				boundsMax[idxAxis] = 
+					max<real_t>(boundsMax[idxAxis], arrMaxs[idxChild][idxAxis]);
+			});
+			if (side == 0)
+				bounds.leftMax = arrMaxs[idxChild][axis];
+			else
+				bounds.rightMin = arrMins[idxChild][axis];
+		}
+
+		real_t extent = boundsMax[axis] - boundsMin[axis];
+		if (idxChildren[0] != IDX_NONE && idxChildren[1] != IDX_NONE) {
+			if (extent > 0 && bounds.leftMax > bounds.rightMin)
+				out_overlap += (bounds.leftMax - bounds.rightMin) / extent;
+			++out_numSplits;
+		}
+	}
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::refit(const point_t* arrPositions)
+{
+	point_t* pPoints = getOwnedPoints();
+	if (pPoints == NULL && m_numPoints != 0)
+		return false;
+
+	for (size_t idxPoint = 0; idxPoint < m_numPoints; ++idxPoint)
+		pPoints[idxPoint] = arrPositions[m_pInputOrder[idxPoint]];
+	return refit();
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::refit()
+{
+	if (m_pFile)
+		return false;
+	if (m_numNodes == 0)
+		return true;
+
+	vector<point_t> arrMins(m_numNodes);
+	vector<point_t> arrMaxs(m_numNodes);
+	m_arrSplitBounds.resize(m_numNodes);
+	m_pSplitBounds = &m_arrSplitBounds[0];
+
+	// Subtrees below the top levels are contiguous and refit on the shared
+	// workers, the top levels are left in between and refit last
+	static const size_t MIN_NODES_PER_THREAD = 16 * 1024;
+	size_t numThreads = min<size_t>(thread::hardware_concurrency(),
+		m_numNodes / MIN_NODES_PER_THREAD);
+	vector<uint_t> arrSubtrees(1, getIdxRootNode());
+	while (numThreads > 1 && arrSubtrees.size() < numThreads) {
+		vector<uint_t> arrChildren;
+		for_each(begin(arrSubtrees), end(arrSubtrees), [&](uint_t idxNode) {
+			const KDTreeNode<uint_t>& node = m_pNodes[idxNode];
+			if (node.getIdxLeft() != IDX_NONE)
+				arrChildren.push_back(node.getIdxLeft());
+			if (node.getIdxRight() != IDX_NONE)
+				arrChildren.push_back(node.getIdxRight());
+		});
+		arrSubtrees.swap(arrChildren);
+	}
+	if (arrSubtrees.size() == 1)
+		arrSubtrees.clear();
+
+	vector<pair<size_t, size_t> > arrRanges;
+	for_each(begin(arrSubtrees), end(arrSubtrees), [&](uint_t idxNode) {
+		arrRanges.push_back(make_pair(
+			static_cast<size_t>(getIdxFirstNode(idxNode)),
+			static_cast<size_t>(idxNode) + 1));
+	});
+	sort(begin(arrRanges), end(arrRanges));
+
+	vector<double> arrOverlaps(arrRanges.size(), 0);
+	vector<size_t> arrNumSplits(arrRanges.size(), 0);
+	WorkerPool::getShared().run(arrRanges.size(), [&](size_t idx) {
+		refitNodes(arrRanges[idx].first, arrRanges[idx].second,
+			&arrMins[0], &arrMaxs[0], arrOverlaps[idx], arrNumSplits[idx]);
+	});
+
+	double overlap = accumulate(begin(arrOverlaps), end(arrOverlaps), 0.0);
+	size_t numSplits = 
+		accumulate(begin(arrNumSplits), end(arrNumSplits), size_t(0));
+	size_t idxBegin = 0;
+	arrRanges.push_back(make_pair(m_numNodes, m_numNodes));
+	for_each(begin(arrRanges), end(arrRanges), 
+		[&](const pair<size_t, size_t>& range) {
+			refitNodes(idxBegin, range.first, &arrMins[0], &arrMaxs[0],
+				overlap, numSplits);
+			idxBegin = range.second;
+		});
+
+	m_refitOverlap = numSplits != 0 ? overlap / numSplits : 0;
+	if (m_refitOverlap > m_refitThreshold)
+		rebuild();
+	return true;
+}
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicPointKDTree(
+	PointList&& arrPoints,
+	KDTreeNodeList&& arrNodes)
+	: m_arrNodes(move(arrNodes))
+	, m_pNodes(NULL)
+	, m_numNodes(m_arrNodes.size())
+	, m_arrPoints(move(arrPoints))
+	, m_pInputOrder(NULL)
+	, m_pPoints(NULL)
+	, m_pointStride(sizeof(point_t))
+	, m_numPoints(m_arrPoints.size())
+	, m_numErased(0)
+	, m_compactionThreshold(KD_TREE_COMPACTION_THRESHOLD)
+	, m_pSplitBounds(NULL)
+	, m_refitThreshold(KD_TREE_REFIT_THRESHOLD)
+	, m_refitOverlap(0)
+{
+	// Nodes were already built over the points in this order
+	if (!m_arrNodes.empty())
+		m_pNodes = &m_arrNodes[0];
+	if (!m_arrPoints.empty())
+		m_pPoints = reinterpret_cast<const char*>(&m_arrPoints[0]);
+	numberInputOrder();
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::getBounds(point_t& boundsMin, point_t& boundsMax) const
+{
+	assert(m_numPoints != 0);
+	boundsMin = getPoint(0);
+	boundsMax = boundsMin;
+	for (size_t idx = 1; idx < m_numPoints; ++idx) {
+		const point_t& point = getPoint(idx);
+		forEachAxis<DIM>([&](int axis) {
+			boundsMin[axis] = min<real_t>(point[axis], boundsMin[axis]);
+			boundsMax[axis] = max<real_t>(point[axis], boundsMax[axis]);
+		});
+	}
+}
+
+KD_TREE_TEMPLATE
+template <typename uint_src_t>
+uint_t
+KD_TREE_CLASS::convertIdx(uint_src_t idx, size_t offset)
+{
+	return idx == InvalidIndex<uint_src_t>::value ? 
+		IDX_NONE : static_cast<uint_t>(static_cast<size_t>(idx) + offset);
+}
+
+KD_TREE_TEMPLATE
+template <typename uint_src_t>
+void
+KD_TREE_CLASS::appendLivePoints(
+	const BasicPointKDTree<uint_src_t, DIM, real_t, alloc_t>& tree,
+	PointList& arrPoints)
+{
+	for (size_t idx = 0; idx < tree.m_numPoints; ++idx) {
+		if (!tree.isErased(idx))
+			arrPoints.push_back(tree.getPoint(idx));
+	}
+}
+
+KD_TREE_TEMPLATE
+template <typename uint_src_t>
+void
+KD_TREE_CLASS::appendNodes(
+	const BasicPointKDTree<uint_src_t, DIM, real_t, alloc_t>& tree,
+	size_t idxFirstNode,
+	size_t pointOffset,
+	KDTreeNodeList& arrNodes)
+{
+	// Nodes before idxFirstNode are dropped, children referring to them
+	// are cut off and later nodes move down to follow the ones appended
+	size_t nodeOffset = arrNodes.size() - idxFirstNode;
+	for (size_t idx = idxFirstNode; idx < tree.m_numNodes; ++idx) {
+		const KDTreeNode<uint_src_t>& node = tree.m_pNodes[idx];
+		auto convertChild = [&](uint_src_t idxChild) -> uint_t {
+			return idxChild != InvalidIndex<uint_src_t>::value
+				&& static_cast<size_t>(idxChild) < idxFirstNode ?
+				IDX_NONE : convertIdx(idxChild, nodeOffset);
+		};
+		arrNodes.push_back(KDTreeNode<uint_t>(
+			convertIdx(node.getIdxPoint(), pointOffset),
+			convertChild(node.getIdxLeft()),
+			convertChild(node.getIdxRight()),
+			node.getAxis()));
+	}
+}
+
+KD_TREE_TEMPLATE
+template <typename uint_low_t, typename uint_high_t>
+unique_ptr<KD_TREE_CLASS>
+KD_TREE_CLASS::graft(
+	const BasicPointKDTree<uint_low_t, DIM, real_t, alloc_t>& low,
+	const BasicPointKDTree<uint_high_t, DIM, real_t, alloc_t>& high,
+	int axis)
+{
+	PointList arrPoints;
+	arrPoints.reserve(low.m_numPoints + high.m_numPoints);
+	appendLivePoints(low, arrPoints);
+	appendLivePoints(high, arrPoints);
+
+	// The first node in post-order is a leaf, the high tree gives it up to
+	// be the new root. Its point is left of some high points along axis,
+	// so the root is pruned by extents like every other node.
+	KDTreeNodeList arrNodes;
+	arrNodes.reserve(low.m_numNodes + high.m_numNodes);
+	appendNodes(low, 0, 0, arrNodes);
+	uint_t idxLowRoot = static_cast<uint_t>(arrNodes.size() - 1);
+	appendNodes(high, 1, low.m_numPoints, arrNodes);
+	uint_t idxHighRoot = high.m_numNodes > 1 ? 
+		static_cast<uint_t>(arrNodes.size() - 1) : IDX_NONE;
+	arrNodes.push_back(KDTreeNode<uint_t>(
+		convertIdx(high.m_pNodes[0].getIdxPoint(), low.m_numPoints),
+		idxLowRoot, idxHighRoot, axis));
+
+	unique_ptr<BasicPointKDTree> pTree(
+		new BasicPointKDTree(move(arrPoints), move(arrNodes)));
+	pTree->refit();
+	return pTree;
+}
+
+KD_TREE_TEMPLATE
+template <typename uint_a_t, typename uint_b_t>
+unique_ptr<KD_TREE_CLASS>
+KD_TREE_CLASS::merge(
+	const BasicPointKDTree<uint_a_t, DIM, real_t, alloc_t>& a,
+	const BasicPointKDTree<uint_b_t, DIM, real_t, alloc_t>& b)
+{
+	assert(a.getNumLivePoints() + b.getNumLivePoints() < IDX_NONE);
+	if (a.m_numErased == 0 && b.m_numErased == 0 
+		&& a.m_numNodes != 0 && b.m_numNodes != 0)
+	{
+		// Graft along the axis the trees overlap least on, relative to
+		// their joint extent
+		point_t minA, maxA, minB, maxB;
+		a.getBounds(minA, maxA);
+		b.getBounds(minB, maxB);
+		int graftAxis = -1;
+		bool isALow = true;
+		double graftOverlap = KD_TREE_REFIT_THRESHOLD;
+		forEachAxis<DIM>([&](int axis) {
+			real_t extent = max(maxA[axis], maxB[axis]) 
+				- min(minA[axis], minB[axis]);
+			if (extent <= 0)
+				return;
+			bool isLow = minA[axis] <= minB[axis];
+			real_t overlap = isLow ? 
+				maxA[axis] - minB[axis] : maxB[axis] - minA[axis];
+			double fraction = max<double>(0, overlap / extent);
+			if (fraction <= graftOverlap) {
+				graftAxis = axis;
+				isALow = isLow;
+				graftOverlap = fraction;
+			}
+		});
+		if (graftAxis >= 0)
+			return isALow ? graft(a, b, graftAxis) : graft(b, a, graftAxis);
+	}
+
+	PointList arrPoints;
+	arrPoints.reserve(a.getNumLivePoints() + b.getNumLivePoints());
+	appendLivePoints(a, arrPoints);
+	appendLivePoints(b, arrPoints);
+	unique_ptr<BasicPointKDTree> pTree(
+		new BasicPointKDTree(move(arrPoints), KDTreeNodeList()));
+	pTree->init();
+	return pTree;
+}
+
+KD_TREE_TEMPLATE
+const KDTreeNode<uint_t>*
+KD_TREE_CLASS::getRootNode() const
+{
+	if (m_numNodes == 0)
+		return NULL;
+	return &m_pNodes[m_numNodes-1];
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::getIdxRootNode() const
+{
+	assert(m_numNodes != 0);
+	return static_cast<uint_t>(m_numNodes-1);
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::initClosestPointStack(
+	vector<uint_t>& nodeIdxStack) const
+{
+	size_t numPoints = m_numPoints;
+	size_t log2NumPoints = static_cast<size_t>(
+		log(static_cast<double>(numPoints)) / log(2.0));
+	nodeIdxStack.reserve(log2NumPoints);
+	nodeIdxStack.push_back(getIdxRootNode());
+}
+
+KD_TREE_TEMPLATE
+const KDTreeNode<uint_t>&
+KD_TREE_CLASS::getCurrentNode(
+	vector<uint_t>& nodeIdxStack) const
+{
+	assert(!nodeIdxStack.empty());
+	size_t idx = static_cast<size_t>(nodeIdxStack.back());
+	return m_pNodes[idx];
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::updateClosestPoint(
+	vector<uint_t>& nodeIdxStack,
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	assert(!nodeIdxStack.empty());
+	return updateClosestPoint(nodeIdxStack.back(), point, result);
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::updateClosestPoint(
+	uint_t idxNode,
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	const KDTreeNode<uint_t>& node = m_pNodes[static_cast<size_t>(idxNode)];
+	size_t idxPoint = static_cast<size_t>(node.getIdxPoint());
+	if (isErased(idxPoint))
+		return false;
+	const point_t& nodePoint = getPoint(idxPoint);
+
+	real_t distance2 = getDistance2<DIM>(point, nodePoint);
+
+	if (distance2 >= result.distance2)
+		return false;
+
+	result.point = nodePoint;
+	result.distance2 = distance2;
+	result.idxNode = static_cast<size_t>(idxNode);
+	return true;
+}
+
+KD_TREE_TEMPLATE
+real_t
+KD_TREE_CLASS::getDistanceToSide2(
+	const KDTreeNode<uint_t>& node,
+	uint_t idxSide,
+	const point_t& point) const
+{
+	int axis = node.getAxis();
+	if (m_pSplitBounds == NULL) {
+		size_t idxNodePoint = static_cast<size_t>(node.getIdxPoint());
+		const point_t& nodePoint = getPoint(idxNodePoint);
+		real_t sqrtResult = point[axis] - nodePoint[axis];
+		return sqrtResult * sqrtResult;
+	}
+
+	// A refit tree's sides may cross the node's point, so the distance is
+	// to the side's own extent along the axis
+	const KDTreeSplitBounds<real_t>& bounds = 
+		m_pSplitBounds[static_cast<size_t>(&node - m_pNodes)];
+	real_t distance = (idxSide == node.getIdxLeft()) ?
+		point[axis] - bounds.leftMax : bounds.rightMin - point[axis];
+	return distance > 0 ? distance * distance : 0;
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::getClosestPointTo(
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	if (getNumLivePoints() == 0)
+		return false;
+
+	vector<uint_t> nodeIdxStack;
+	initClosestPointStack(nodeIdxStack);
+	searchSubtree(nodeIdxStack, point, result);
+	return true;
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::getPathToNode(
+	uint_t idxNode,
+	vector<uint_t>& nodeIdxPath) const
+{
+	// Nodes are stored in post-order, so a subtree is a contiguous range
+	// ending at its root, the left one followed by the right one. The left
+	// child is thus the highest index of its subtree and every node of the
+	// right subtree lies between it and the root.
+	nodeIdxPath.clear();
+	nodeIdxPath.push_back(getIdxRootNode());
+	while (nodeIdxPath.back() != idxNode) {
+		const KDTreeNode<uint_t>& node = getCurrentNode(nodeIdxPath);
+		uint_t idxLeft = node.getIdxLeft();
+		bool isInLeft = (idxLeft != IDX_NONE && idxNode <= idxLeft);
+		uint_t idxChild = isInLeft ? idxLeft : node.getIdxRight();
+		if (idxChild == IDX_NONE)
+			return false;
+		nodeIdxPath.push_back(idxChild);
+	}
+	return true;
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::getClosestPointTo(
+	const point_t& point,
+	const ClosestPoint& hint,
+	ClosestPoint& result) const
+{
+	if (getNumLivePoints() == 0)
+		return false;
+
+	result = ClosestPoint();
+	result.distance2 = hint.distance2;
+
+	// Without a usable node the hint only bounds a regular search
+	vector<uint_t> nodeIdxPath;
+	if (hint.idxNode >= m_numNodes
+		|| !getPathToNode(static_cast<uint_t>(hint.idxNode), nodeIdxPath))
+	{
+		vector<uint_t> nodeIdxStack;
+		initClosestPointStack(nodeIdxStack);
+		searchSubtree(nodeIdxStack, point, result);
+		return result.idxNode != ClosestPoint::IDX_NONE;
+	}
+
+	// Search the hinted subtree first, its point bounds everything else
+	result.distance2 = numeric_limits<real_t>::max();
+	vector<uint_t> nodeIdxStack;
+	initClosestPointStack(nodeIdxStack);
+	nodeIdxStack.back() = nodeIdxPath.back();
+	updateClosestPoint(nodeIdxStack, point, result);
+	searchSubtree(nodeIdxStack, point, result);
+
+	// Then backtrack through the hint's ancestors towards the root
+	for (size_t depth = nodeIdxPath.size()-1; depth > 0; --depth) {
+		uint_t idxNode = nodeIdxPath[depth-1];
+		const KDTreeNode<uint_t>& node = m_pNodes[static_cast<size_t>(idxNode)];
+		updateClosestPoint(idxNode, point, result);
+
+		uint_t idxOppositeSide = getIdxOppositeSide(nodeIdxPath[depth], node);
+		if (idxOppositeSide == IDX_NONE || isSubtreeErased(idxOppositeSide)
+			|| getDistanceToSide2(node, idxOppositeSide, point)
+				>= result.distance2)
+			continue;
+
+		nodeIdxStack.push_back(idxOppositeSide);
+		searchSubtree(nodeIdxStack, point, result);
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicPointKDTree Packet Query Methods
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int
+countLanes(int laneMask)
+{
+	int count = 0;
+	for (; laneMask != 0; laneMask &= laneMask - 1)
+		++count;
+	return count;
+}
+
+static inline size_t
+getFirstLane(int laneMask)
+{
+	assert(laneMask != 0);
+	size_t lane = 0;
+	while ((laneMask & (1 << lane)) == 0)
+		++lane;
+	return lane;
+}
+
+template <int DIM, typename real_t, size_t SIZE, typename point_t>
+static void
+initQueryPacket(
+	const point_t* arrQueries,
+	size_t numQueries,
+	KDTreeQueryPacket<DIM, real_t, SIZE>& packet)
+{
+	assert(numQueries > 0 && numQueries <= SIZE);
+
+	// Unused lanes repeat the last query and are masked off
+	packet.laneMask = (1 << numQueries) - 1;
+	for (size_t lane = 0; lane < SIZE; ++lane) {
+		const point_t& query = arrQueries[min(lane, numQueries-1)];
+		for (int axis = 0; axis < DIM; ++axis)
+			packet.coords[axis][lane] = query[axis];
+		packet.results[lane] = BasicKDTreeClosestPoint<point_t>();
+		packet.distance2[lane] = packet.results[lane].distance2;
+	}
+}
+
+template <int DIM, typename real_t, size_t SIZE>
+static inline int
+getPacketActiveMask(
+	const real_t* bound2,
+	const KDTreeQueryPacket<DIM, real_t, SIZE>& packet,
+	int laneMask)
+{
+	typedef KDTreeSimd<real_t> Simd;
+
+	int activeMask = 0;
+	for (size_t lane = 0; lane < SIZE; lane += Simd::WIDTH) {
+		typename Simd::reg_t bound = Simd::load(&bound2[lane]);
+		typename Simd::reg_t best = Simd::load(&packet.distance2[lane]);
+		activeMask |= Simd::lessThan(bound, best) << lane;
+	}
+	return activeMask & laneMask;
+}
+
+template <typename uint_t, typename real_t, size_t SIZE>
+static inline void
+pushPacketEntry(
+	vector<KDTreePacketStackEntry<uint_t, real_t, SIZE> >& packetStack,
+	uint_t idxNode,
+	int laneMask,
+	int nearMask,
+	const real_t* plane2,
+	const real_t* parentBound2)
+{
+	if (idxNode == InvalidIndex<uint_t>::value)
+		return;
+
+	// Lanes for which this child is across the splitting plane are also
+	// bounded by their distance to the plane
+	KDTreePacketStackEntry<uint_t, real_t, SIZE> entry;
+	entry.idxNode = idxNode;
+	entry.laneMask = laneMask;
+	for (size_t lane = 0; lane < SIZE; ++lane) {
+		bool isNear = (nearMask & (1 << lane)) != 0;
+		entry.bound2[lane] = isNear ? parentBound2[lane]
+			: max(plane2[lane], parentBound2[lane]);
+	}
+	packetStack.push_back(entry);
+}
+
+KD_TREE_TEMPLATE
+template <size_t SIZE>
+void
+KD_TREE_CLASS::updateClosestPointPacket(
+	const KDTreeNode<uint_t>& node,
+	int laneMask,
+	KDTreeQueryPacket<DIM, real_t, SIZE>& packet) const
+{
+	size_t idxPoint = static_cast<size_t>(node.getIdxPoint());
+	if (isErased(idxPoint))
+		return;
+	const point_t& nodePoint = getPoint(idxPoint);
+	size_t idxNode = static_cast<size_t>(&node - m_pNodes);
+
+	for (size_t lane = 0; lane < SIZE; lane += Simd::WIDTH) {
+		// Summed in axis order to match getDistance2() exactly
+		typename Simd::reg_t distance2 = Simd::set1(0);
+		forEachAxis<DIM>([&](int axis) {
+			typename Simd::reg_t diff = Simd::sub(
+				Simd::load(&packet.coords[axis][lane]),
+				Simd::set1(nodePoint[axis]));
+			distance2 = Simd::add(distance2, Simd::mul(diff, diff));
+		});
+		typename Simd::reg_t best = Simd::load(&packet.distance2[lane]);
+
+		int closerMask = Simd::lessThan(distance2, best);
+		closerMask &= laneMask >> lane;
+		if (closerMask == 0)
+			continue;
+
+		real_t arrDistance2[Simd::WIDTH];
+		Simd::store(arrDistance2, distance2);
+		for (size_t idx = 0; idx < Simd::WIDTH; ++idx) {
+			if ((closerMask & (1 << idx)) == 0)
+				continue;
+			packet.distance2[lane+idx] = arrDistance2[idx];
+			packet.results[lane+idx].distance2 = arrDistance2[idx];
+			packet.results[lane+idx].point = nodePoint;
+			packet.results[lane+idx].idxNode = idxNode;
+		}
+	}
+}
+
+KD_TREE_TEMPLATE
+template <size_t SIZE>
+int
+KD_TREE_CLASS::getPacketLeftMask(
+	const KDTreeNode<uint_t>& node,
+	const KDTreeQueryPacket<DIM, real_t, SIZE>& packet,
+	real_t* out_plane2) const
+{
+	int axis = node.getAxis();
+	size_t idxNodePoint = static_cast<size_t>(node.getIdxPoint());
+	typename Simd::reg_t split = Simd::set1(getPoint(idxNodePoint)[axis]);
+
+	int leftMask = 0;
+	for (size_t lane = 0; lane < SIZE; lane += Simd::WIDTH) {
+		typename Simd::reg_t coord = Simd::load(&packet.coords[axis][lane]);
+		typename Simd::reg_t diff = Simd::sub(coord, split);
+		Simd::store(&out_plane2[lane], Simd::mul(diff, diff));
+		leftMask |= Simd::lessEqual(coord, split) << lane;
+	}
+
+	// Refit sides are bounded by their extent instead, see 
+	// getDistanceToSide2(). Each lane's far side is the one it does not
+	// descend into first.
+	if (m_pSplitBounds != NULL) {
+		const KDTreeSplitBounds<real_t>& bounds = 
+			m_pSplitBounds[static_cast<size_t>(&node - m_pNodes)];
+		for (size_t lane = 0; lane < SIZE; ++lane) {
+			real_t coord = packet.coords[axis][lane];
+			real_t distance = (leftMask & (1 << lane)) ?
+				bounds.rightMin - coord : coord - bounds.leftMax;
+			out_plane2[lane] = distance > 0 ? distance * distance : 0;
+		}
+	}
+	return leftMask;
+}
+
+KD_TREE_TEMPLATE
+template <size_t SIZE>
+void
+KD_TREE_CLASS::searchSubtreeForLane(
+	uint_t idxNode,
+	size_t lane,
+	KDTreeQueryPacket<DIM, real_t, SIZE>& packet) const
+{
+	point_t point;
+	for (int axis = 0; axis < DIM; ++axis)
+		point[axis] = packet.coords[axis][lane];
+
+	vector<uint_t> nodeIdxStack;
+	initClosestPointStack(nodeIdxStack);
+	nodeIdxStack.back() = idxNode;
+	searchSubtree(nodeIdxStack, point, packet.results[lane]);
+	packet.distance2[lane] = packet.results[lane].distance2;
+}
+
+KD_TREE_TEMPLATE
+template <size_t SIZE>
+void
+KD_TREE_CLASS::searchPacket(KDTreeQueryPacket<DIM, real_t, SIZE>& packet) const
+{
+	typedef KDTreePacketStackEntry<uint_t, real_t, SIZE> PacketStackEntry;
+
+	vector<PacketStackEntry> packetStack;
+	packetStack.reserve(2 * static_cast<size_t>(
+		log(static_cast<double>(m_numPoints)) / log(2.0) + 1));
+
+	real_t zero2[SIZE] = {};
+	pushPacketEntry(packetStack, getIdxRootNode(), packet.laneMask,
+		KDTreeQueryPacket<DIM, real_t, SIZE>::ALL_LANES, zero2, zero2);
+
+	while (!packetStack.empty()) {
+		PacketStackEntry entry = packetStack.back();
+		packetStack.pop_back();
+
+		int laneMask = getPacketActiveMask(entry.bound2, packet,
+			entry.laneMask);
+		if (laneMask == 0 || isSubtreeErased(entry.idxNode))
+			continue;
+
+		// A single remaining lane gains nothing from SIMD, so it finishes
+		// the subtree with the scalar traversal
+		if (countLanes(laneMask) == 1) {
+			searchSubtreeForLane(entry.idxNode, getFirstLane(laneMask), packet);
+			continue;
+		}
+
+		const KDTreeNode<uint_t>& node =
+			m_pNodes[static_cast<size_t>(entry.idxNode)];
+		updateClosestPointPacket(node, laneMask, packet);
+		if (isLeafNode(node))
+			continue;
+
+		// Visit the side most lanes fall on first, lanes that disagree
+		// visit it as their far side
+		real_t plane2[SIZE];
+		int leftMask = getPacketLeftMask(node, packet, plane2) & laneMask;
+		int rightMask = laneMask & ~leftMask;
+		bool leftFirst = countLanes(leftMask) >= countLanes(rightMask);
+		if (leftFirst) {
+			pushPacketEntry(packetStack, node.getIdxRight(), laneMask,
+				rightMask, plane2, entry.bound2);
+			pushPacketEntry(packetStack, node.getIdxLeft(), laneMask,
+				leftMask, plane2, entry.bound2);
+		} else {
+			pushPacketEntry(packetStack, node.getIdxLeft(), laneMask,
+				leftMask, plane2, entry.bound2);
+			pushPacketEntry(packetStack, node.getIdxRight(), laneMask,
+				rightMask, plane2, entry.bound2);
+		}
+	}
+}
+
+template <int DIM>
+static inline uint64_t
+getMortonCode(const uint64_t* arrCells, int bitsPerAxis)
+{
+	// Interleaves the cell bits of every axis, most significant first
+	uint64_t code = 0;
+	for (int bit = bitsPerAxis-1; bit >= 0; --bit) {
+		forEachAxis<DIM>([&](int axis) {
+			code = (code << 1) | ((arrCells[axis] >> bit) & 1);
+		});
+	}
+	return code;
+}
+
+template <int DIM, typename point_t>
+static void
+sortAlongMortonCurve(
+	const point_t* arrQueries,
+	size_t numQueries,
+	vector<size_t>& out_order)
+{
+	typedef typename point_t::BaseType real_t;
+	static const int MORTON_BITS = 63 / DIM;
+	static_assert(MORTON_BITS > 0, "too many dimensions for a Morton code");
+	const real_t mortonCells = static_cast<real_t>((1ull << MORTON_BITS) - 1);
+
+	point_t boundsMin(numeric_limits<real_t>::max());
+	point_t boundsMax(-numeric_limits<real_t>::max());
+	for (size_t idx = 0; idx < numQueries; ++idx) {
+		forEachAxis<DIM>([&](int axis) {
+			boundsMin[axis] = min(boundsMin[axis], arrQueries[idx][axis]);
+			boundsMax[axis] = max(boundsMax[axis], arrQueries[idx][axis]);
+		});
+	}
+
+	point_t scale;
+	forEachAxis<DIM>([&](int axis) {
+		real_t size = boundsMax[axis] - boundsMin[axis];
+		scale[axis] = (size > 0) ? mortonCells / size : 0;
+	});
+
+	vector<pair<uint64_t, size_t> > arrCodes;
+	arrCodes.reserve(numQueries);
+	uint64_t arrCells[DIM];
+	for (size_t idx = 0; idx < numQueries; ++idx) {
+		forEachAxis<DIM>([&](int axis) {
+			real_t cell = (arrQueries[idx][axis] - boundsMin[axis]) * scale[axis];
+			arrCells[axis] = static_cast<uint64_t>(cell);
+		});
+		uint64_t code = getMortonCode<DIM>(arrCells, MORTON_BITS);
+		arrCodes.emplace_back(make_pair(code, idx));
+	}
+	sort(begin(arrCodes), end(arrCodes));
+
+	out_order.clear();
+	out_order.reserve(numQueries);
+	for_each(begin(arrCodes), end(arrCodes),
+		[&](const pair<uint64_t, size_t>& code) {
+		out_order.push_back(code.second);
+	});
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::getClosestPointsTo(
+	const point_t* arrQueries,
+	size_t numQueries,
+	ClosestPoint* arrResults) const
+{
+	return getClosestPointsTo<KD_TREE_PACKET_SIZE>(arrQueries, numQueries,
+		arrResults);
+}
+
+KD_TREE_TEMPLATE
+template <size_t SIZE>
+bool
+KD_TREE_CLASS::getClosestPointsTo(
+	const point_t* arrQueries,
+	size_t numQueries,
+	ClosestPoint* arrResults) const
+{
+	if (getNumLivePoints() == 0)
+		return false;
+
+	// Queries arrive in any order, visiting them along a Morton curve keeps
+	// consecutive packets coherent and their paths through the tree warm
+	vector<size_t> arrOrder;
+	sortAlongMortonCurve<DIM>(arrQueries, numQueries, arrOrder);
+
+	KDTreeQueryPacket<DIM, real_t, SIZE> packet;
+	point_t packetQueries[SIZE];
+	for (size_t idxQuery = 0; idxQuery < numQueries; idxQuery += SIZE) {
+		size_t packetSize = min(SIZE, numQueries - idxQuery);
+		for (size_t lane = 0; lane < packetSize; ++lane)
+			packetQueries[lane] = arrQueries[arrOrder[idxQuery+lane]];
+
+		initQueryPacket(packetQueries, packetSize, packet);
+		searchPacket(packet);
+		for (size_t lane = 0; lane < packetSize; ++lane)
+			arrResults[arrOrder[idxQuery+lane]] = packet.results[lane];
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicPointKDTree Serialization
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicPointKDTree(
+	const shared_ptr<MappedFile>& pFile,
+	const KDTreeFileHeader& header)
+	: m_pNodes(NULL)
+	, m_numNodes(static_cast<size_t>(header.numNodes))
+	, m_pInputOrder(NULL)
+	, m_pPoints(pFile->getData() + header.pointsOffset)
+	, m_pointStride(sizeof(point_t))
+	, m_numPoints(static_cast<size_t>(header.numPoints))
+	, m_numErased(0)
+	, m_compactionThreshold(KD_TREE_COMPACTION_THRESHOLD)
+	, m_pSplitBounds(NULL)
+	, m_refitThreshold(KD_TREE_REFIT_THRESHOLD)
+	, m_refitOverlap(0)
+	, m_pFile(pFile)
+{
+	if (m_numNodes != 0) {
+		m_pNodes = reinterpret_cast<const KDTreeNode<uint_t>*>(
+			pFile->getData() + header.nodesOffset);
+	}
+	if (m_numNodes != 0 && (header.flags & KD_TREE_FILE_SPLIT_BOUNDS)) {
+		m_pSplitBounds = reinterpret_cast<const KDTreeSplitBounds<real_t>*>(
+			pFile->getData() + header.boundsOffset);
+	}
+	if (header.flags & KD_TREE_FILE_TOMBSTONES) {
+		const uint8_t* pBits = reinterpret_cast<const uint8_t*>(
+			pFile->getData() + header.erasedOffset);
+		m_arrErased.resize(m_numPoints);
+		for (size_t idxPoint = 0; idxPoint < m_numPoints; ++idxPoint) {
+			bool isErased = ((pBits[idxPoint / 8] >> (idxPoint % 8)) & 1) != 0;
+			m_arrErased[idxPoint] = isErased;
+			m_numErased += isErased ? 1 : 0;
+		}
+		m_arrLiveCounts.resize(m_numNodes);
+		updateLiveCounts();
+	}
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::initFileHeader(KDTreeFileHeader& header) const
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KD_TREE_FILE_MAGIC, sizeof(header.magic));
+	header.version = KD_TREE_FILE_VERSION;
+	header.byteOrder = KD_TREE_FILE_BYTE_ORDER;
+	header.headerSize = sizeof(KDTreeFileHeader);
+	header.idxBits = sizeof(uint_t) * 8;
+	header.dim = DIM;
+	header.realSize = sizeof(real_t);
+	header.nodeSize = sizeof(KDTreeNode<uint_t>);
+
+	header.numNodes = m_numNodes;
+	header.numPoints = m_numPoints;
+	header.nodesOffset = getAlignedFileOffset(sizeof(KDTreeFileHeader));
+	header.pointsOffset = getAlignedFileOffset(
+		header.nodesOffset + m_numNodes * sizeof(KDTreeNode<uint_t>));
+	header.fileSize = header.pointsOffset + m_numPoints * sizeof(point_t);
+	if (m_pSplitBounds != NULL) {
+		header.flags |= KD_TREE_FILE_SPLIT_BOUNDS;
+		header.boundsOffset = getAlignedFileOffset(header.fileSize);
+		header.fileSize = header.boundsOffset 
+			+ m_numNodes * sizeof(KDTreeSplitBounds<real_t>);
+	}
+	if (m_numErased != 0) {
+		header.flags |= KD_TREE_FILE_TOMBSTONES;
+		header.erasedOffset = getAlignedFileOffset(header.fileSize);
+		header.fileSize = header.erasedOffset + getErasedBitsSize(m_numPoints);
+	}
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::getErasedBits(vector<uint8_t>& out_bits) const
+{
+	out_bits.assign(static_cast<size_t>(getErasedBitsSize(m_numPoints)), 0);
+	for (size_t idxPoint = 0; idxPoint < m_numPoints; ++idxPoint) {
+		if (isErased(idxPoint))
+			out_bits[idxPoint / 8] |= 
+				static_cast<uint8_t>(1 << (idxPoint % 8));
+	}
+}
+
+KD_TREE_TEMPLATE
+uint64_t
+KD_TREE_CLASS::getChecksum() const
+{
+	// Points are hashed one at a time so strided external points give the
+	// same checksum as the packed points written for them
+	uint64_t hash = getKDTreeChecksum(
+		reinterpret_cast<const char*>(m_pNodes), 
+		m_numNodes * sizeof(KDTreeNode<uint_t>));
+	for (size_t idx = 0; idx < m_numPoints; ++idx) {
+		hash = getKDTreeChecksum(
+			reinterpret_cast<const char*>(&getPoint(idx)), 
+			sizeof(point_t), hash);
+	}
+	if (m_pSplitBounds != NULL) {
+		hash = getKDTreeChecksum(
+			reinterpret_cast<const char*>(m_pSplitBounds),
+			m_numNodes * sizeof(KDTreeSplitBounds<real_t>), hash);
+	}
+	if (m_numErased != 0) {
+		vector<uint8_t> arrBits;
+		getErasedBits(arrBits);
+		hash = getKDTreeChecksum(
+			reinterpret_cast<const char*>(&arrBits[0]), arrBits.size(), hash);
+	}
+	return hash;
+}
+
+KD_TREE_TEMPLATE
+template <typename write_t>
+void
+KD_TREE_CLASS::writeSections(write_t write) const
+{
+	KDTreeFileHeader header;
+	initFileHeader(header);
+	header.checksum = getChecksum();
+
+	static const char padding[KD_TREE_FILE_ALIGNMENT] = { 0 };
+	write(reinterpret_cast<const char*>(&header), sizeof(header));
+	write(padding, static_cast<size_t>(header.nodesOffset - sizeof(header)));
+	write(reinterpret_cast<const char*>(m_pNodes),
+		m_numNodes * sizeof(KDTreeNode<uint_t>));
+	write(padding, static_cast<size_t>(header.pointsOffset 
+		- header.nodesOffset - m_numNodes * sizeof(KDTreeNode<uint_t>)));
+
+	if (m_pointStride == sizeof(point_t) && m_numPoints != 0) {
+		write(m_pPoints, m_numPoints * sizeof(point_t));
+	} else {
+		for (size_t idx = 0; idx < m_numPoints; ++idx) {
+			write(reinterpret_cast<const char*>(&getPoint(idx)),
+				sizeof(point_t));
+		}
+	}
+
+	uint64_t offset = header.pointsOffset + m_numPoints * sizeof(point_t);
+	if (header.flags & KD_TREE_FILE_SPLIT_BOUNDS) {
+		write(padding, static_cast<size_t>(header.boundsOffset - offset));
+		write(reinterpret_cast<const char*>(m_pSplitBounds),
+			m_numNodes * sizeof(KDTreeSplitBounds<real_t>));
+		offset = header.boundsOffset 
+			+ m_numNodes * sizeof(KDTreeSplitBounds<real_t>);
+	}
+
+	if (header.flags & KD_TREE_FILE_TOMBSTONES) {
+		vector<uint8_t> arrBits;
+		getErasedBits(arrBits);
+		write(padding, static_cast<size_t>(header.erasedOffset - offset));
+		write(reinterpret_cast<const char*>(&arrBits[0]), arrBits.size());
+	}
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::save(const string& path) const
+{
+	ofstream out(path.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!out)
+		return false;
+
+	writeSections([&](const char* pData, size_t size) {
+		out.write(pData, size);
+	});
+
+	out.close();
+	return !out.fail();
+}
+
+KD_TREE_TEMPLATE
+size_t
+KD_TREE_CLASS::getImageSize() const
+{
+	KDTreeFileHeader header;
+	initFileHeader(header);
+	return static_cast<size_t>(header.fileSize);
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::writeImage(char* pImage) const
+{
+	writeSections([&](const char* pData, size_t size) {
+		memcpy(pImage, pData, size);
+		pImage += size;
+	});
+}
+
+KD_TREE_TEMPLATE
+unique_ptr<KD_TREE_CLASS>
+KD_TREE_CLASS::open(const string& path, int flags)
+{
+	shared_ptr<MappedFile> pFile(new MappedFile());
+	if (!pFile->open(path))
+		return unique_ptr<BasicPointKDTree>();
+	return open(pFile, flags);
+}
+
+KD_TREE_TEMPLATE
+unique_ptr<KD_TREE_CLASS>
+KD_TREE_CLASS::open(const shared_ptr<MappedFile>& pFile, int flags)
+{
+	KDTreeFileHeader header;
+	if (!readKDTreeFileHeader(*pFile, header)
+		|| header.idxBits != sizeof(uint_t) * 8
+		|| header.dim != DIM
+		|| header.realSize != sizeof(real_t)
+		|| header.nodeSize != sizeof(KDTreeNode<uint_t>)
+		|| header.numPoints >= InvalidIndex<uint_t>::value
+		|| header.numNodes != header.numPoints
+		|| header.nodesOffset % KD_TREE_FILE_ALIGNMENT != 0
+		|| header.pointsOffset % KD_TREE_FILE_ALIGNMENT != 0
+		|| header.nodesOffset < header.headerSize
+		|| header.pointsOffset < header.nodesOffset 
+			+ header.numNodes * sizeof(KDTreeNode<uint_t>)
+		|| header.fileSize < header.pointsOffset 
+			+ header.numPoints * sizeof(point_t))
+	{
+		return unique_ptr<BasicPointKDTree>();
+	}
+	if ((header.flags & KD_TREE_FILE_SPLIT_BOUNDS)
+		&& (header.boundsOffset % KD_TREE_FILE_ALIGNMENT != 0
+			|| header.boundsOffset < header.pointsOffset
+				+ header.numPoints * sizeof(point_t)
+			|| header.fileSize < header.boundsOffset
+				+ header.numNodes * sizeof(KDTreeSplitBounds<real_t>)))
+	{
+		return unique_ptr<BasicPointKDTree>();
+	}
+	if ((header.flags & KD_TREE_FILE_TOMBSTONES)
+		&& (header.erasedOffset < header.pointsOffset
+				+ header.numPoints * sizeof(point_t)
+			|| header.fileSize < header.erasedOffset
+				+ getErasedBitsSize(header.numPoints)))
+	{
+		return unique_ptr<BasicPointKDTree>();
+	}
+
+	if (flags & KD_TREE_OPEN_PREFETCH)
+		pFile->prefetch();
+
+	unique_ptr<BasicPointKDTree> pTree(new BasicPointKDTree(pFile, header));
+	if ((flags & KD_TREE_OPEN_VERIFY) && pTree->getChecksum() != header.checksum)
+		return unique_ptr<BasicPointKDTree>();
+	return pTree;
+}
+
+#undef KD_TREE_TEMPLATE
+#undef KD_TREE_CLASS
+
+#endif // EPL_BASICKDTREE_H_
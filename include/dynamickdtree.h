@@ -0,0 +1,315 @@
+#pragma once
+#ifndef EPL_DYNAMICKDTREE_H_
+#define EPL_DYNAMICKDTREE_H_
+
+#include "stdafx.h"
+#include "basickdtree.h"
+
+// Result of BasicDynamicPointKDTree::getClosestPointTo()
+template <typename real_t>
+struct KDTreeDynamicClosestPoint
+{
+	static const size_t IDX_NONE = static_cast<size_t>(-1);
+
+	size_t idxPoint; // index of the point in the coordinates given to the tree
+	real_t distance2;
+
+	KDTreeDynamicClosestPoint()
+		: idxPoint(IDX_NONE)
+		, distance2(numeric_limits<real_t>::max())
+	{}
+};
+
+/// KD Tree with a Dimension Chosen at Runtime
+/// Meant for feature vectors whose length is only known from the data.
+/// Coordinates are stored flat, point after point, and stay in the order
+/// they were given: the tree is built over a permutation of point indices.
+/// Built and searched by the same KDTreeTraversal as BasicPointKDTree.
+template <typename uint_t, typename real_t = fpreal>
+class BasicDynamicPointKDTree : public Uncopyable,
+	private KDTreeTraversal<BasicDynamicPointKDTree<uint_t, real_t>, uint_t>
+{
+public: // types
+	typedef KDTreeTraversal<BasicDynamicPointKDTree, uint_t> Traversal;
+	typedef KDTreeDynamicClosestPoint<real_t> ClosestPoint;
+	typedef vector<KDTreeNode<uint_t> > KDTreeNodeList;
+
+public: // static members
+	static const uint_t IDX_NONE = InvalidIndex<uint_t>::value;
+
+public: // methods
+	BasicDynamicPointKDTree(const vector<real_t>& arrCoords, size_t dim);
+	BasicDynamicPointKDTree(vector<real_t>&& arrCoords, size_t dim);
+
+	size_t getDimension() const { return m_dim; }
+	size_t getNumPoints() const { return m_arrCoords.size() / m_dim; }
+	const real_t* getPoint(size_t idxPoint) const;
+
+	bool isBalanced() const;
+	bool getClosestPointTo(const real_t* point, ClosestPoint& result) const;
+	void dump(ostream& out = cerr) const;
+
+private: // methods
+	friend class KDTreeTraversal<BasicDynamicPointKDTree, uint_t>;
+	using Traversal::buildTree;
+	using Traversal::searchSubtree;
+
+	void init();
+	int chooseSplitAxis(uint_t idxBegin, uint_t idxEnd) const;
+	uint_t partitionAroundMedian(uint_t idxBegin, uint_t idxEnd, int axis);
+	uint_t getIdxPointAt(uint_t idxOrder) const
+		{ return m_arrOrder[static_cast<size_t>(idxOrder)]; }
+	uint_t addNode(const KDTreeNode<uint_t>& node);
+
+	const KDTreeNode<uint_t>& getNode(size_t idxNode) const
+		{ return m_arrNodes[idxNode]; }
+	real_t getCoord(uint_t idxPoint, int axis) const;
+	real_t getDistance2(uint_t idxPoint, const real_t* point) const;
+	uint_t getIdxRootNode() const;
+	void updateClosestPoint(uint_t idxNode, const real_t* point,
+		ClosestPoint& result) const;
+	bool isSubtreeErased(uint_t) const { return false; }
+	real_t getDistanceToSide2(const KDTreeNode<uint_t>& node, uint_t idxSide,
+		const real_t* point) const;
+
+private: // members
+	size_t m_dim;
+	vector<real_t> m_arrCoords;
+	vector<uint_t> m_arrOrder;
+	KDTreeNodeList m_arrNodes;
+};
+
+#define KD_TREE_TEMPLATE template <typename uint_t, typename real_t>
+#define KD_TREE_CLASS BasicDynamicPointKDTree<uint_t, real_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicDynamicPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicDynamicPointKDTree(
+	const vector<real_t>& arrCoords,
+	size_t dim)
+	: m_dim(dim)
+	, m_arrCoords(arrCoords)
+{
+	init();
+}
+
+KD_TREE_TEMPLATE
+KD_TREE_CLASS::BasicDynamicPointKDTree(
+	vector<real_t>&& arrCoords,
+	size_t dim)
+	: m_dim(dim)
+	, m_arrCoords(move(arrCoords))
+{
+	init();
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::init()
+{
+	assert(m_dim > 0 && m_dim <= UINT8_MAX);
+	assert(m_arrCoords.size() % m_dim == 0);
+
+	uint_t numPoints = static_cast<uint_t>(getNumPoints());
+	m_arrOrder.resize(getNumPoints());
+	for (uint_t idx = 0; idx < numPoints; ++idx)
+		m_arrOrder[static_cast<size_t>(idx)] = idx;
+
+	m_arrNodes.reserve(getNumPoints());
+	buildTree(0, numPoints);
+
+	// Nodes refer to points directly, the permutation is only for building
+	vector<uint_t>().swap(m_arrOrder);
+}
+
+KD_TREE_TEMPLATE
+const real_t*
+KD_TREE_CLASS::getPoint(size_t idxPoint) const
+{
+	assert(idxPoint < getNumPoints());
+	return &m_arrCoords[idxPoint * m_dim];
+}
+
+KD_TREE_TEMPLATE
+real_t
+KD_TREE_CLASS::getCoord(uint_t idxPoint, int axis) const
+{
+	return m_arrCoords[static_cast<size_t>(idxPoint) * m_dim + axis];
+}
+
+KD_TREE_TEMPLATE
+real_t
+KD_TREE_CLASS::getDistance2(uint_t idxPoint, const real_t* point) const
+{
+	const real_t* nodePoint = getPoint(static_cast<size_t>(idxPoint));
+	real_t distance2 = 0;
+	for (size_t axis = 0; axis < m_dim; ++axis) {
+		real_t diff = point[axis] - nodePoint[axis];
+		distance2 += diff * diff;
+	}
+	return distance2;
+}
+
+KD_TREE_TEMPLATE
+int
+KD_TREE_CLASS::chooseSplitAxis(
+	uint_t idxBegin,
+	uint_t idxEnd) const
+{
+	assert(idxBegin < idxEnd);
+
+	if (idxBegin+1 == idxEnd)
+		return X_AXIS;
+
+	const real_t* firstPoint = getPoint(
+		static_cast<size_t>(m_arrOrder[static_cast<size_t>(idxBegin)]));
+	vector<real_t> boundsMin(firstPoint, firstPoint + m_dim);
+	vector<real_t> boundsMax(boundsMin);
+
+	for (uint_t idx = idxBegin+1; idx < idxEnd; ++idx) {
+		const real_t* point = getPoint(
+			static_cast<size_t>(m_arrOrder[static_cast<size_t>(idx)]));
+		for (size_t axis = 0; axis < m_dim; ++axis) {
+			boundsMin[axis] = min<real_t>(point[axis], boundsMin[axis]);
+			boundsMax[axis] = max<real_t>(point[axis], boundsMax[axis]);
+		}
+	}
+
+	// Split the widest axis, ties go to the lowest axis
+	int splitAxis = X_AXIS;
+	real_t splitSize = boundsMax[X_AXIS] - boundsMin[X_AXIS];
+	for (size_t axis = 1; axis < m_dim; ++axis) {
+		real_t size = boundsMax[axis] - boundsMin[axis];
+		if (size > splitSize) {
+			splitAxis = static_cast<int>(axis);
+			splitSize = size;
+		}
+	}
+	return splitAxis;
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::partitionAroundMedian(
+	uint_t idxBegin,
+	uint_t idxEnd,
+	int axis)
+{
+	uint_t halfSize = (idxEnd - idxBegin) / 2;
+	uint_t idxMedian = idxBegin + halfSize;
+
+	auto itGlobalBegin = begin(m_arrOrder);
+	auto itBegin = itGlobalBegin + static_cast<size_t>(idxBegin);
+	auto itMedian = itGlobalBegin + static_cast<size_t>(idxMedian);
+	auto itEnd = itGlobalBegin + static_cast<size_t>(idxEnd);
+	nth_element(itBegin, itMedian, itEnd,
+		[=](uint_t lhs, uint_t rhs) -> bool {
+		return getCoord(lhs, axis) < getCoord(rhs, axis);
+	});
+
+	return idxMedian;
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::addNode(const KDTreeNode<uint_t>& node)
+{
+	m_arrNodes.push_back(node);
+	return getIdxRootNode();
+}
+
+KD_TREE_TEMPLATE
+uint_t
+KD_TREE_CLASS::getIdxRootNode() const
+{
+	assert(!m_arrNodes.empty());
+	return static_cast<uint_t>(m_arrNodes.size()-1);
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::isBalanced() const
+{
+	if (m_arrNodes.size() <= 2)
+		return true;
+	return m_arrNodes.back().isBalanced(&m_arrNodes[0]);
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::dump(ostream& out) const
+{
+	out << "== DYNAMIC KD TREE IMPLEMENTATION ====\n";
+	out << "DIMENSION: " << m_dim << "\n";
+	out << "POINT COUNT: " << getNumPoints() << "\n";
+	out << "NODE COUNT: " << m_arrNodes.size() << "\n\n";
+
+	out << "-- NODES ----\n";
+	for (size_t idxNode = 0; idxNode < m_arrNodes.size(); ++idxNode) {
+		const KDTreeNode<uint_t>& node = m_arrNodes[idxNode];
+		size_t idxPoint = static_cast<size_t>(node.getIdxPoint());
+		out << idxNode << ": ";
+		node.dumpAxis(out);
+		out << ", POINT " << idxPoint << ": (";
+		for (size_t axis = 0; axis < m_dim; ++axis)
+			out << (axis == 0 ? "" : " ") << getPoint(idxPoint)[axis];
+		out << ")\n";
+		out << "  CHILDREN: " << getIdxString(node.getIdxLeft()) << " "
+			<< getIdxString(node.getIdxRight()) << "\n";
+	}
+
+	out.flush();
+}
+
+KD_TREE_TEMPLATE
+void
+KD_TREE_CLASS::updateClosestPoint(
+	uint_t idxNode,
+	const real_t* point,
+	ClosestPoint& result) const
+{
+	const KDTreeNode<uint_t>& node = m_arrNodes[static_cast<size_t>(idxNode)];
+	real_t distance2 = getDistance2(node.getIdxPoint(), point);
+	if (distance2 >= result.distance2)
+		return;
+
+	result.idxPoint = static_cast<size_t>(node.getIdxPoint());
+	result.distance2 = distance2;
+}
+
+KD_TREE_TEMPLATE
+real_t
+KD_TREE_CLASS::getDistanceToSide2(
+	const KDTreeNode<uint_t>& node,
+	uint_t,
+	const real_t* point) const
+{
+	int axis = node.getAxis();
+	real_t planeDistance = point[axis] - getCoord(node.getIdxPoint(), axis);
+	return planeDistance * planeDistance;
+}
+
+KD_TREE_TEMPLATE
+bool
+KD_TREE_CLASS::getClosestPointTo(
+	const real_t* point,
+	ClosestPoint& result) const
+{
+	if (m_arrNodes.empty())
+		return false;
+
+	vector<uint_t> nodeIdxStack;
+	nodeIdxStack.reserve(static_cast<size_t>(
+		log(static_cast<double>(getNumPoints())) / log(2.0)) + 1);
+	nodeIdxStack.push_back(getIdxRootNode());
+	searchSubtree(nodeIdxStack, point, result);
+	return true;
+}
+
+#undef KD_TREE_TEMPLATE
+#undef KD_TREE_CLASS
+
+#endif // EPL_DYNAMICKDTREE_H_
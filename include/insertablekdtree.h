@@ -0,0 +1,429 @@
+#pragma once
+#ifndef EPL_INSERTABLEKDTREE_H_
+#define EPL_INSERTABLEKDTREE_H_
+
+#include "stdafx.h"
+#include "basickdtree.h"
+#include "readepochs.h"
+
+/// Points collected before they are merged into the forest's smallest tree
+static const size_t KD_TREE_INSERT_BUFFER_SIZE = 1024;
+
+/// Lock-Free Append Buffer
+/// Writers reserve a slot with one atomic increment and flag it once the
+/// point is stored, so appends never wait for each other. Readers scan the
+/// flagged slots while writers append. The capacity is fixed, a full or 
+/// sealed buffer refuses further points.
+template <typename point_t, int DIM>
+class KDTreeAppendBuffer : public Uncopyable
+{
+public: // methods
+	explicit KDTreeAppendBuffer(size_t capacity);
+
+	// Returns the reserved slot, the point was refused if it is capacity or
+	// more. The writer storing the last slot is the one that saw it fill.
+	size_t append(const point_t& point);
+
+	// Refuses further points, returns false if the buffer had already been
+	// filled or sealed
+	bool seal();
+
+	// Waits for writers still storing points into reserved slots
+	void waitUntilWritten() const;
+
+	size_t getCapacity() const { return m_capacity; }
+	size_t getNumPoints() const;
+	const point_t* getPoints() const { return m_arrPoints.get(); }
+
+	// Replaces result if a stored point is closer
+	void getClosestPointTo(const point_t& point,
+		BasicKDTreeClosestPoint<point_t>& result) const;
+
+private: // members
+	const size_t m_capacity;
+	unique_ptr<point_t[]> m_arrPoints;
+	unique_ptr<atomic<bool>[]> m_arrIsWritten;
+	atomic<size_t> m_numReserved;
+	atomic<size_t> m_numSealed; // capacity unless sealed before filling
+};
+
+/// Published Contents of an Insertable Tree
+/// Never changed once published apart from appends to the live buffer, 
+/// queries search a state without locking.
+template <typename tree_t, typename buffer_t>
+struct KDTreeForestState
+{
+	// Level i holds about bufferSize << i points, or nothing
+	vector<shared_ptr<const tree_t> > arrLevels;
+
+	// Buffer new points are appended to
+	shared_ptr<buffer_t> pBuffer;
+
+	// Sealed buffers scanned until they are merged into a level, oldest first
+	vector<shared_ptr<const buffer_t> > arrMerging;
+};
+
+/// KD Tree with Insertion
+/// A logarithmic (Bentley-Saxe) forest of static BasicPointKDTrees. New
+/// points are appended to a small lock-free buffer that queries scan. A
+/// full buffer is sealed and replaced, a background thread merges it with
+/// the levels below the first empty one into a tree for that level, so
+/// every point is rebuilt O(log n) times. Queries search every level, 
+/// bounded by the closest point found so far.
+/// Queries and insertions may be called concurrently. Neither takes a lock:
+/// states are swapped atomically and queries only pin a ReadEpochs, which
+/// defers freeing a replaced state until no query can still read it. 
+/// Writers only wait for the writer that filled the buffer to replace it.
+/// NOTE: results leave idxNode unset, warm starts are not supported.
+template <typename uint_t, int DIM = 3, typename real_t = fpreal>
+class BasicInsertablePointKDTree : public Uncopyable
+{
+public: // types
+	typedef BasicPointKDTree<uint_t, DIM, real_t> Tree;
+	typedef typename Tree::point_t point_t;
+	typedef typename Tree::ClosestPoint ClosestPoint;
+	typedef KDTreeAppendBuffer<point_t, DIM> Buffer;
+	typedef KDTreeForestState<Tree, Buffer> State;
+
+public: // methods
+	BasicInsertablePointKDTree(
+		size_t bufferSize = KD_TREE_INSERT_BUFFER_SIZE);
+	~BasicInsertablePointKDTree();
+
+	void insert(const point_t& point);
+	void insert(const point_t* arrPoints, size_t numPoints);
+
+	// Merges the buffer and waits until every sealed buffer is merged
+	void flush();
+
+	size_t getNumPoints() const { return m_numPoints; }
+	size_t getNumLevels() const;
+	bool getClosestPointTo(const point_t& point, ClosestPoint& result) const;
+
+private: // methods
+	void replaceBuffer();
+	void publish(const State* pState);
+	void runMerger();
+	void mergeOldestBuffer(unique_lock<mutex>& lock);
+
+private: // members
+	const size_t m_bufferSize;
+	atomic<const State*> m_pState;
+	atomic<size_t> m_numPoints;
+	mutable ReadEpochs m_epochs;
+
+	mutex m_mutex; // serialises publishing, guards the members below
+	vector<const State*> m_arrRetired;
+	bool m_isStopping;
+	condition_variable m_wakeMerger;
+	condition_variable m_mergeDone;
+	thread m_merger;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// KDTreeAppendBuffer Methods
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename point_t, int DIM>
+KDTreeAppendBuffer<point_t, DIM>::KDTreeAppendBuffer(size_t capacity)
+	: m_capacity(max<size_t>(1, capacity))
+	, m_arrPoints(new point_t[m_capacity])
+	, m_arrIsWritten(new atomic<bool>[m_capacity])
+{
+	for (size_t idx = 0; idx < m_capacity; ++idx)
+		m_arrIsWritten[idx] = false;
+	m_numReserved = 0;
+	m_numSealed = m_capacity;
+}
+
+template <typename point_t, int DIM>
+size_t
+KDTreeAppendBuffer<point_t, DIM>::append(const point_t& point)
+{
+	size_t idx = m_numReserved++;
+	if (idx < m_capacity) {
+		m_arrPoints[idx] = point;
+		m_arrIsWritten[idx] = true;
+	}
+	return idx;
+}
+
+template <typename point_t, int DIM>
+bool
+KDTreeAppendBuffer<point_t, DIM>::seal()
+{
+	// Jumps past the last slot, so no later append sees the buffer fill
+	size_t numReserved = m_numReserved.fetch_add(m_capacity + 1);
+	if (numReserved >= m_capacity)
+		return false;
+
+	m_numSealed = numReserved;
+	return true;
+}
+
+template <typename point_t, int DIM>
+void
+KDTreeAppendBuffer<point_t, DIM>::waitUntilWritten() const
+{
+	size_t numPoints = getNumPoints();
+	for (size_t idx = 0; idx < numPoints; ++idx) {
+		while (!m_arrIsWritten[idx])
+			this_thread::yield();
+	}
+}
+
+template <typename point_t, int DIM>
+size_t
+KDTreeAppendBuffer<point_t, DIM>::getNumPoints() const
+{
+	// Until m_numSealed is set after a seal, unwritten slots are skipped
+	return min<size_t>(m_numReserved, m_numSealed);
+}
+
+template <typename point_t, int DIM>
+void
+KDTreeAppendBuffer<point_t, DIM>::getClosestPointTo(
+	const point_t& point,
+	BasicKDTreeClosestPoint<point_t>& result) const
+{
+	// Slots still being stored split the buffer into runs scanned with SIMD
+	size_t numPoints = getNumPoints();
+	size_t idxBegin = 0;
+	while (idxBegin < numPoints) {
+		if (!m_arrIsWritten[idxBegin]) {
+			++idxBegin;
+			continue;
+		}
+		size_t idxEnd = idxBegin + 1;
+		while (idxEnd < numPoints && m_arrIsWritten[idxEnd])
+			++idxEnd;
+
+		BasicKDTreeClosestPoint<point_t> runResult;
+		getClosestPointByScan<DIM>(
+			reinterpret_cast<const char*>(&m_arrPoints[idxBegin]),
+			sizeof(point_t), idxEnd - idxBegin, point, runResult);
+		if (runResult.distance2 < result.distance2)
+			result = runResult;
+		idxBegin = idxEnd;
+	}
+}
+
+#define KD_TREE_FOREST_TEMPLATE \
+	template <typename uint_t, int DIM, typename real_t>
+#define KD_TREE_FOREST_CLASS BasicInsertablePointKDTree<uint_t, DIM, real_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicInsertablePointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_FOREST_TEMPLATE
+KD_TREE_FOREST_CLASS::BasicInsertablePointKDTree(size_t bufferSize)
+	: m_bufferSize(max<size_t>(1, bufferSize))
+	, m_isStopping(false)
+{
+	State* pState = new State();
+	pState->pBuffer.reset(new Buffer(m_bufferSize));
+	m_pState = pState;
+	m_numPoints = 0;
+	m_merger = thread(&BasicInsertablePointKDTree::runMerger, this);
+}
+
+KD_TREE_FOREST_TEMPLATE
+KD_TREE_FOREST_CLASS::~BasicInsertablePointKDTree()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_isStopping = true;
+		m_wakeMerger.notify_one();
+	}
+	m_merger.join();
+
+	for_each(begin(m_arrRetired), end(m_arrRetired), 
+		[](const State* pState) { delete pState; });
+	delete m_pState.load();
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::insert(const point_t& point)
+{
+	insert(&point, 1);
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::insert(const point_t* arrPoints, size_t numPoints)
+{
+	size_t idx = 0;
+	while (idx < numPoints) {
+		bool isFilled = false;
+		{
+			ReadEpochPin pin(m_epochs);
+			Buffer& buffer = *m_pState.load()->pBuffer;
+			size_t idxBegin = idx;
+			while (idx < numPoints) {
+				size_t idxSlot = buffer.append(arrPoints[idx]);
+				if (idxSlot >= buffer.getCapacity())
+					break;
+				++idx;
+				if (idxSlot + 1 == buffer.getCapacity()) {
+					isFilled = true;
+					break;
+				}
+			}
+			m_numPoints += idx - idxBegin;
+		}
+
+		// Only the writer that filled the buffer replaces it, the others 
+		// retry once it has
+		if (isFilled) {
+			lock_guard<mutex> lock(m_mutex);
+			replaceBuffer();
+		} else if (idx < numPoints) {
+			this_thread::yield();
+		}
+	}
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::flush()
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (m_pState.load()->pBuffer->seal())
+		replaceBuffer();
+	m_mergeDone.wait(lock, 
+		[this]() { return m_pState.load()->arrMerging.empty(); });
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::replaceBuffer()
+{
+	// Called with m_mutex held, the current buffer refuses new points
+	const State& state = *m_pState.load();
+	State* pState = new State(state);
+	if (state.pBuffer->getNumPoints() != 0)
+		pState->arrMerging.push_back(state.pBuffer);
+	pState->pBuffer.reset(new Buffer(m_bufferSize));
+	publish(pState);
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::publish(const State* pState)
+{
+	// Called with m_mutex held. The old state is freed by the merger once no
+	// query can still read it.
+	m_arrRetired.push_back(m_pState.exchange(pState));
+	m_wakeMerger.notify_one();
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::runMerger()
+{
+	unique_lock<mutex> lock(m_mutex);
+	for (;;) {
+		if (!m_arrRetired.empty()) {
+			vector<const State*> arrRetired;
+			arrRetired.swap(m_arrRetired);
+			lock.unlock();
+			m_epochs.synchronize();
+			for_each(begin(arrRetired), end(arrRetired), 
+				[](const State* pState) { delete pState; });
+			lock.lock();
+			continue;
+		}
+		if (m_isStopping)
+			return;
+
+		if (!m_pState.load()->arrMerging.empty())
+			mergeOldestBuffer(lock);
+		else
+			m_wakeMerger.wait(lock);
+	}
+}
+
+KD_TREE_FOREST_TEMPLATE
+void
+KD_TREE_FOREST_CLASS::mergeOldestBuffer(unique_lock<mutex>& lock)
+{
+	// The buffer carries into the first empty level, like a binary counter.
+	// Only the merger replaces levels, so they stay as read while unlocked.
+	const State& state = *m_pState.load();
+	shared_ptr<const Buffer> pBuffer = state.arrMerging.front();
+	size_t idxLevel = 0;
+	while (idxLevel < state.arrLevels.size() && state.arrLevels[idxLevel])
+		++idxLevel;
+	vector<shared_ptr<const Tree> > arrMerged(begin(state.arrLevels), 
+		begin(state.arrLevels) + idxLevel);
+	lock.unlock();
+
+	pBuffer->waitUntilWritten();
+	vector<point_t> arrPoints(pBuffer->getPoints(), 
+		pBuffer->getPoints() + pBuffer->getNumPoints());
+	for_each(begin(arrMerged), end(arrMerged), 
+		[&](const shared_ptr<const Tree>& pTree) {
+			for (size_t idx = 0; idx < pTree->getNumPoints(); ++idx)
+				arrPoints.push_back(pTree->getPoint(idx));
+		});
+	shared_ptr<const Tree> pTree(new Tree(move(arrPoints)));
+
+	lock.lock();
+	State* pState = new State(*m_pState.load());
+	pState->arrLevels.resize(max(pState->arrLevels.size(), idxLevel + 1));
+	for (size_t idx = 0; idx < idxLevel; ++idx)
+		pState->arrLevels[idx].reset();
+	pState->arrLevels[idxLevel] = pTree;
+	pState->arrMerging.erase(begin(pState->arrMerging));
+	publish(pState);
+	m_mergeDone.notify_all();
+}
+
+KD_TREE_FOREST_TEMPLATE
+size_t
+KD_TREE_FOREST_CLASS::getNumLevels() const
+{
+	ReadEpochPin pin(m_epochs);
+	const State& state = *m_pState.load();
+	return count_if(begin(state.arrLevels), end(state.arrLevels),
+		[](const shared_ptr<const Tree>& pTree) { return pTree != NULL; });
+}
+
+KD_TREE_FOREST_TEMPLATE
+bool
+KD_TREE_FOREST_CLASS::getClosestPointTo(
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	// Everything is searched in the state published when the query started
+	ReadEpochPin pin(m_epochs);
+	const State& state = *m_pState.load();
+	result = ClosestPoint();
+	state.pBuffer->getClosestPointTo(point, result);
+	for_each(begin(state.arrMerging), end(state.arrMerging),
+		[&](const shared_ptr<const Buffer>& pBuffer) {
+			pBuffer->getClosestPointTo(point, result);
+		});
+
+	// Larger levels first, they are the likeliest to bound the rest
+	for (size_t idx = state.arrLevels.size(); idx-- != 0; ) {
+		if (!state.arrLevels[idx])
+			continue;
+
+		ClosestPoint hint = result;
+		hint.idxNode = ClosestPoint::IDX_NONE;
+		ClosestPoint levelResult;
+		if (state.arrLevels[idx]->getClosestPointTo(point, hint, levelResult))
+			result = levelResult;
+	}
+
+	result.idxNode = ClosestPoint::IDX_NONE;
+	return result.distance2 != numeric_limits<real_t>::max();
+}
+
+#undef KD_TREE_FOREST_TEMPLATE
+#undef KD_TREE_FOREST_CLASS
+
+#endif // EPL_INSERTABLEKDTREE_H_
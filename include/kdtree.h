@@ -3,48 +3,414 @@
 #define EPL_KDTREE_H_
 
 #include "stdafx.h"
+#include "basickdtree.h"
+#include "dynamickdtree.h"
+#include "kdtreebuilder.h"
+#include "pagedkdtree.h"
+#include "lazykdtree.h"
+#include "pointscan.h"
+#include "insertablekdtree.h"
+#include "readepochs.h"
+#include "largepages.h"
+#include "pointcloud.h"
 
 // Forward Declarations
 class PointKDTreeImpl;
+class PointKDTreeSubscriber;
+struct KDTreeSharedControl;
+struct KDTreeVersion;
+struct KDTreeTimeBin;
 
 // Result of KDTree::getClosestPointTo()
-struct KDTreeClosestPoint
-{
-	V3x point;
-	fpreal distance2;
+typedef BasicKDTreeClosestPoint<V3x> KDTreeClosestPoint;
 
-	KDTreeClosestPoint() 
-		: point(numeric_limits<fpreal>::max())
-		, distance2(numeric_limits<fpreal>::max())
-	{}
-};
+// Disk-paged tree over files written by PointKDTree::save() or buildFile()
+typedef BasicPagedPointKDTree<3, fpreal> PagedPointKDTree;
 
-// Splitting Plane Axis
-enum KDTreeAxis 
-{
-	X_AXIS = 0,
-	Y_AXIS = 1,
-	Z_AXIS = 2
-};
+// Brute-force engine answering PointKDTree queries over few points
+typedef BasicPointScan<3, fpreal> PointScan;
 
+/// KD Tree over Points with Runtime Index Precision
+/// The narrowest index type that fits the points is chosen at construction,
+/// see visit() for calling into the statically typed tree directly. Trees
+/// built from at most KD_TREE_SCAN_MAX_POINTS points answer queries with a
+/// PointScan over the tree's points instead, results carry the tree's nodes.
 class PointKDTree : public Uncopyable 
 {
 public: // methods
 	PointKDTree(const vector<V3x>& arrPoints);
 	PointKDTree(vector<V3x>&& arrPoints);
+
+	// Non-owning tree over numPoints external points, e.g. the positions of
+	// an interleaved vertex buffer or a memory-mapped file. Point i starts 
+	// at (const char*)pCoords + i*byteStride. Nothing is copied or moved,
+	// the buffer must stay valid for the tree's lifetime and may only 
+	// change if refit() is called before the next query.
+	PointKDTree(const fpreal* pCoords, size_t byteStride, size_t numPoints);
 	~PointKDTree();
 
 	bool getClosestPointTo(
 		const V3x& point,
 		KDTreeClosestPoint& out_result) const;
 
+	// Warm-started query for points that move only slightly between calls.
+	// The search starts at hint.idxNode, usually a previous result from the
+	// same tree, and is bounded by that node's distance to point. Without a
+	// node, hint.distance2 bounds the search and false is returned if no 
+	// point lies closer than it.
+	bool getClosestPointTo(
+		const V3x& point,
+		const KDTreeClosestPoint& hint,
+		KDTreeClosestPoint& out_result) const;
+
+	// Answers a batch of queries in any order, internally visiting them 
+	// along a Morton curve and traversing neighbouring queries together as
+	// SIMD packets. Results are returned in the order of arrPoints.
+	bool getClosestPointsTo(
+		const vector<V3x>& arrPoints,
+		vector<KDTreeClosestPoint>& out_results) const;
+
 	bool isBalanced() const;
 	void dump(ostream& out) const;
 
+	// Tombstones every point inside box, see BasicPointKDTree::eraseInBox()
+	size_t eraseInBox(const Box<V3x>& box);
+	size_t getNumLivePoints() const;
+	void setCompactionThreshold(double fraction);
+
+	// Rebuilds a tree owning its points from the live ones, see
+	// BasicPointKDTree::compact(). Returns false for trees over external
+	// or opened points and for trees without erased points.
+	bool compact();
+
+	// Updates a tree over external points after they moved in place, see
+	// BasicPointKDTree::refit(). Returns false for opened trees.
+	bool refit();
+	void setRefitThreshold(double overlap);
+	double getRefitOverlap() const;
+
+	// Combines two trees, e.g. of neighbouring tiles, into a new one. Trees
+	// whose bounds barely overlap keep their partitions and are grafted 
+	// under a new root, see BasicPointKDTree::merge().
+	static unique_ptr<PointKDTree> merge(const PointKDTree& a,
+		const PointKDTree& b);
+
+	// Writes the tree in a versioned, checksummed format that open() maps
+	// and queries in place, so startup costs only the page faults it takes.
+	// Refit extents and tombstones are kept, so the opened tree has this
+	// tree's point and node indices. Call compact() first to leave erased
+	// points out of the file.
+	bool save(const string& path) const;
+
+	// Returns NULL if path does not hold a tree written by save(). flags is
+	// a combination of KDTreeOpenFlags, e.g. KD_TREE_OPEN_PREFETCH to fault
+	// in the whole file before the first query.
+	static unique_ptr<PointKDTree> open(const string& path, int flags = 0);
+
+	// Builds a tree over a file of packed V3x too large for memory, holding
+	// at most memoryBudget bytes of points and nodes at once, and writes it
+	// to outputPath for open()
+	static bool buildFile(const string& inputPath, const string& outputPath,
+		size_t memoryBudget);
+
+	// Calls visitor(tree) once with the concrete BasicPointKDTree<uint_t>
+	// behind this tree, so tight query loops inside the visitor are resolved
+	// statically and can inline. The visitor must accept every index width,
+	// e.g. a functor with a templated operator().
+	template <typename visitor_t>
+	void visit(visitor_t&& visitor) const;
+
+private: // methods
+	friend class PointKDTreeSubscriber;
+	friend class PointKDTreePublisher;
+
+	PointKDTree(PointKDTreeImpl* pImpl);
+	static unique_ptr<PointKDTree> open(const shared_ptr<MappedFile>& pFile,
+		int flags);
+
+#define KD_TREE_DECLARE_GET_TREE(bits) \
+	const BasicPointKDTree<uint##bits##_t>* getTree##bits() const;
+
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_DECLARE_GET_TREE)
+#undef KD_TREE_DECLARE_GET_TREE
+
 private: // members
 	const unique_ptr<PointKDTreeImpl> m_pImpl;
 };
 
+template <typename visitor_t>
+void
+PointKDTree::visit(visitor_t&& visitor) const
+{
+#define KD_TREE_VISIT_TREE(bits) \
+	if (const BasicPointKDTree<uint##bits##_t>* pTree = getTree##bits()) { \
+		visitor(*pTree); \
+		return; \
+	}
+
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_VISIT_TREE)
+#undef KD_TREE_VISIT_TREE
+}
+
+/// KD Tree Answering Queries while it is Built
+/// The tree is built on a background thread over the points in place, with
+/// the external points constructor so nothing is reordered under readers.
+/// Until it is done queries are answered by an exhaustive SIMD scan, then
+/// the finished tree is switched in atomically.
+class ProgressivePointKDTree : public Uncopyable
+{
+public: // methods
+	ProgressivePointKDTree(vector<V3x>&& arrPoints);
+	~ProgressivePointKDTree();
+
+	bool isBuilt() const { return getTree() != NULL; }
+	void waitUntilBuilt();
+
+	// The full tree once built, otherwise NULL
+	const PointKDTree* getTree() const 
+		{ return m_pBuiltTree.load(memory_order_acquire); }
+
+	// Results of the scan leave idxNode unset
+	bool getClosestPointTo(
+		const V3x& point,
+		KDTreeClosestPoint& out_result) const;
+
+private: // members
+	const vector<V3x> m_arrPoints;
+	unique_ptr<PointKDTree> m_pTree; // written by the builder thread only
+	atomic<const PointKDTree*> m_pBuiltTree;
+	thread m_builder;
+};
+
+/// Handle Replacing PointKDTrees under Concurrent Readers
+/// Readers take a Snapshot, which pins an epoch and holds the version that
+/// was current at that moment, unchanged and valid until the snapshot is
+/// destroyed. publish() swaps the next version in with one atomic pointer
+/// exchange and never waits for readers. Taking and releasing a snapshot
+/// is a counter update each, readers never retry, free or wait. Replaced
+/// versions are freed by the writer, in publish() or reclaim(), once no
+/// snapshot can still hold them.
+class VersionedPointKDTree : public Uncopyable
+{
+public: // types
+	class Snapshot : public Uncopyable
+	{
+	public: // methods
+		explicit Snapshot(const VersionedPointKDTree& versioned);
+		~Snapshot();
+
+		// NULL before the first publish()
+		const PointKDTree* getTree() const;
+
+		// Number of publish() calls this snapshot's tree is the result of
+		uint64_t getVersion() const;
+
+	private: // members
+		const VersionedPointKDTree& m_versioned;
+		const int m_slot;
+		const KDTreeVersion* m_pVersion;
+	};
+
+public: // methods
+	VersionedPointKDTree();
+	~VersionedPointKDTree();
+
+	// Returns the new version number
+	uint64_t publish(unique_ptr<PointKDTree> pTree);
+	uint64_t getVersion() const;
+
+	// Frees the replaced versions no snapshot holds any more. publish()
+	// calls this, a version still held then stays until the next call.
+	void reclaim();
+
+	// Queries a snapshot taken for this call only
+	bool getClosestPointTo(
+		const V3x& point,
+		KDTreeClosestPoint& out_result) const;
+
+private: // members
+	mutable ReadEpochs m_epochs;
+	atomic<const KDTreeVersion*> m_pVersion;
+
+	// Serialises publish() and reclaim(), guards the members below
+	mutex m_mutex;
+	vector<pair<const KDTreeVersion*, unsigned> > m_arrRetired;
+};
+
+/// Sliding Time Window over Streamed Point Frames
+/// Frames are binned by their time stamp into intervals of binDuration
+/// seconds. While a bin is the newest, each frame gets its own tree. Once a
+/// later bin starts the frame trees are merged into one on a background
+/// thread, which replaces them at the next addFrame() or advanceTo() after
+/// it is done. Bins that have left the window are dropped whole, without
+/// touching the others, so the window is rounded out to whole bins. 
+/// Queries visit the bins nearest to the point first and skip those
+/// farther away than the closest point found so far.
+class WindowedPointKDTree : public Uncopyable
+{
+public: // methods
+	WindowedPointKDTree(double window, double binDuration);
+	~WindowedPointKDTree();
+
+	// Frames must arrive in time order, false is returned for a frame
+	// stamped before the latest time seen
+	bool addFrame(double time, const vector<V3x>& arrPoints);
+
+	// Drops the bins that left the window ending at time
+	void advanceTo(double time);
+
+	// Waits for the bins being merged and swaps their merged trees in
+	void waitUntilMerged();
+
+	size_t getNumBins() const { return m_bins.size(); }
+	size_t getNumTrees() const;
+	size_t getNumPoints() const;
+
+	bool getClosestPointTo(
+		const V3x& point,
+		KDTreeClosestPoint& out_result) const;
+
+private: // methods
+	int64_t getInterval(double time) const;
+	void closeNewestBin();
+	void adoptMergedBins();
+
+private: // members
+	const double m_window;
+	const double m_binDuration;
+	double m_time;
+	deque<unique_ptr<KDTreeTimeBin> > m_bins; // oldest first
+};
+
+/// Forest of Spatially Partitioned PointKDTrees
+/// Points are split into numShards boxes by recursive median splits of the
+/// widest axis, each shard is built on its own thread. The threads are 
+/// bound to the NUMA nodes in turn, so shards spread over the nodes' memory.
+/// Queries visit the shards nearest to the point first and stop at the
+/// first shard farther away than the closest point found so far. Shards
+/// are independent units, one can be rebuilt without touching the others.
+class ShardedPointKDTree : public Uncopyable
+{
+public: // static members
+	// Smallest batch share worth a thread of its own
+	static const size_t MIN_QUERIES_PER_THREAD = 256;
+
+public: // methods
+	ShardedPointKDTree(const vector<V3x>& arrPoints, size_t numShards);
+	~ShardedPointKDTree();
+
+	size_t getNumShards() const { return m_shards.size(); }
+	const PointKDTree& getShard(size_t idxShard) const 
+		{ return *m_shards[idxShard]; }
+	const Box<V3x>& getShardBounds(size_t idxShard) const 
+		{ return m_shardBounds[idxShard]; }
+
+	// Replaces a shard's points, e.g. once its region was rescanned. Points
+	// may leave the shard's old bounds. The shard is placed on the node of
+	// the calling thread. Not safe while queries run.
+	void rebuildShard(size_t idxShard, vector<V3x>&& arrPoints);
+
+	size_t getNumPoints() const;
+	bool getClosestPointTo(
+		const V3x& point,
+		KDTreeClosestPoint& out_result) const;
+
+	// Answers a batch of queries on several threads, results are returned
+	// in the order of arrPoints and leave idxNode unset
+	bool getClosestPointsTo(
+		const vector<V3x>& arrPoints,
+		vector<KDTreeClosestPoint>& out_results) const;
+
+private: // members
+	vector<unique_ptr<PointKDTree> > m_shards;
+	vector<Box<V3x> > m_shardBounds;
+};
+
+/// PointKDTree Replicated on every NUMA Node
+/// Each replica is built by a thread bound to its node's processors, so its
+/// points and nodes are first touched, and placed, in that node's memory.
+/// Queries go to the replica of the node the calling thread runs on, which
+/// trades a copy of the tree per node for local memory latency. Nodes and
+/// processors are identified with their processor group, so machines with
+/// more than 64 logical processors get a replica per node as well.
+/// NOTE: a node spanning several processor groups, which Windows allows
+///       from Windows 11 and Server 2022 on, builds its replica on the
+///       processors of its primary group.
+class ReplicatedPointKDTree : public Uncopyable
+{
+public: // methods
+	ReplicatedPointKDTree(const vector<V3x>& arrPoints);
+	~ReplicatedPointKDTree();
+
+	size_t getNumReplicas() const { return m_replicas.size(); }
+	const PointKDTree& getReplica(size_t idxReplica) const
+		{ return *m_replicas[idxReplica]; }
+
+	// Replica of the node the calling thread currently runs on
+	size_t getIdxLocalReplica() const;
+	const PointKDTree& getLocalReplica() const
+		{ return *m_replicas[getIdxLocalReplica()]; }
+
+	bool getClosestPointTo(
+		const V3x& point,
+		KDTreeClosestPoint& out_result) const;
+	bool getClosestPointsTo(
+		const vector<V3x>& arrPoints,
+		vector<KDTreeClosestPoint>& out_results) const;
+
+private: // members
+	vector<unique_ptr<PointKDTree> > m_replicas;
+	vector<size_t> m_nodeReplicas; // replica of every NUMA node
+};
+
+/// Publishes PointKDTrees to Worker Processes through Shared Memory
+/// Each publish() copies the tree into a new named segment and then swaps
+/// the generation number that subscribers of the same name read, so a tree
+/// is built once per host and workers attach to it read-only. Segments hold
+/// the offset-based image written by PointKDTree::save(). The previous 
+/// generation stays open for workers still attaching to it, older ones are
+/// freed once the last worker using them lets go.
+class PointKDTreePublisher : public Uncopyable
+{
+public: // methods
+	PointKDTreePublisher(const string& name);
+
+	// False if the name is already taken by another publisher
+	bool isValid() const { return m_control.isOpen(); }
+
+	bool publish(const PointKDTree& tree);
+	uint32_t getGeneration() const { return m_generation; }
+
+private: // members
+	string m_name;
+	MappedFile m_control;
+	MappedFile m_segments[2];
+	uint32_t m_generation;
+};
+
+/// Attaches Worker Processes to Trees of a PointKDTreePublisher
+class PointKDTreeSubscriber : public Uncopyable
+{
+public: // methods
+	PointKDTreeSubscriber(const string& name);
+
+	// False until a publisher of this name exists
+	bool isValid() const { return m_control.isOpen(); }
+
+	// Latest published generation, 0 before the first publish(). Cheap 
+	// enough to poll between queries to notice a newer tree.
+	uint32_t getGeneration() const;
+
+	// Maps the latest published tree, which stays valid after newer ones
+	// are published. Returns NULL if nothing was published yet.
+	unique_ptr<PointKDTree> attach(int flags = 0,
+		uint32_t* out_generation = NULL) const;
+
+private: // members
+	string m_name;
+	MappedFile m_control;
+};
+
 /// @{
 /// KD Tree Unit Tests
 static inline void fillPoints(
@@ -118,9 +484,10 @@ fillPointsAlongAxis(
 	fillTimer.print();
 }
 
+template <typename tree_t>
 static inline void
 queryTreeAlongAxis(
-	unique_ptr<PointKDTree>& tree,
+	const tree_t& tree,
 	size_t numPoints,
 	KDTreeAxis axis)
 {
@@ -133,7 +500,7 @@ queryTreeAlongAxis(
 		KDTreeClosestPoint result;
 		V3x queryPoint(0);
 		queryPoint[axis] = static_cast<fpreal>(idx+0.025);
-		bool gotPoint = tree->getClosestPointTo(queryPoint, result);
+		bool gotPoint = tree.getClosestPointTo(queryPoint, result);
 		REQUIRE(gotPoint);
 
 		V3x expectedResult(0);
@@ -154,13 +521,1458 @@ createAxisSplitTest(KDTreeAxis axis)
 	cout << "\n";
 	vector<V3x> arrPoints;
 	fillPointsAlongAxis(arrPoints, numPoints, axis);
+
+	// A PointKDTree this small answers by scanning, so the statically typed
+	// tree it holds is also built and walked directly
+	BasicPointKDTree<uint8_t> walkedTree(arrPoints);
+	REQUIRE(walkedTree.isBalanced());
+	cout << "\n";
+	walkedTree.dump(cout);
+	queryTreeAlongAxis(walkedTree, numPoints, axis);
+
 	auto kdtree = buildTree(arrPoints);
 	cout << "\n";
 	kdtree->dump(cout);
-	queryTreeAlongAxis(kdtree, numPoints, axis);
+	queryTreeAlongAxis(*kdtree, numPoints, axis);
 	return kdtree;
 }
 
+static inline void
+fillQueryGrid(
+	vector<V3x>& arrQueries,
+	size_t numPerAxis,
+	fpreal spacing)
+{
+	arrQueries.clear();
+	arrQueries.reserve(numPerAxis * numPerAxis * numPerAxis);
+	for (size_t z = 0; z < numPerAxis; ++z)
+	for (size_t y = 0; y < numPerAxis; ++y)
+	for (size_t x = 0; x < numPerAxis; ++x) {
+		arrQueries.emplace_back(V3x(
+			static_cast<fpreal>(x) * spacing,
+			static_cast<fpreal>(y) * spacing,
+			static_cast<fpreal>(z) * spacing));
+	}
+}
+
+static inline KDTreeClosestPoint
+getClosestPointBruteForce(
+	const vector<V3x>& arrPoints,
+	const V3x& query)
+{
+	KDTreeClosestPoint result;
+	for_each(begin(arrPoints), end(arrPoints), [&](const V3x& point) {
+		fpreal distance2 = (point - query).length2();
+		if (distance2 < result.distance2) {
+			result.point = point;
+			result.distance2 = distance2;
+		}
+	});
+	return result;
+}
+
+namedtest("closest point matches brute force")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 5000);
+	PointKDTree kdtree(arrPoints);
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 12, RAND_MAX / 11.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		KDTreeClosestPoint expected = 
+			getClosestPointBruteForce(arrPoints, query);
+		REQUIRE_EQUAL(result.distance2, expected.distance2);
+	});
+}
+
+namedtest("packet queries match single queries")
+{
+	cout << "\n";
+	auto kdtree = createKDTreeTest(256*1000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 40, RAND_MAX / 390.0);
+	arrQueries.pop_back(); // exercise a partial packet
+	random_shuffle(begin(arrQueries), end(arrQueries));
+
+	Timer packetTimer("packet queries");
+	packetTimer.start();
+	vector<KDTreeClosestPoint> arrResults;
+	REQUIRE(kdtree->getClosestPointsTo(arrQueries, arrResults));
+	packetTimer.stop();
+	packetTimer.print();
+	REQUIRE_EQUAL(arrResults.size(), arrQueries.size());
+
+	Timer singleTimer("single queries");
+	singleTimer.start();
+	for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree->getClosestPointTo(arrQueries[idx], result));
+		REQUIRE_EQUAL(arrResults[idx].distance2, result.distance2);
+	}
+	singleTimer.stop();
+	singleTimer.print();
+}
+
+namedtest("8 wide query packets match single queries")
+{
+	vector<V3x> arrPoints, arrQueries;
+	fillPoints(arrPoints, 100*1000);
+	fillQueryGrid(arrQueries, 20, RAND_MAX / 190.0);
+	arrQueries.resize(arrQueries.size() - 3); // exercise a partial packet
+	BasicPointKDTree<uint32_t> kdtree(arrPoints);
+
+	const size_t numQueries = arrQueries.size();
+	vector<KDTreeClosestPoint> arrResults(numQueries);
+	REQUIRE(kdtree.getClosestPointsTo<8>(&arrQueries[0], numQueries,
+		&arrResults[0]));
+	for (size_t idx = 0; idx < numQueries; ++idx) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+		REQUIRE_EQUAL(arrResults[idx].distance2, result.distance2);
+	}
+}
+
+namedtest("warm-started queries match cold queries")
+{
+	// Small trees answer through a scan, whose results must warm-start
+	// later queries like the tree's own
+	const size_t arrNumPoints[] = { 256*1000, 100 };
+	for_each(begin(arrNumPoints), end(arrNumPoints), [](size_t numPoints) {
+		cout << "\n";
+		auto kdtree = createKDTreeTest(numPoints);
+		vector<V3x> arrQueries;
+		fillQueryGrid(arrQueries, 10, RAND_MAX / 9.0);
+
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			KDTreeClosestPoint hint;
+			REQUIRE(kdtree->getClosestPointTo(query, hint));
+			REQUIRE(hint.idxNode != KDTreeClosestPoint::IDX_NONE);
+
+			// Drift the query a little each frame, starting from the last
+			// result
+			V3x movedQuery(query);
+			for (int frame = 0; frame < 8; ++frame) {
+				movedQuery += V3x(97, -61, 43);
+				KDTreeClosestPoint result, expected;
+				REQUIRE(kdtree->getClosestPointTo(movedQuery, hint, result));
+				REQUIRE(kdtree->getClosestPointTo(movedQuery, expected));
+				REQUIRE_EQUAL(result.distance2, expected.distance2);
+				hint = result;
+			}
+		});
+
+		// A search radius alone only finds points within it
+		KDTreeClosestPoint radius;
+		radius.distance2 = 0;
+		KDTreeClosestPoint result;
+		REQUIRE(!kdtree->getClosestPointTo(V3x(-1), radius, result));
+		radius.distance2 = numeric_limits<fpreal>::max();
+		REQUIRE(kdtree->getClosestPointTo(V3x(-1), radius, result));
+	});
+}
+
+struct CountingClosestPointVisitor
+{
+	const vector<V3x>& arrQueries;
+	size_t numFound;
+
+	CountingClosestPointVisitor(const vector<V3x>& queries)
+		: arrQueries(queries)
+		, numFound(0)
+	{}
+
+	template <typename uint_t>
+	void operator()(const BasicPointKDTree<uint_t>& tree)
+	{
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			KDTreeClosestPoint result;
+			if (tree.getClosestPointTo(query, result))
+				++numFound;
+		});
+	}
+};
+
+namedtest("visit statically typed tree")
+{
+	cout << "\n";
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 10, RAND_MAX / 9.0);
+
+	auto kdtree = createKDTreeTest(1000);
+	CountingClosestPointVisitor visitor(arrQueries);
+	kdtree->visit(visitor);
+	REQUIRE_EQUAL(visitor.numFound, arrQueries.size());
+
+	vector<Vec3<float> > arrPoints(1, Vec3<float>(1, 2, 3));
+	BasicPointKDTree<uint32_t, 3, float> floatTree(arrPoints);
+	BasicKDTreeClosestPoint<Vec3<float> > result;
+	REQUIRE(floatTree.getClosestPointTo(Vec3<float>(1, 2, 4), result));
+	REQUIRE_EQUAL(result.point, arrPoints[0]);
+	REQUIRE_EQUAL(result.distance2, 1.0f);
+}
+
+template <int DIM>
+static inline void
+fillPointsInDim(
+	vector<typename KDTreePointTraits<DIM, fpreal>::point_t>& arrPoints,
+	size_t numPoints)
+{
+	arrPoints.resize(numPoints);
+	for (size_t idx = 0; idx < numPoints; ++idx)
+		for (int axis = 0; axis < DIM; ++axis)
+			arrPoints[idx][axis] = static_cast<fpreal>(rand() % 1000);
+}
+
+template <int DIM>
+static inline void
+testClosestPointsInDim(size_t numPoints, size_t numQueries)
+{
+	typedef typename KDTreePointTraits<DIM, fpreal>::point_t point_t;
+	typedef BasicPointKDTree<uint32_t, DIM> Tree;
+
+	srand(DIM);
+	vector<point_t> arrPoints, arrQueries;
+	fillPointsInDim<DIM>(arrPoints, numPoints);
+	fillPointsInDim<DIM>(arrQueries, numQueries);
+	Tree kdtree(arrPoints);
+	REQUIRE(kdtree.isBalanced());
+
+	vector<typename Tree::ClosestPoint> arrResults(numQueries);
+	REQUIRE(kdtree.getClosestPointsTo(&arrQueries[0], numQueries, 
+		&arrResults[0]));
+	for (size_t idx = 0; idx < numQueries; ++idx) {
+		fpreal expected = numeric_limits<fpreal>::max();
+		for_each(begin(arrPoints), end(arrPoints), [&](const point_t& point) {
+			expected = min(expected, 
+				getDistance2<DIM>(point, arrQueries[idx]));
+		});
+
+		typename Tree::ClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+		REQUIRE_EQUAL(result.distance2, expected);
+		REQUIRE_EQUAL(arrResults[idx].distance2, expected);
+	}
+}
+
+namedtest("2d, 4d and 7d kdtrees")
+{
+	testClosestPointsInDim<2>(2000, 200);
+	testClosestPointsInDim<4>(2000, 200);
+	testClosestPointsInDim<7>(2000, 200);
+}
+
+namedtest("runtime dimension kdtree")
+{
+	static const size_t dim = 12;
+	static const size_t numPoints = 2000;
+	srand(1987);
+	vector<fpreal> arrCoords(dim * numPoints);
+	for_each(begin(arrCoords), end(arrCoords), [](fpreal& coord) {
+		coord = static_cast<fpreal>(rand() % 100);
+	});
+	BasicDynamicPointKDTree<uint16_t> kdtree(arrCoords, dim);
+	REQUIRE(kdtree.isBalanced());
+	REQUIRE_EQUAL(kdtree.getNumPoints(), numPoints);
+
+	vector<fpreal> query(dim);
+	for (int idxQuery = 0; idxQuery < 100; ++idxQuery) {
+		for_each(begin(query), end(query), [](fpreal& coord) {
+			coord = static_cast<fpreal>(rand() % 100);
+		});
+
+		fpreal expected = numeric_limits<fpreal>::max();
+		for (size_t idxPoint = 0; idxPoint < numPoints; ++idxPoint) {
+			fpreal distance2 = 0;
+			for (size_t axis = 0; axis < dim; ++axis) {
+				fpreal diff = arrCoords[idxPoint*dim + axis] - query[axis];
+				distance2 += diff * diff;
+			}
+			expected = min(expected, distance2);
+		}
+
+		KDTreeDynamicClosestPoint<fpreal> result;
+		REQUIRE(kdtree.getClosestPointTo(&query[0], result));
+		REQUIRE_EQUAL(result.distance2, expected);
+	}
+}
+
+struct TestVertex
+{
+	V3x normal;
+	V3x position;
+	uint32_t color;
+};
+
+namedtest("kdtree over strided external points")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 10000);
+	vector<TestVertex> arrVertices(arrPoints.size());
+	for (size_t idx = 0; idx < arrPoints.size(); ++idx) {
+		arrVertices[idx].normal = V3x(0, 0, 1);
+		arrVertices[idx].position = arrPoints[idx];
+		arrVertices[idx].color = static_cast<uint32_t>(idx);
+	}
+
+	PointKDTree kdtree(&arrVertices[0].position.x, sizeof(TestVertex),
+		arrVertices.size());
+	REQUIRE(kdtree.isBalanced());
+	for (size_t idx = 0; idx < arrPoints.size(); ++idx)
+		REQUIRE_EQUAL(arrVertices[idx].position, arrPoints[idx]);
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 8, RAND_MAX / 7.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		KDTreeClosestPoint expected = 
+			getClosestPointBruteForce(arrPoints, query);
+		REQUIRE_EQUAL(result.distance2, expected.distance2);
+	});
+}
+
+namedtest("save and open kdtree")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 10000);
+	PointKDTree kdtree(arrPoints);
+
+	const string path = "kdtree_test.kdt";
+	REQUIRE(kdtree.save(path));
+	unique_ptr<PointKDTree> pOpened = PointKDTree::open(path,
+		KD_TREE_OPEN_VERIFY | KD_TREE_OPEN_PREFETCH);
+	REQUIRE(pOpened);
+	REQUIRE(pOpened->isBalanced());
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 8, RAND_MAX / 7.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint expected, result;
+		REQUIRE(kdtree.getClosestPointTo(query, expected));
+		REQUIRE(pOpened->getClosestPointTo(query, result));
+		REQUIRE_EQUAL(result.point, expected.point);
+		REQUIRE_EQUAL(result.idxNode, expected.idxNode);
+	});
+	pOpened.reset();
+
+	// A flipped point coordinate must fail verification
+	{
+		fstream file(path.c_str(), ios::in | ios::out | ios::binary);
+		file.seekp(-1, ios::end);
+		file.put('\x7f');
+	}
+	REQUIRE(PointKDTree::open(path));
+	REQUIRE(!PointKDTree::open(path, KD_TREE_OPEN_VERIFY));
+	REQUIRE(!PointKDTree::open("missing.kdt"));
+	remove(path.c_str());
+}
+
+namedtest("publish and attach shared kdtree")
+{
+	cout << "\n";
+	const string name = "KDTreeSharedTest";
+	PointKDTreeSubscriber early(name);
+	REQUIRE(!early.isValid());
+
+	PointKDTreePublisher publisher(name);
+	REQUIRE(publisher.isValid());
+	REQUIRE(!PointKDTreePublisher(name).isValid());
+
+	PointKDTreeSubscriber subscriber(name);
+	REQUIRE(subscriber.isValid());
+	REQUIRE_EQUAL(subscriber.getGeneration(), 0u);
+	REQUIRE(!subscriber.attach());
+
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 1000);
+	PointKDTree first(arrPoints);
+	REQUIRE(publisher.publish(first));
+	uint32_t generation = 0;
+	unique_ptr<PointKDTree> pAttached = 
+		subscriber.attach(KD_TREE_OPEN_VERIFY, &generation);
+	REQUIRE(pAttached);
+	REQUIRE_EQUAL(generation, 1u);
+
+	// A newer tree is picked up by attaching again, the old one stays usable
+	fillPoints(arrPoints, 2000);
+	PointKDTree second(arrPoints);
+	REQUIRE(publisher.publish(second));
+	REQUIRE(publisher.publish(second));
+	REQUIRE_EQUAL(subscriber.getGeneration(), 3u);
+	unique_ptr<PointKDTree> pRefreshed = subscriber.attach(KD_TREE_OPEN_VERIFY);
+	REQUIRE(pRefreshed);
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint expected, result;
+		REQUIRE(first.getClosestPointTo(query, expected));
+		REQUIRE(pAttached->getClosestPointTo(query, result));
+		REQUIRE_EQUAL(result.point, expected.point);
+		REQUIRE(second.getClosestPointTo(query, expected));
+		REQUIRE(pRefreshed->getClosestPointTo(query, result));
+		REQUIRE_EQUAL(result.point, expected.point);
+	});
+}
+
+namedtest("out-of-core kdtree build")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 20000);
+
+	// Duplicates exercise points on the splitting planes of on-disk runs
+	copy(begin(arrPoints), begin(arrPoints) + 1000, begin(arrPoints) + 1000);
+
+	const string inputPath = "kdtree_test.points";
+	const string outputPath = "kdtree_test.kdt";
+	{
+		ofstream out(inputPath.c_str(), ios::out | ios::binary | ios::trunc);
+		out.write(reinterpret_cast<const char*>(&arrPoints[0]), 
+			arrPoints.size() * sizeof(V3x));
+	}
+
+	// Budget of about 500 points forces several levels of on-disk runs
+	REQUIRE(PointKDTree::buildFile(inputPath, outputPath, 
+		500 * (sizeof(V3x) + 16)));
+	unique_ptr<PointKDTree> pTree = 
+		PointKDTree::open(outputPath, KD_TREE_OPEN_VERIFY);
+	REQUIRE(pTree);
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 8, RAND_MAX / 7.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(pTree->getClosestPointTo(query, result));
+		KDTreeClosestPoint expected = 
+			getClosestPointBruteForce(arrPoints, query);
+		REQUIRE_EQUAL(result.distance2, expected.distance2);
+	});
+
+	pTree.reset();
+
+	// Budgets of a point or two leave empty runs, which are removed too
+	for (size_t numBudgetPoints = 1; numBudgetPoints <= 2; ++numBudgetPoints) {
+		REQUIRE(PointKDTree::buildFile(inputPath, outputPath,
+			numBudgetPoints * (sizeof(V3x) + 16)));
+		for (size_t idxRun = 0; idxRun < 2 * arrPoints.size(); ++idxRun) {
+			ostringstream runPath;
+			runPath << outputPath << ".run" << idxRun;
+			REQUIRE(!ifstream(runPath.str().c_str()));
+		}
+	}
+
+	remove(inputPath.c_str());
+	remove(outputPath.c_str());
+}
+
+namedtest("disk-paged kdtree")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 20000);
+	const string path = "kdtree_test.kdt";
+	REQUIRE(PointKDTree(arrPoints).save(path));
+
+	// Pages of 4096 bytes leave points straddling page boundaries
+	const size_t cacheBytes = 16 * 4096;
+	PagedPointKDTree kdtree;
+	REQUIRE(kdtree.open(path, cacheBytes, 4096, 4));
+	REQUIRE(kdtree.getPinnedBytes() != 0);
+	REQUIRE_EQUAL(kdtree.getNumPoints(), arrPoints.size());
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 8, RAND_MAX / 7.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		KDTreeClosestPoint expected = 
+			getClosestPointBruteForce(arrPoints, query);
+		REQUIRE_EQUAL(result.distance2, expected.distance2);
+		REQUIRE(kdtree.getCachedBytes() <= cacheBytes);
+	});
+	REQUIRE(kdtree.getCacheHits() != 0);
+	REQUIRE(kdtree.getCacheMisses() != 0);
+	remove(path.c_str());
+}
+
+namedtest("disk-paged kdtree keeps only its top levels resident")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 200000);
+	const string path = "kdtree_test.kdt";
+	REQUIRE(PointKDTree(arrPoints).save(path));
+	uint64_t fileSize = ifstream(path.c_str(), ios::binary | ios::ate).tellg();
+
+	// In post-order the top levels touch every page of the file
+	PagedPointKDTree kdtree;
+	REQUIRE(kdtree.open(path, 1 << 20));
+	REQUIRE(kdtree.getPinnedBytes() != 0);
+	REQUIRE(kdtree.getPinnedBytes() < fileSize / 8);
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		KDTreeClosestPoint expected = 
+			getClosestPointBruteForce(arrPoints, query);
+		REQUIRE_EQUAL(result.distance2, expected.distance2);
+		REQUIRE(kdtree.getCachedBytes() <= 1 << 20);
+	});
+	remove(path.c_str());
+}
+
+namedtest("load ply and xyz point clouds")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 5000);
+	for_each(begin(arrPoints), end(arrPoints), [](V3x& point) {
+		point.x = static_cast<float>(point.x);
+		point.z = static_cast<float>(point.z);
+	});
+
+	// Interleaved with a property the loader skips, y stored as double
+	const string plyPath = "kdtree_test.ply";
+	{
+		ofstream out(plyPath.c_str(), ios::out | ios::binary | ios::trunc);
+		out << "ply\nformat binary_little_endian 1.0\n"
+			<< "element vertex " << arrPoints.size() << "\n"
+			<< "property float x\nproperty uchar red\n"
+			<< "property double y\nproperty float z\n"
+			<< "element face 0\nproperty list uchar int vertex_indices\n"
+			<< "end_header\n";
+		for_each(begin(arrPoints), end(arrPoints), [&](const V3x& point) {
+			float x = static_cast<float>(point.x);
+			float z = static_cast<float>(point.z);
+			out.write(reinterpret_cast<const char*>(&x), sizeof(x));
+			out.put('\xff');
+			out.write(reinterpret_cast<const char*>(&point.y), sizeof(point.y));
+			out.write(reinterpret_cast<const char*>(&z), sizeof(z));
+		});
+	}
+
+	const string xyzPath = "kdtree_test.xyz";
+	{
+		ofstream out(xyzPath.c_str());
+		out << "# x y z intensity\n\n";
+		out.precision(17);
+		for_each(begin(arrPoints), end(arrPoints), [&](const V3x& point) {
+			out << point.x << " " << point.y << "\t" << point.z << " 1\n";
+		});
+	}
+
+	vector<V3x> arrPLYPoints, arrXYZPoints;
+	REQUIRE(loadPointCloud(plyPath, arrPLYPoints));
+	REQUIRE(loadPointCloud(xyzPath, arrXYZPoints));
+	REQUIRE(arrPLYPoints == arrPoints);
+	REQUIRE(arrXYZPoints == arrPoints);
+	REQUIRE(!loadPointCloud("missing.ply", arrPLYPoints));
+
+	PointKDTree kdtree(move(arrXYZPoints));
+	REQUIRE(kdtree.isBalanced());
+	remove(plyPath.c_str());
+	remove(xyzPath.c_str());
+}
+
+namedtest("lazy kdtree builds only queried ranges")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 20000);
+	BasicLazyPointKDTree<uint32_t> kdtree(vector<V3x>(arrPoints), 256);
+	REQUIRE(kdtree.getNumDeferredRanges() > 1);
+	REQUIRE_EQUAL(kdtree.getNumBuiltRanges(), 0u);
+
+	// A query near one corner only reaches the ranges around it
+	BasicLazyPointKDTree<uint32_t>::ClosestPoint result;
+	REQUIRE(kdtree.getClosestPointTo(V3x(0), result));
+	REQUIRE_EQUAL(result.distance2, 
+		getClosestPointBruteForce(arrPoints, V3x(0)).distance2);
+	REQUIRE(kdtree.getNumBuiltRanges() < kdtree.getNumDeferredRanges());
+
+	// Concurrent queries race to build the remaining ranges
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 8, RAND_MAX / 7.0);
+	vector<char> arrMatches(arrQueries.size(), 0);
+	vector<thread> arrThreads;
+	for (size_t idxThread = 0; idxThread < 4; ++idxThread) {
+		arrThreads.push_back(thread([&, idxThread]() {
+			for (size_t idx = idxThread; idx < arrQueries.size(); idx += 4) {
+				BasicLazyPointKDTree<uint32_t>::ClosestPoint result;
+				kdtree.getClosestPointTo(arrQueries[idx], result);
+				arrMatches[idx] = result.distance2 == getClosestPointBruteForce(
+					arrPoints, arrQueries[idx]).distance2;
+			}
+		}));
+	}
+	for_each(begin(arrThreads), end(arrThreads), [](thread& t) { t.join(); });
+	REQUIRE(find(begin(arrMatches), end(arrMatches), 0) == end(arrMatches));
+}
+
+namedtest("progressive kdtree answers queries while building")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 200000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 4, RAND_MAX / 3.0);
+
+	ProgressivePointKDTree kdtree((vector<V3x>(arrPoints)));
+	auto checkQueries = [&]() {
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			KDTreeClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(query, result));
+			KDTreeClosestPoint expected = 
+				getClosestPointBruteForce(arrPoints, query);
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+		});
+	};
+
+	checkQueries();
+	kdtree.waitUntilBuilt();
+	REQUIRE(kdtree.isBuilt());
+	REQUIRE(kdtree.getTree()->isBalanced());
+	checkQueries();
+}
+
+namedtest("insertable kdtree")
+{
+	cout << "\n";
+	typedef BasicInsertablePointKDTree<uint32_t> InsertableTree;
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 30000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+
+	InsertableTree kdtree(256);
+	InsertableTree::ClosestPoint result;
+	REQUIRE(!kdtree.getClosestPointTo(V3x(0), result));
+
+	// Queries run against whatever has been inserted so far
+	atomic<bool> isInserting(true);
+	thread reader([&]() {
+		while (isInserting) {
+			for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+				InsertableTree::ClosestPoint result;
+				kdtree.getClosestPointTo(query, result);
+			});
+		}
+	});
+	// Writers append concurrently, in batches that straddle the buffers
+	static const size_t NUM_WRITERS = 4;
+	vector<thread> arrWriters;
+	for (size_t idxWriter = 0; idxWriter < NUM_WRITERS; ++idxWriter) {
+		arrWriters.push_back(thread([&, idxWriter]() {
+			for (size_t idx = idxWriter * 100; idx < arrPoints.size(); 
+				idx += NUM_WRITERS * 100)
+			{
+				kdtree.insert(&arrPoints[idx], 
+					min<size_t>(100, arrPoints.size() - idx));
+			}
+		}));
+	}
+	for_each(begin(arrWriters), end(arrWriters), [](thread& t) { t.join(); });
+	isInserting = false;
+	reader.join();
+
+	kdtree.flush();
+	REQUIRE_EQUAL(kdtree.getNumPoints(), arrPoints.size());
+
+	// Level occupancy follows the binary digits of the merge count
+	InsertableTree counter(256);
+	for (size_t idx = 0; idx < 3; ++idx) {
+		counter.insert(&arrPoints[idx * 256], 256);
+		counter.flush();
+	}
+	REQUIRE_EQUAL(counter.getNumLevels(), 2u);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		InsertableTree::ClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		REQUIRE_EQUAL(result.distance2, 
+			getClosestPointBruteForce(arrPoints, query).distance2);
+	});
+}
+
+namedtest("versioned kdtree snapshots")
+{
+	cout << "\n";
+	vector<V3x> arrPoints[2];
+	fillPoints(arrPoints[0], 2000);
+	fillPoints(arrPoints[1], 3000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 4, RAND_MAX / 3.0);
+
+	VersionedPointKDTree kdtree;
+	KDTreeClosestPoint result;
+	REQUIRE(!kdtree.getClosestPointTo(V3x(0), result));
+	REQUIRE_EQUAL(kdtree.getVersion(), 0u);
+
+	// Versions alternate between the point sets, odd ones hold the first
+	auto checkSnapshot = [&](const VersionedPointKDTree::Snapshot& snapshot) {
+		const vector<V3x>& arrVersionPoints = 
+			arrPoints[(snapshot.getVersion() + 1) % 2];
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			KDTreeClosestPoint result;
+			REQUIRE(snapshot.getTree()->getClosestPointTo(query, result));
+			REQUIRE_EQUAL(result.distance2, 
+				getClosestPointBruteForce(arrVersionPoints, query).distance2);
+		});
+	};
+
+	// A snapshot outlives the versions published after it
+	REQUIRE_EQUAL(kdtree.publish(
+		unique_ptr<PointKDTree>(new PointKDTree(arrPoints[0]))), 1u);
+	{
+		VersionedPointKDTree::Snapshot snapshot(kdtree);
+		REQUIRE_EQUAL(kdtree.publish(
+			unique_ptr<PointKDTree>(new PointKDTree(arrPoints[1]))), 2u);
+		REQUIRE_EQUAL(kdtree.publish(
+			unique_ptr<PointKDTree>(new PointKDTree(arrPoints[0]))), 3u);
+		kdtree.reclaim();
+		REQUIRE_EQUAL(snapshot.getVersion(), 1u);
+		checkSnapshot(snapshot);
+	}
+
+	// Readers keep querying while versions are replaced under them
+	atomic<bool> isPublishing(true);
+	vector<thread> arrReaders;
+	for (size_t idx = 0; idx < 3; ++idx) {
+		arrReaders.push_back(thread([&]() {
+			while (isPublishing) {
+				VersionedPointKDTree::Snapshot snapshot(kdtree);
+				checkSnapshot(snapshot);
+			}
+		}));
+	}
+	for (size_t idx = 0; idx < 20; ++idx) {
+		kdtree.publish(unique_ptr<PointKDTree>(
+			new PointKDTree(arrPoints[kdtree.getVersion() % 2])));
+	}
+	isPublishing = false;
+	for_each(begin(arrReaders), end(arrReaders), [](thread& t) { t.join(); });
+	kdtree.reclaim();
+	REQUIRE_EQUAL(kdtree.getVersion(), 23u);
+}
+
+namedtest("sliding time window")
+{
+	cout << "\n";
+	WindowedPointKDTree kdtree(3.0, 1.0);
+
+	// Two frames per one second bin, the last frame at 9.5 keeps the bins
+	// from 6 on, with the window rounded out to whole bins
+	vector<vector<V3x> > arrFrames(20);
+	for (size_t idx = 0; idx < arrFrames.size(); ++idx) {
+		fillPoints(arrFrames[idx], 500);
+		V3x offset(RAND_MAX * 0.05 * idx, 0, 0);
+		for_each(begin(arrFrames[idx]), end(arrFrames[idx]), 
+			[&](V3x& point) { point += offset; });
+		REQUIRE(kdtree.addFrame(idx * 0.5, arrFrames[idx]));
+	}
+	REQUIRE(!kdtree.addFrame(9.0, arrFrames[0]));
+	REQUIRE_EQUAL(kdtree.getNumBins(), 4u);
+	REQUIRE_EQUAL(kdtree.getNumPoints(), 4000u);
+	REQUIRE(kdtree.getNumTrees() <= 8u);
+	kdtree.waitUntilMerged();
+	REQUIRE_EQUAL(kdtree.getNumTrees(), 5u);
+
+	vector<V3x> arrLive;
+	for (size_t idx = 12; idx < arrFrames.size(); ++idx)
+		arrLive.insert(end(arrLive), begin(arrFrames[idx]), end(arrFrames[idx]));
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		REQUIRE_EQUAL(result.distance2, 
+			getClosestPointBruteForce(arrLive, query).distance2);
+	});
+
+	kdtree.advanceTo(20.0);
+	REQUIRE_EQUAL(kdtree.getNumBins(), 0u);
+	KDTreeClosestPoint result;
+	REQUIRE(!kdtree.getClosestPointTo(V3x(0), result));
+}
+
+namedtest("merge kdtrees")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 4000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	auto checkQueries = [&](const PointKDTree& kdtree, 
+		const vector<V3x>& arrExpected) 
+	{
+		REQUIRE_EQUAL(kdtree.getNumLivePoints(), arrExpected.size());
+		vector<KDTreeClosestPoint> arrResults;
+		REQUIRE(kdtree.getClosestPointsTo(arrQueries, arrResults));
+		for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+			KDTreeClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+			KDTreeClosestPoint expected = 
+				getClosestPointBruteForce(arrExpected, arrQueries[idx]);
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(arrResults[idx].distance2, expected.distance2);
+		}
+	};
+
+	// Side by side tiles of unequal size are grafted, which leaves the
+	// root unbalanced
+	vector<V3x> arrLeft, arrRight;
+	for_each(begin(arrPoints), end(arrPoints), [&](const V3x& point) {
+		(point.y < RAND_MAX * 0.75 ? arrLeft : arrRight).push_back(point);
+	});
+	PointKDTree left(arrLeft);
+	PointKDTree right(arrRight);
+	unique_ptr<PointKDTree> pGrafted = PointKDTree::merge(right, left);
+	REQUIRE(!pGrafted->isBalanced());
+	checkQueries(*pGrafted, arrPoints);
+
+	// Grafted trees are pruned by their extents, which every copy keeps
+	const string path = "kdtree_test.kdt";
+	REQUIRE(pGrafted->save(path));
+	unique_ptr<PointKDTree> pOpened = 
+		PointKDTree::open(path, KD_TREE_OPEN_VERIFY);
+	REQUIRE(pOpened);
+	checkQueries(*pOpened, arrPoints);
+	PagedPointKDTree paged;
+	REQUIRE(paged.open(path, 16 * 4096, 4096, 4));
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(paged.getClosestPointTo(query, result));
+		REQUIRE_EQUAL(result.distance2, 
+			getClosestPointBruteForce(arrPoints, query).distance2);
+	});
+	{
+		PointKDTreePublisher publisher("KDTreeMergeTest");
+		REQUIRE(publisher.publish(*pGrafted));
+		unique_ptr<PointKDTree> pAttached = 
+			PointKDTreeSubscriber("KDTreeMergeTest").attach();
+		REQUIRE(pAttached);
+		checkQueries(*pAttached, arrPoints);
+	}
+
+	// A thin band across the seam reaches into both tiles, but not up to
+	// the point the new root took from the right tile
+	Box<V3x> band(V3x(0, RAND_MAX * 0.7, 0), 
+		V3x(RAND_MAX, RAND_MAX * 0.77, RAND_MAX));
+	vector<V3x> arrOutside;
+	copy_if(begin(arrPoints), end(arrPoints), back_inserter(arrOutside),
+		[&](const V3x& point) { return !band.intersects(point); });
+	REQUIRE_EQUAL(pGrafted->eraseInBox(band), 
+		arrPoints.size() - arrOutside.size());
+	checkQueries(*pGrafted, arrOutside);
+	REQUIRE(pGrafted->save(path));
+	pOpened = PointKDTree::open(path, KD_TREE_OPEN_VERIFY);
+	REQUIRE(pOpened);
+	checkQueries(*pOpened, arrOutside);
+	pOpened.reset();
+	remove(path.c_str());
+
+	// Overlapping tiles of narrower index types are rebuilt, tombstones
+	// are dropped on the way
+	vector<V3x> arrSmall(begin(arrPoints), begin(arrPoints) + 200);
+	vector<V3x> arrOther(begin(arrPoints) + 200, begin(arrPoints) + 400);
+	PointKDTree small(arrSmall);
+	PointKDTree other(arrOther);
+	Box<V3x> corner(V3x(0), V3x(RAND_MAX / 2.0));
+	other.eraseInBox(corner);
+	arrOther.erase(remove_if(begin(arrOther), end(arrOther),
+		[&](const V3x& point) { return corner.intersects(point); }),
+		end(arrOther));
+	unique_ptr<PointKDTree> pRebuilt = PointKDTree::merge(small, other);
+	REQUIRE(pRebuilt->isBalanced());
+	arrSmall.insert(end(arrSmall), begin(arrOther), end(arrOther));
+	checkQueries(*pRebuilt, arrSmall);
+}
+
+struct AppendingPointsVisitor
+{
+	vector<V3x>& arrPoints;
+
+	AppendingPointsVisitor(vector<V3x>& points)
+		: arrPoints(points)
+	{}
+
+	template <typename uint_t>
+	void operator()(const BasicPointKDTree<uint_t>& tree)
+	{
+		for (size_t idx = 0; idx < tree.getNumPoints(); ++idx)
+			arrPoints.push_back(tree.getPoint(idx));
+	}
+};
+
+namedtest("sharded kdtree")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 20000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 8, RAND_MAX / 7.0);
+
+	ShardedPointKDTree kdtree(arrPoints, 5);
+	REQUIRE_EQUAL(kdtree.getNumShards(), 5u);
+	REQUIRE_EQUAL(kdtree.getNumPoints(), arrPoints.size());
+	auto checkQueries = [&](const vector<V3x>& arrExpected) {
+		vector<KDTreeClosestPoint> arrResults;
+		REQUIRE(kdtree.getClosestPointsTo(arrQueries, arrResults));
+		for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+			KDTreeClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+			KDTreeClosestPoint expected = 
+				getClosestPointBruteForce(arrExpected, arrQueries[idx]);
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(arrResults[idx].distance2, expected.distance2);
+		}
+	};
+	checkQueries(arrPoints);
+
+	// A rebuilt shard keeps every other of its points
+	vector<V3x> arrShard;
+	kdtree.getShard(0).visit(AppendingPointsVisitor(arrShard));
+	auto isLess = [](const V3x& lhs, const V3x& rhs) {
+		return lexicographical_compare(&lhs.x, &lhs.x + 3, &rhs.x, &rhs.x + 3);
+	};
+	sort(begin(arrPoints), end(arrPoints), isLess);
+	sort(begin(arrShard), end(arrShard), isLess);
+	vector<V3x> arrRest;
+	set_difference(begin(arrPoints), end(arrPoints), begin(arrShard), 
+		end(arrShard), back_inserter(arrRest), isLess);
+	vector<V3x> arrRebuilt;
+	for (size_t idx = 0; idx < arrShard.size(); idx += 2)
+		arrRebuilt.push_back(arrShard[idx]);
+	arrPoints = arrRest;
+	arrPoints.insert(end(arrPoints), begin(arrRebuilt), end(arrRebuilt));
+	kdtree.rebuildShard(0, move(arrRebuilt));
+	REQUIRE_EQUAL(kdtree.getNumPoints(), arrPoints.size());
+	checkQueries(arrPoints);
+
+	// More shards than points leaves some empty
+	vector<V3x> arrFew(begin(arrPoints), begin(arrPoints) + 3);
+	ShardedPointKDTree few(arrFew, 8);
+	KDTreeClosestPoint result;
+	REQUIRE(few.getClosestPointTo(V3x(0), result));
+	REQUIRE_EQUAL(result.distance2, 
+		getClosestPointBruteForce(arrFew, V3x(0)).distance2);
+}
+
+namedtest("numa replicated kdtree")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 5000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 5, RAND_MAX / 4.0);
+
+	ReplicatedPointKDTree kdtree(arrPoints);
+	REQUIRE(kdtree.getNumReplicas() >= 1);
+	for (size_t idx = 0; idx < kdtree.getNumReplicas(); ++idx)
+		REQUIRE(kdtree.getReplica(idx).isBalanced());
+
+	// Every thread is routed to some replica, all answer alike
+	vector<thread> arrReaders;
+	for (size_t idxReader = 0; idxReader < 4; ++idxReader) {
+		arrReaders.push_back(thread([&]() {
+			REQUIRE(kdtree.getIdxLocalReplica() < kdtree.getNumReplicas());
+			vector<KDTreeClosestPoint> arrResults;
+			REQUIRE(kdtree.getClosestPointsTo(arrQueries, arrResults));
+			for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+				KDTreeClosestPoint result;
+				REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+				KDTreeClosestPoint expected = 
+					getClosestPointBruteForce(arrPoints, arrQueries[idx]);
+				REQUIRE_EQUAL(result.distance2, expected.distance2);
+				REQUIRE_EQUAL(arrResults[idx].distance2, expected.distance2);
+			}
+		}));
+	}
+	for_each(begin(arrReaders), end(arrReaders), [](thread& t) { t.join(); });
+}
+
+namedtest("large page kdtree")
+{
+	cout << "\n";
+	typedef BasicPointKDTree<uint32_t, 3, fpreal,
+		KDTreeLargePageAllocator<char> > Tree;
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 100000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+
+	size_t largePageBytes = getLargePageBytes();
+	{
+		Tree kdtree(arrPoints);
+		if (getLargePageSize() != 0)
+			REQUIRE(getLargePageBytes() > largePageBytes);
+
+		// Compaction swaps in a rebuilt point list of the same allocator
+		Box<V3x> corner(V3x(0), V3x(RAND_MAX * 0.75));
+		REQUIRE(kdtree.eraseInBox(corner.min, corner.max) != 0);
+		REQUIRE_EQUAL(kdtree.getNumPoints(), kdtree.getNumLivePoints());
+		arrPoints.erase(remove_if(begin(arrPoints), end(arrPoints),
+			[&](const V3x& point) { return corner.intersects(point); }),
+			end(arrPoints));
+		REQUIRE_EQUAL(kdtree.getNumPoints(), arrPoints.size());
+
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			Tree::ClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(query, result));
+			REQUIRE_EQUAL(result.distance2,
+				getClosestPointBruteForce(arrPoints, query).distance2);
+		});
+	}
+	REQUIRE_EQUAL(getLargePageBytes(), largePageBytes);
+
+	// Half a huge page is rounded up to a whole one, or to large pages if
+	// no contiguous gigabyte is left
+	size_t hugePageSize = getHugePageSize();
+	if (hugePageSize != 0) {
+		void* pData = allocateLargePages(hugePageSize / 2);
+		size_t numBytes = getLargePageBytes() - largePageBytes;
+		REQUIRE(numBytes == hugePageSize || numBytes == hugePageSize / 2);
+		freeLargePages(pData);
+		REQUIRE_EQUAL(getLargePageBytes(), largePageBytes);
+	}
+}
+
+inline size_t& getCountedBytes() { static size_t numBytes; return numBytes; }
+inline size_t& getPeakCountedBytes() { static size_t numBytes; return numBytes; }
+
+template <typename T>
+struct CountingAllocator : public allocator<T>
+{
+	template <typename U>
+	struct rebind { typedef CountingAllocator<U> other; };
+
+	CountingAllocator() {}
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U>&) {}
+
+	T* allocate(size_t count, const void* = NULL)
+	{
+		getCountedBytes() += count * sizeof(T);
+		getPeakCountedBytes() = max(getPeakCountedBytes(), getCountedBytes());
+		return allocator<T>::allocate(count);
+	}
+
+	void deallocate(T* p, size_t count)
+	{
+		getCountedBytes() -= count * sizeof(T);
+		allocator<T>::deallocate(p, count);
+	}
+};
+
+namedtest("kdtree builds in a single block")
+{
+	cout << "\n";
+	typedef BasicPointKDTree<uint32_t, 3, fpreal, CountingAllocator<char> > Tree;
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 10000);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	auto checkQueries = [&](const Tree& kdtree) {
+		REQUIRE_EQUAL(kdtree.getNumPoints(), arrPoints.size());
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			Tree::ClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(query, result));
+			REQUIRE_EQUAL(result.distance2,
+				getClosestPointBruteForce(arrPoints, query).distance2);
+		});
+	};
+
+	getCountedBytes() = 0;
+	getPeakCountedBytes() = 0;
+	{
+		// Points, nodes and construction indices are the only allocation,
+		// made once
+		Tree kdtree(arrPoints);
+		size_t finalSize = arrPoints.size() * (sizeof(V3x) 
+			+ sizeof(KDTreeNode<uint32_t>) + sizeof(uint32_t));
+		REQUIRE_EQUAL(getCountedBytes(), finalSize);
+		REQUIRE_EQUAL(getPeakCountedBytes(), finalSize);
+		REQUIRE(kdtree.isBalanced());
+		checkQueries(kdtree);
+
+		// Compaction moves the live points to a smaller block, they keep
+		// their construction indices
+		vector<V3x> arrConstructed(arrPoints);
+		auto checkInputOrder = [&](const V3x& offset) {
+			for (size_t idx = 0; idx < kdtree.getNumPoints(); ++idx) {
+				REQUIRE_EQUAL(kdtree.getPoint(idx), 
+					arrConstructed[kdtree.getIdxInputPoint(idx)] + offset);
+			}
+		};
+		checkInputOrder(V3x(0));
+		Box<V3x> corner(V3x(0), V3x(RAND_MAX * 0.75));
+		REQUIRE(kdtree.eraseInBox(corner.min, corner.max) != 0);
+		arrPoints.erase(remove_if(begin(arrPoints), end(arrPoints),
+			[&](const V3x& point) { return corner.intersects(point); }),
+			end(arrPoints));
+		REQUIRE(getCountedBytes() < finalSize);
+		checkQueries(kdtree);
+		checkInputOrder(V3x(0));
+
+		// Owned points move and are refit in place from positions in
+		// construction order, erased ones are not read
+		V3x offset(RAND_MAX / 100.0, 0, 0);
+		for_each(begin(arrPoints), end(arrPoints), [&](V3x& point) {
+			point += offset;
+		});
+		vector<V3x> arrPositions(arrConstructed.size());
+		for (size_t idx = 0; idx < arrConstructed.size(); ++idx)
+			arrPositions[idx] = arrConstructed[idx] + offset;
+		REQUIRE(kdtree.refit(&arrPositions[0]));
+		checkQueries(kdtree);
+		checkInputOrder(offset);
+	}
+	REQUIRE_EQUAL(getCountedBytes(), size_t(0));
+}
+
+namedtest("small kdtree scans its points")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, KD_TREE_SCAN_MAX_POINTS);
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+
+	PointKDTree kdtree(arrPoints);
+	PointScan scan(&arrPoints[0], arrPoints.size());
+	auto checkQueries = [&]() {
+		vector<KDTreeClosestPoint> arrResults;
+		REQUIRE(kdtree.getClosestPointsTo(arrQueries, arrResults));
+		for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+			KDTreeClosestPoint expected = 
+				getClosestPointBruteForce(arrPoints, arrQueries[idx]);
+			KDTreeClosestPoint result, scanned;
+			REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+			REQUIRE(scan.getClosestPointTo(arrQueries[idx], scanned));
+			REQUIRE(result.idxNode != KDTreeClosestPoint::IDX_NONE);
+			REQUIRE_EQUAL(scanned.idxNode, KDTreeClosestPoint::IDX_NONE);
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(scanned.distance2, expected.distance2);
+			REQUIRE_EQUAL(arrResults[idx].distance2, expected.distance2);
+		}
+	};
+	checkQueries();
+
+	// The tree stays behind the scan for everything but queries
+	CountingClosestPointVisitor visitor(arrQueries);
+	kdtree.visit(visitor);
+	REQUIRE_EQUAL(visitor.numFound, arrQueries.size());
+
+	// A hint without a node bounds the scan
+	KDTreeClosestPoint radius;
+	radius.distance2 = 0;
+	KDTreeClosestPoint result;
+	REQUIRE(!kdtree.getClosestPointTo(V3x(-1), radius, result));
+
+	Box<V3x> corner(V3x(0), V3x(RAND_MAX / 2.0));
+	size_t numErased = kdtree.eraseInBox(corner);
+	REQUIRE_EQUAL(scan.eraseInBox(corner.min, corner.max), numErased);
+	arrPoints.erase(remove_if(begin(arrPoints), end(arrPoints),
+		[&](const V3x& point) { return corner.intersects(point); }),
+		end(arrPoints));
+	REQUIRE_EQUAL(scan.getNumPoints(), arrPoints.size());
+	checkQueries();
+
+	// Point counts off the register width are padded
+	typedef BasicPointScan<3, float> FloatScan;
+	vector<V3f> arrFloatPoints(7);
+	for (size_t idx = 0; idx < arrFloatPoints.size(); ++idx)
+		arrFloatPoints[idx] = V3f(float(idx), float(idx % 3), 0);
+	FloatScan floatScan(&arrFloatPoints[0], arrFloatPoints.size());
+	FloatScan::ClosestPoint floatResult;
+	REQUIRE(floatScan.getClosestPointTo(V3f(6.2f, 0, 0), floatResult));
+	REQUIRE_EQUAL(floatResult.point, arrFloatPoints[6]);
+}
+
+namedtest("scan packed and strided points")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 1001);
+	vector<TestVertex> arrVertices(arrPoints.size());
+	vector<V3f> arrFloatPoints(arrPoints.size());
+	for (size_t idx = 0; idx < arrPoints.size(); ++idx) {
+		arrVertices[idx].position = arrPoints[idx];
+		arrFloatPoints[idx] = V3f(arrPoints[idx]);
+	}
+	BasicPointScan<3, float> floatScan(
+		&arrFloatPoints[0], arrFloatPoints.size());
+
+	// Packed points are shuffled into registers, strided ones gathered,
+	// both sum distances like the scalar code
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint expected = 
+			getClosestPointBruteForce(arrPoints, query);
+		KDTreeClosestPoint packed, strided;
+		REQUIRE(getClosestPointByScan<3>(
+			reinterpret_cast<const char*>(&arrPoints[0]), sizeof(V3x),
+			arrPoints.size(), query, packed));
+		REQUIRE(getClosestPointByScan<3>(
+			reinterpret_cast<const char*>(&arrVertices[0].position),
+			sizeof(TestVertex), arrVertices.size(), query, strided));
+		REQUIRE_EQUAL(packed.distance2, expected.distance2);
+		REQUIRE_EQUAL(strided.distance2, expected.distance2);
+		REQUIRE_EQUAL(packed.point, strided.point);
+
+		V3f floatQuery(query);
+		BasicKDTreeClosestPoint<V3f> floatPacked, floatExpected;
+		REQUIRE(getClosestPointByScan<3>(
+			reinterpret_cast<const char*>(&arrFloatPoints[0]), sizeof(V3f),
+			arrFloatPoints.size(), floatQuery, floatPacked));
+		REQUIRE(floatScan.getClosestPointTo(floatQuery, floatExpected));
+		REQUIRE_EQUAL(floatPacked.distance2, floatExpected.distance2);
+	});
+}
+
+namedtest("erase points in box")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 10000);
+	PointKDTree kdtree(arrPoints);
+	kdtree.setCompactionThreshold(0.5);
+
+	auto eraseFromReference = [&](const Box<V3x>& box) {
+		arrPoints.erase(remove_if(begin(arrPoints), end(arrPoints),
+			[&](const V3x& point) { return box.intersects(point); }),
+			end(arrPoints));
+	};
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	auto checkQueries = [&]() {
+		REQUIRE_EQUAL(kdtree.getNumLivePoints(), arrPoints.size());
+		vector<KDTreeClosestPoint> arrResults;
+		REQUIRE(kdtree.getClosestPointsTo(arrQueries, arrResults));
+		for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+			KDTreeClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+			KDTreeClosestPoint expected = 
+				getClosestPointBruteForce(arrPoints, arrQueries[idx]);
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(arrResults[idx].distance2, expected.distance2);
+		}
+	};
+
+	// A corner, then most of the space, which triggers a compaction
+	Box<V3x> corner(V3x(0), V3x(RAND_MAX / 2.0));
+	size_t numCorner = arrPoints.size();
+	eraseFromReference(corner);
+	numCorner -= arrPoints.size();
+	REQUIRE_EQUAL(kdtree.eraseInBox(corner), numCorner);
+	REQUIRE_EQUAL(kdtree.eraseInBox(corner), 0u);
+	checkQueries();
+
+	Box<V3x> slab(V3x(0), V3x(RAND_MAX, RAND_MAX, RAND_MAX * 0.8));
+	kdtree.eraseInBox(slab);
+	eraseFromReference(slab);
+	checkQueries();
+	REQUIRE(kdtree.isBalanced());
+
+	kdtree.eraseInBox(Box<V3x>(V3x(0), V3x(RAND_MAX)));
+	KDTreeClosestPoint result;
+	REQUIRE(!kdtree.getClosestPointTo(V3x(0), result));
+}
+
+namedtest("refit moving external points")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 100000);
+	PointKDTree kdtree(&arrPoints[0].x, sizeof(V3x), arrPoints.size());
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	auto checkQueries = [&]() {
+		vector<KDTreeClosestPoint> arrResults;
+		REQUIRE(kdtree.getClosestPointsTo(arrQueries, arrResults));
+		for (size_t idx = 0; idx < arrQueries.size(); ++idx) {
+			KDTreeClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(arrQueries[idx], result));
+			KDTreeClosestPoint expected = 
+				getClosestPointBruteForce(arrPoints, arrQueries[idx]);
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(arrResults[idx].distance2, expected.distance2);
+		}
+	};
+
+	// A small jitter keeps the topology, siblings overlap a little
+	const fpreal jitter = RAND_MAX / 2000.0;
+	for_each(begin(arrPoints), end(arrPoints), [&](V3x& point) {
+		point += V3x(rand(), rand(), rand()) * (2 * jitter / RAND_MAX)
+			- V3x(jitter);
+	});
+	REQUIRE(kdtree.refit());
+	REQUIRE(kdtree.getRefitOverlap() > 0);
+	REQUIRE(kdtree.getRefitOverlap() < 0.1);
+	checkQueries();
+
+	// Scrambled points overlap everywhere and are rebuilt instead
+	random_shuffle(begin(arrPoints), end(arrPoints));
+	REQUIRE(kdtree.refit());
+	REQUIRE_EQUAL(kdtree.getRefitOverlap(), 0.0);
+	REQUIRE(kdtree.isBalanced());
+	checkQueries();
+}
+
+namedtest("refit moving owned points in construction order")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 100000);
+	vector<V3x> arrMoved(arrPoints);
+	BasicPointKDTree<uint32_t> kdtree(move(arrMoved));
+	auto checkPoints = [&]() {
+		for (size_t idx = 0; idx < kdtree.getNumPoints(); ++idx) {
+			REQUIRE_EQUAL(kdtree.getPoint(idx), 
+				arrPoints[kdtree.getIdxInputPoint(idx)]);
+		}
+		for (size_t idx = 0; idx < arrPoints.size(); idx += 997) {
+			BasicPointKDTree<uint32_t>::ClosestPoint result;
+			REQUIRE(kdtree.getClosestPointTo(arrPoints[idx], result));
+			REQUIRE_EQUAL(result.distance2, 0.0);
+		}
+	};
+	checkPoints();
+
+	// Positions are read by construction index, the build's order stays
+	const fpreal jitter = RAND_MAX / 2000.0;
+	for_each(begin(arrPoints), end(arrPoints), [&](V3x& point) {
+		point += V3x(rand(), rand(), rand()) * (2 * jitter / RAND_MAX)
+			- V3x(jitter);
+	});
+	REQUIRE(kdtree.refit(&arrPoints[0]));
+	REQUIRE(kdtree.getRefitOverlap() > 0);
+	checkPoints();
+
+	// A rebuild partitions the points again, they keep their indices
+	random_shuffle(begin(arrPoints), end(arrPoints));
+	REQUIRE(kdtree.refit(&arrPoints[0]));
+	REQUIRE_EQUAL(kdtree.getRefitOverlap(), 0.0);
+	REQUIRE(kdtree.isBalanced());
+	checkPoints();
+}
+
+namedtest("erase points in box after refit")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 100000);
+	PointKDTree kdtree(&arrPoints[0].x, sizeof(V3x), arrPoints.size());
+
+	// Points cross their parents' planes, only the refit extents bound them
+	const fpreal jitter = RAND_MAX / 200.0;
+	for_each(begin(arrPoints), end(arrPoints), [&](V3x& point) {
+		point += V3x(rand(), rand(), rand()) * (2 * jitter / RAND_MAX)
+			- V3x(jitter);
+	});
+	REQUIRE(kdtree.refit());
+	REQUIRE(kdtree.getRefitOverlap() > 0);
+
+	Box<V3x> corner(V3x(0), V3x(RAND_MAX / 2.0));
+	vector<V3x> arrLive;
+	copy_if(begin(arrPoints), end(arrPoints), back_inserter(arrLive),
+		[&](const V3x& point) { return !corner.intersects(point); });
+	REQUIRE_EQUAL(kdtree.eraseInBox(corner), arrPoints.size() - arrLive.size());
+	REQUIRE_EQUAL(kdtree.getNumLivePoints(), arrLive.size());
+
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 6, RAND_MAX / 5.0);
+	for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+		KDTreeClosestPoint result;
+		REQUIRE(kdtree.getClosestPointTo(query, result));
+		KDTreeClosestPoint expected = getClosestPointBruteForce(arrLive, query);
+		REQUIRE_EQUAL(result.distance2, expected.distance2);
+	});
+}
+
+namedtest("save and open refit and erased kdtrees")
+{
+	cout << "\n";
+	vector<V3x> arrPoints;
+	fillPoints(arrPoints, 100000);
+	PointKDTree kdtree(&arrPoints[0].x, sizeof(V3x), arrPoints.size());
+
+	// Points move well past their parents' planes but are not rebuilt
+	const fpreal jitter = RAND_MAX / 20.0;
+	for_each(begin(arrPoints), end(arrPoints), [&](V3x& point) {
+		point += V3x(rand(), rand(), rand()) * (2 * jitter / RAND_MAX)
+			- V3x(jitter);
+	});
+	kdtree.setRefitThreshold(1.0);
+	REQUIRE(kdtree.refit());
+	REQUIRE(kdtree.getRefitOverlap() > 0);
+
+	// Every copy of the tree must find what the tree itself finds
+	vector<V3x> arrQueries;
+	fillQueryGrid(arrQueries, 16, RAND_MAX / 15.0);
+	const string path = "kdtree_test.kdt";
+	auto checkSaved = [&]() {
+		REQUIRE(kdtree.save(path));
+		unique_ptr<PointKDTree> pOpened = 
+			PointKDTree::open(path, KD_TREE_OPEN_VERIFY);
+		REQUIRE(pOpened);
+		REQUIRE_EQUAL(pOpened->getNumLivePoints(), kdtree.getNumLivePoints());
+		PagedPointKDTree paged;
+		REQUIRE(paged.open(path, 16 * 4096, 4096, 4));
+		REQUIRE_EQUAL(paged.getNumPoints(), kdtree.getNumLivePoints());
+
+		// Node indices carry over, so results warm-start the opened tree
+		for_each(begin(arrQueries), end(arrQueries), [&](const V3x& query) {
+			KDTreeClosestPoint expected, result;
+			REQUIRE(kdtree.getClosestPointTo(query, expected));
+			REQUIRE(pOpened->getClosestPointTo(query, result));
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(result.idxNode, expected.idxNode);
+			REQUIRE(pOpened->getClosestPointTo(query, expected, result));
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE(paged.getClosestPointTo(query, result));
+			REQUIRE_EQUAL(result.distance2, expected.distance2);
+			REQUIRE_EQUAL(result.idxNode, expected.idxNode);
+		});
+	};
+	checkSaved();
+
+	// Erased points stay erased in the file instead of coming back
+	Box<V3x> corner(V3x(0), V3x(RAND_MAX / 2.0));
+	REQUIRE(kdtree.eraseInBox(corner) != 0);
+	checkSaved();
+
+	// A compacted tree leaves them out of the file
+	auto getFileSize = [&]() -> streamoff {
+		ifstream file(path.c_str(), ios::in | ios::binary | ios::ate);
+		return file.tellg();
+	};
+	PointKDTree owned(arrPoints);
+	REQUIRE(owned.eraseInBox(corner) != 0);
+	REQUIRE(owned.save(path));
+	streamoff erasedSize = getFileSize();
+	REQUIRE(owned.compact());
+	REQUIRE(!owned.compact());
+	REQUIRE(owned.save(path));
+	REQUIRE(getFileSize() < erasedSize);
+	unique_ptr<PointKDTree> pCompacted = 
+		PointKDTree::open(path, KD_TREE_OPEN_VERIFY);
+	REQUIRE(pCompacted);
+	REQUIRE_EQUAL(pCompacted->getNumLivePoints(), owned.getNumLivePoints());
+	pCompacted.reset();
+	remove(path.c_str());
+}
+
 namedtest("x axis splits") 
 {
 	createAxisSplitTest(X_AXIS);
@@ -0,0 +1,405 @@
+#pragma once
+#ifndef EPL_KDTREEBUILDER_H_
+#define EPL_KDTREEBUILDER_H_
+
+#include "stdafx.h"
+#include "basickdtree.h"
+
+/// Number of points sampled to choose the splitter of an on-disk run
+static const size_t KD_TREE_BUILDER_SAMPLE_SIZE = 1023;
+
+/// Out-of-Core KD Tree Builder
+/// Builds a tree over a file of packed points without holding them all in
+/// memory. Runs larger than the memory budget are split around the median
+/// of a random sample into two on-disk runs, runs that fit are built in 
+/// memory as BasicPointKDTree subtrees. Nodes and points are streamed into
+/// the file format of BasicPointKDTree::save(), so the result is queried
+/// through BasicPointKDTree::open() and is never loaded whole either.
+/// NOTE: splitters are sampled, so the top of the tree is only roughly 
+///       balanced.
+template <typename uint_t, int DIM = 3, typename real_t = fpreal>
+class BasicKDTreeFileBuilder : public Uncopyable
+{
+public: // types
+	typedef BasicPointKDTree<uint_t, DIM, real_t> Tree;
+	typedef typename Tree::point_t point_t;
+	typedef KDTreeNode<uint_t> Node;
+
+public: // static members
+	static const uint_t IDX_NONE = InvalidIndex<uint_t>::value;
+
+public: // methods
+	// memoryBudget bounds the bytes of points and nodes held at once
+	BasicKDTreeFileBuilder(size_t memoryBudget);
+
+	// inputPath holds numPoints packed point_t, the tree is written to 
+	// outputPath. Temporary runs are created next to outputPath.
+	bool build(const string& inputPath, const string& outputPath);
+
+	static bool getNumPoints(const string& inputPath, 
+		uint64_t& out_numPoints);
+
+private: // methods
+	uint_t buildRun(const string& runPath, uint64_t numPoints, bool isTemp);
+	uint_t buildInMemory(vector<point_t>&& arrPoints);
+	uint_t appendPoints(const point_t* arrPoints, size_t numPoints);
+	uint_t appendNodes(const Node* arrNodes, size_t numNodes);
+	bool writeChecksum();
+
+	string getRunPath();
+	uint64_t getRandom();
+
+private: // members
+	size_t m_leafSize;
+	size_t m_chunkSize;
+
+	string m_outputPath;
+	fstream m_out;
+	KDTreeFileHeader m_header;
+	uint64_t m_numNodesWritten;
+	uint64_t m_numPointsWritten;
+
+	size_t m_numRuns;
+	uint64_t m_random;
+};
+
+#define KD_TREE_BUILDER_TEMPLATE \
+	template <typename uint_t, int DIM, typename real_t>
+#define KD_TREE_BUILDER_CLASS BasicKDTreeFileBuilder<uint_t, DIM, real_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicKDTreeFileBuilder Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_BUILDER_TEMPLATE
+KD_TREE_BUILDER_CLASS::BasicKDTreeFileBuilder(size_t memoryBudget)
+	: m_leafSize(max<size_t>(1, memoryBudget / (sizeof(point_t) + sizeof(Node))))
+	, m_chunkSize(min<size_t>(m_leafSize, 65536))
+	, m_numNodesWritten(0)
+	, m_numPointsWritten(0)
+	, m_numRuns(0)
+	, m_random(88172645463325252ULL)
+{
+}
+
+KD_TREE_BUILDER_TEMPLATE
+bool
+KD_TREE_BUILDER_CLASS::getNumPoints(
+	const string& inputPath,
+	uint64_t& out_numPoints)
+{
+	ifstream in(inputPath.c_str(), ios::in | ios::binary | ios::ate);
+	if (!in)
+		return false;
+
+	uint64_t size = static_cast<uint64_t>(in.tellg());
+	out_numPoints = size / sizeof(point_t);
+	return size % sizeof(point_t) == 0;
+}
+
+KD_TREE_BUILDER_TEMPLATE
+bool
+KD_TREE_BUILDER_CLASS::build(
+	const string& inputPath,
+	const string& outputPath)
+{
+	uint64_t numPoints;
+	if (!getNumPoints(inputPath, numPoints) 
+		|| numPoints >= InvalidIndex<uint_t>::value)
+	{
+		return false;
+	}
+
+	// Every point becomes one node, so both sections are laid out up front
+	// and filled in post-order as subtrees complete
+	memset(&m_header, 0, sizeof(m_header));
+	memcpy(m_header.magic, KD_TREE_FILE_MAGIC, sizeof(m_header.magic));
+	m_header.version = KD_TREE_FILE_VERSION;
+	m_header.byteOrder = KD_TREE_FILE_BYTE_ORDER;
+	m_header.headerSize = sizeof(KDTreeFileHeader);
+	m_header.idxBits = sizeof(uint_t) * 8;
+	m_header.dim = DIM;
+	m_header.realSize = sizeof(real_t);
+	m_header.nodeSize = sizeof(Node);
+	m_header.numNodes = numPoints;
+	m_header.numPoints = numPoints;
+	m_header.nodesOffset = getAlignedFileOffset(sizeof(KDTreeFileHeader));
+	m_header.pointsOffset = getAlignedFileOffset(
+		m_header.nodesOffset + numPoints * sizeof(Node));
+	m_header.fileSize = m_header.pointsOffset + numPoints * sizeof(point_t);
+
+	m_outputPath = outputPath;
+	m_out.open(outputPath.c_str(), 
+		ios::in | ios::out | ios::binary | ios::trunc);
+	if (!m_out)
+		return false;
+
+	// Sizes the file, the gaps between sections read back as zeros
+	static const char zero = 0;
+	m_out.seekp(m_header.fileSize - 1);
+	m_out.write(&zero, 1);
+
+	m_numNodesWritten = 0;
+	m_numPointsWritten = 0;
+	buildRun(inputPath, numPoints, false);
+	assert(!m_out || m_numNodesWritten == numPoints);
+
+	bool isValid = writeChecksum();
+	m_out.close();
+	return isValid && !m_out.fail();
+}
+
+KD_TREE_BUILDER_TEMPLATE
+uint_t
+KD_TREE_BUILDER_CLASS::buildRun(
+	const string& runPath,
+	uint64_t numPoints,
+	bool isTemp)
+{
+	// A temporary run is removed on every way out, as soon as it is read
+	ifstream in;
+	auto removeRun = [&]() {
+		in.close();
+		if (isTemp)
+			remove(runPath.c_str());
+	};
+	if (numPoints == 0 || !m_out) {
+		removeRun();
+		return IDX_NONE;
+	}
+
+	vector<point_t> arrChunk;
+	in.open(runPath.c_str(), ios::in | ios::binary);
+	auto readChunk = [&](uint64_t numLeft) -> size_t {
+		size_t numRead = static_cast<size_t>(min<uint64_t>(numLeft, 
+			arrChunk.size()));
+		in.read(reinterpret_cast<char*>(&arrChunk[0]), 
+			numRead * sizeof(point_t));
+		return in ? numRead : 0;
+	};
+
+	if (numPoints <= m_leafSize) {
+		arrChunk.resize(static_cast<size_t>(numPoints));
+		bool isRead = readChunk(numPoints) == numPoints;
+		removeRun();
+		if (!isRead) {
+			m_out.setstate(ios::failbit);
+			return IDX_NONE;
+		}
+		return buildInMemory(move(arrChunk));
+	}
+
+	// First pass: bounds and a reservoir sample of the run
+	arrChunk.resize(m_chunkSize);
+	vector<pair<point_t, uint64_t> > arrSamples;
+	point_t boundsMin(numeric_limits<real_t>::max());
+	point_t boundsMax(-numeric_limits<real_t>::max());
+	for (uint64_t idxPoint = 0; idxPoint < numPoints; ) {
+		size_t numRead = readChunk(numPoints - idxPoint);
+		if (numRead == 0) {
+			removeRun();
+			m_out.setstate(ios::failbit);
+			return IDX_NONE;
+		}
+
+		for (size_t idx = 0; idx < numRead; ++idx, ++idxPoint) {
+			const point_t& point = arrChunk[idx];
+			forEachAxis<DIM>([&](int axis) {
+				boundsMin[axis] = min<real_t>(point[axis], boundsMin[axis]);
+				boundsMax[axis] = max<real_t>(point[axis], boundsMax[axis]);
+			});
+
+			if (arrSamples.size() < KD_TREE_BUILDER_SAMPLE_SIZE) {
+				arrSamples.push_back(make_pair(point, idxPoint));
+			} else {
+				uint64_t idxSample = getRandom() % (idxPoint + 1);
+				if (idxSample < KD_TREE_BUILDER_SAMPLE_SIZE)
+					arrSamples[static_cast<size_t>(idxSample)] = 
+						make_pair(point, idxPoint);
+			}
+		}
+	}
+
+	// Split the widest axis, ties go to the lowest axis
+	int axis = X_AXIS;
+	real_t splitSize = boundsMax[X_AXIS] - boundsMin[X_AXIS];
+	forEachAxis<DIM>([&](int idxAxis) {
+		real_t size = boundsMax[idxAxis] - boundsMin[idxAxis];
+		if (size > splitSize) {
+			axis = idxAxis;
+			splitSize = size;
+		}
+	});
+
+	auto itMedian = begin(arrSamples) + arrSamples.size() / 2;
+	nth_element(begin(arrSamples), itMedian, end(arrSamples),
+		[axis](const pair<point_t, uint64_t>& lhs, 
+			const pair<point_t, uint64_t>& rhs) 
+		{
+			return lhs.first[axis] < rhs.first[axis];
+		});
+	const point_t median = itMedian->first;
+	const uint64_t idxMedian = itMedian->second;
+	vector<pair<point_t, uint64_t> >().swap(arrSamples);
+
+	// Second pass: split the run around the median sample, points on the
+	// splitting plane go to the smaller side so far
+	string leftPath = getRunPath();
+	string rightPath = getRunPath();
+	ofstream leftOut(leftPath.c_str(), ios::out | ios::binary | ios::trunc);
+	ofstream rightOut(rightPath.c_str(), ios::out | ios::binary | ios::trunc);
+	uint64_t numLeft = 0;
+	uint64_t numRight = 0;
+
+	in.clear();
+	in.seekg(0);
+	for (uint64_t idxPoint = 0; idxPoint < numPoints; ) {
+		size_t numRead = readChunk(numPoints - idxPoint);
+		if (numRead == 0)
+			break;
+
+		for (size_t idx = 0; idx < numRead; ++idx, ++idxPoint) {
+			const point_t& point = arrChunk[idx];
+			if (idxPoint == idxMedian)
+				continue;
+
+			bool isLeft = point[axis] < median[axis] 
+				|| (point[axis] == median[axis] && numLeft <= numRight);
+			ofstream& out = isLeft ? leftOut : rightOut;
+			out.write(reinterpret_cast<const char*>(&point), sizeof(point_t));
+			++(isLeft ? numLeft : numRight);
+		}
+	}
+
+	removeRun();
+	leftOut.close();
+	rightOut.close();
+	if (leftOut.fail() || rightOut.fail() || numLeft + numRight + 1 != numPoints)
+		m_out.setstate(ios::failbit);
+	vector<point_t>().swap(arrChunk);
+
+	uint_t idxLeft = buildRun(leftPath, numLeft, true);
+	uint_t idxRight = buildRun(rightPath, numRight, true);
+	uint_t idxPoint = appendPoints(&median, 1);
+	Node node(idxPoint, idxLeft, idxRight, axis);
+	return appendNodes(&node, 1);
+}
+
+KD_TREE_BUILDER_TEMPLATE
+uint_t
+KD_TREE_BUILDER_CLASS::buildInMemory(vector<point_t>&& arrPoints)
+{
+	// The subtree's nodes and points follow everything written so far
+	Tree tree(move(arrPoints));
+	uint_t idxNodeBase = static_cast<uint_t>(m_numNodesWritten);
+	uint_t idxPointBase = appendPoints(&tree.getPoint(0), tree.getNumPoints());
+
+	vector<Node> arrNodes;
+	arrNodes.reserve(tree.getNumNodes());
+	for (size_t idx = 0; idx < tree.getNumNodes(); ++idx) {
+		const Node& node = tree.getNode(idx);
+		arrNodes.push_back(Node(
+			node.getIdxPoint() + idxPointBase,
+			node.getIdxLeft() == IDX_NONE ? 
+				IDX_NONE : node.getIdxLeft() + idxNodeBase,
+			node.getIdxRight() == IDX_NONE ? 
+				IDX_NONE : node.getIdxRight() + idxNodeBase,
+			node.getAxis()));
+	}
+
+	appendNodes(&arrNodes[0], arrNodes.size());
+	return static_cast<uint_t>(m_numNodesWritten - 1);
+}
+
+KD_TREE_BUILDER_TEMPLATE
+uint_t
+KD_TREE_BUILDER_CLASS::appendPoints(
+	const point_t* arrPoints,
+	size_t numPoints)
+{
+	uint_t idxFirst = static_cast<uint_t>(m_numPointsWritten);
+	m_out.seekp(m_header.pointsOffset + m_numPointsWritten * sizeof(point_t));
+	m_out.write(reinterpret_cast<const char*>(arrPoints), 
+		numPoints * sizeof(point_t));
+	m_numPointsWritten += numPoints;
+	return idxFirst;
+}
+
+KD_TREE_BUILDER_TEMPLATE
+uint_t
+KD_TREE_BUILDER_CLASS::appendNodes(
+	const Node* arrNodes,
+	size_t numNodes)
+{
+	m_out.seekp(m_header.nodesOffset + m_numNodesWritten * sizeof(Node));
+	m_out.write(reinterpret_cast<const char*>(arrNodes), 
+		numNodes * sizeof(Node));
+	m_numNodesWritten += numNodes;
+	return static_cast<uint_t>(m_numNodesWritten - 1);
+}
+
+KD_TREE_BUILDER_TEMPLATE
+bool
+KD_TREE_BUILDER_CLASS::writeChecksum()
+{
+	if (!m_out)
+		return false;
+
+	// Reads both sections back in chunks, hashing them exactly as
+	// BasicPointKDTree::getChecksum() does in memory. Node chunks are a
+	// multiple of the checksum's word size so only the last has a tail.
+	const size_t chunkSize = (m_chunkSize * sizeof(point_t) 
+		+ sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	vector<char> arrChunk(chunkSize);
+	uint64_t hash = getKDTreeChecksum(NULL, 0);
+
+	m_out.seekg(m_header.nodesOffset);
+	for (uint64_t numLeft = m_header.numNodes * sizeof(Node); numLeft != 0; ) {
+		size_t size = static_cast<size_t>(min<uint64_t>(numLeft, chunkSize));
+		m_out.read(&arrChunk[0], size);
+		hash = getKDTreeChecksum(&arrChunk[0], size, hash);
+		numLeft -= size;
+	}
+
+	m_out.seekg(m_header.pointsOffset);
+	for (uint64_t numLeft = m_header.numPoints; numLeft != 0; ) {
+		size_t numRead = static_cast<size_t>(min<uint64_t>(numLeft, 
+			chunkSize / sizeof(point_t)));
+		m_out.read(&arrChunk[0], numRead * sizeof(point_t));
+		for (size_t idx = 0; idx < numRead; ++idx) {
+			hash = getKDTreeChecksum(&arrChunk[idx * sizeof(point_t)],
+				sizeof(point_t), hash);
+		}
+		numLeft -= numRead;
+	}
+
+	m_header.checksum = hash;
+	m_out.seekp(0);
+	m_out.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	return !m_out.fail();
+}
+
+KD_TREE_BUILDER_TEMPLATE
+string
+KD_TREE_BUILDER_CLASS::getRunPath()
+{
+	ostringstream path;
+	path << m_outputPath << ".run" << m_numRuns++;
+	return path.str();
+}
+
+KD_TREE_BUILDER_TEMPLATE
+uint64_t
+KD_TREE_BUILDER_CLASS::getRandom()
+{
+	// xorshift64, deterministic so builds of the same input are identical
+	m_random ^= m_random << 13;
+	m_random ^= m_random >> 7;
+	m_random ^= m_random << 17;
+	return m_random;
+}
+
+#undef KD_TREE_BUILDER_TEMPLATE
+#undef KD_TREE_BUILDER_CLASS
+
+#endif // EPL_KDTREEBUILDER_H_
@@ -0,0 +1,75 @@
+#pragma once
+#ifndef EPL_LARGEPAGES_H_
+#define EPL_LARGEPAGES_H_
+
+#include "stdafx.h"
+
+/// @{
+/// Large Page Memory
+/// Blocks of at least half a large page are committed as large pages, so
+/// the TLB covers a big tree with a handful of entries instead of one per
+/// 4 KB page. On 64 bit Windows 10 1803 and later, blocks of at least half
+/// a 1 GB huge page are committed as huge pages through VirtualAlloc2,
+/// falling back to large pages if no contiguous gigabyte is left. Both
+/// need the "Lock pages in memory" privilege, which the first call enables
+/// for the process. Without it and for smaller blocks, memory comes from
+/// the heap.
+
+// Large page size once the privilege is enabled, otherwise 0
+size_t getLargePageSize();
+
+// 1 GB if huge pages are available, otherwise 0
+size_t getHugePageSize();
+
+// Throws bad_alloc like operator new
+void* allocateLargePages(size_t size);
+void freeLargePages(void* pData);
+
+// Bytes currently committed as large or huge pages, rounded up to whole
+// pages
+size_t getLargePageBytes();
+/// @}
+
+/// Allocator Backed by Large Pages
+/// Stateless, so containers using it may exchange storage freely.
+template <typename T>
+class KDTreeLargePageAllocator
+{
+public: // types
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind { typedef KDTreeLargePageAllocator<U> other; };
+
+public: // methods
+	KDTreeLargePageAllocator() {}
+	template <typename U>
+	KDTreeLargePageAllocator(const KDTreeLargePageAllocator<U>&) {}
+
+	T* allocate(size_t count, const void* = NULL)
+	{
+		if (count > max_size())
+			throw bad_alloc();
+		return static_cast<T*>(allocateLargePages(count * sizeof(T)));
+	}
+	void deallocate(T* p, size_t) { freeLargePages(p); }
+	size_t max_size() const { return SIZE_MAX / sizeof(T); }
+
+	T* address(T& value) const { return &value; }
+	const T* address(const T& value) const { return &value; }
+	void construct(T* p, const T& value) { new (p) T(value); }
+	void destroy(T* p) { p->~T(); }
+
+	template <typename U>
+	bool operator==(const KDTreeLargePageAllocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const KDTreeLargePageAllocator<U>&) const { return false; }
+};
+
+#endif // EPL_LARGEPAGES_H_
@@ -0,0 +1,237 @@
+#pragma once
+#ifndef EPL_LAZYKDTREE_H_
+#define EPL_LAZYKDTREE_H_
+
+#include "stdafx.h"
+#include "basickdtree.h"
+
+/// Largest point range left unsplit by a lazy tree's upper levels
+static const size_t KD_TREE_LAZY_DEFERRED_SIZE = 4096;
+
+/// Upper Level Node of a Lazy Tree
+/// Either splits its range around idxPoint, or defers the range
+/// [idxBegin, idxEnd) to a subtree built on first use.
+template <typename uint_t>
+struct KDTreeLazyNode
+{
+	uint_t idxPoint;
+	uint_t idxLeft;
+	uint_t idxRight;
+	uint_t idxBegin;
+	uint_t idxEnd;
+	uint_t idxDeferred; // IDX_NONE for split nodes
+	int axis;
+};
+
+/// Deferred Point Range of a Lazy Tree
+template <typename tree_t>
+struct KDTreeDeferredRange
+{
+	once_flag isBuilt;
+	unique_ptr<tree_t> pTree;
+};
+
+/// Lazily Built KD Tree
+/// Only the upper levels are split when the tree is constructed, ranges of
+/// at most deferredSize points are left as deferred nodes. A deferred range
+/// is built into a BasicPointKDTree over the shared point array the first
+/// time a query reaches it, so construction and total work follow the
+/// region that is actually queried. Concurrent queries may reach the same
+/// range, each range is built exactly once under its own once_flag.
+/// NOTE: results leave idxNode unset, warm starts are not supported.
+template <typename uint_t, int DIM = 3, typename real_t = fpreal>
+class BasicLazyPointKDTree : public Uncopyable
+{
+public: // types
+	typedef BasicPointKDTree<uint_t, DIM, real_t> Subtree;
+	typedef typename Subtree::point_t point_t;
+	typedef typename Subtree::ClosestPoint ClosestPoint;
+	typedef KDTreeLazyNode<uint_t> Node;
+	typedef KDTreeDeferredRange<Subtree> DeferredRange;
+
+public: // static members
+	static const uint_t IDX_NONE = InvalidIndex<uint_t>::value;
+
+public: // methods
+	BasicLazyPointKDTree(vector<point_t>&& arrPoints,
+		size_t deferredSize = KD_TREE_LAZY_DEFERRED_SIZE);
+
+	size_t getNumPoints() const { return m_arrPoints.size(); }
+	size_t getNumDeferredRanges() const { return m_numDeferred; }
+	size_t getNumBuiltRanges() const { return m_numBuilt; }
+
+	bool getClosestPointTo(const point_t& point, ClosestPoint& result) const;
+
+private: // methods
+	uint_t buildUpperLevels(uint_t idxBegin, uint_t idxEnd);
+	int chooseSplitAxis(uint_t idxBegin, uint_t idxEnd) const;
+	const Subtree& getSubtree(const Node& node) const;
+
+private: // members
+	size_t m_deferredSize;
+	vector<point_t> m_arrPoints;
+	vector<Node> m_arrNodes; // root first
+	unique_ptr<DeferredRange[]> m_arrDeferred;
+	size_t m_numDeferred;
+	mutable atomic<size_t> m_numBuilt;
+};
+
+#define KD_TREE_LAZY_TEMPLATE \
+	template <typename uint_t, int DIM, typename real_t>
+#define KD_TREE_LAZY_CLASS BasicLazyPointKDTree<uint_t, DIM, real_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicLazyPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_LAZY_TEMPLATE
+KD_TREE_LAZY_CLASS::BasicLazyPointKDTree(
+	vector<point_t>&& arrPoints,
+	size_t deferredSize)
+	: m_deferredSize(max<size_t>(1, deferredSize))
+	, m_arrPoints(move(arrPoints))
+	, m_numDeferred(0)
+{
+	m_numBuilt = 0;
+	assert(m_arrPoints.size() < IDX_NONE);
+	if (m_arrPoints.empty())
+		return;
+
+	buildUpperLevels(0, static_cast<uint_t>(m_arrPoints.size()));
+	m_arrDeferred.reset(new DeferredRange[m_numDeferred]);
+}
+
+KD_TREE_LAZY_TEMPLATE
+uint_t
+KD_TREE_LAZY_CLASS::buildUpperLevels(uint_t idxBegin, uint_t idxEnd)
+{
+	if (idxBegin == idxEnd)
+		return IDX_NONE;
+
+	uint_t idxNode = static_cast<uint_t>(m_arrNodes.size());
+	Node node = { IDX_NONE, IDX_NONE, IDX_NONE, idxBegin, idxEnd,
+		IDX_NONE, X_AXIS };
+	if (static_cast<size_t>(idxEnd - idxBegin) <= m_deferredSize) {
+		node.idxDeferred = static_cast<uint_t>(m_numDeferred++);
+		m_arrNodes.push_back(node);
+		return idxNode;
+	}
+
+	node.axis = chooseSplitAxis(idxBegin, idxEnd);
+	node.idxPoint = idxBegin + (idxEnd - idxBegin) / 2;
+	auto itBegin = begin(m_arrPoints);
+	int axis = node.axis;
+	nth_element(itBegin + idxBegin, itBegin + node.idxPoint, itBegin + idxEnd,
+		[axis](const point_t& lhs, const point_t& rhs) {
+			return lhs[axis] < rhs[axis];
+		});
+
+	m_arrNodes.push_back(node);
+	uint_t idxLeft = buildUpperLevels(idxBegin, node.idxPoint);
+	uint_t idxRight = buildUpperLevels(node.idxPoint + 1, idxEnd);
+	m_arrNodes[idxNode].idxLeft = idxLeft;
+	m_arrNodes[idxNode].idxRight = idxRight;
+	return idxNode;
+}
+
+KD_TREE_LAZY_TEMPLATE
+int
+KD_TREE_LAZY_CLASS::chooseSplitAxis(uint_t idxBegin, uint_t idxEnd) const
+{
+	point_t boundsMin = m_arrPoints[idxBegin];
+	point_t boundsMax = boundsMin;
+	for (uint_t idx = idxBegin+1; idx < idxEnd; ++idx) {
+		const point_t& point = m_arrPoints[idx];
+		forEachAxis<DIM>([&](int axis) {
+			boundsMin[axis] = min<real_t>(point[axis], boundsMin[axis]);
+			boundsMax[axis] = max<real_t>(point[axis], boundsMax[axis]);
+		});
+	}
+
+	// Split the widest axis, ties go to the lowest axis
+	int splitAxis = X_AXIS;
+	real_t splitSize = boundsMax[X_AXIS] - boundsMin[X_AXIS];
+	forEachAxis<DIM>([&](int axis) {
+		real_t size = boundsMax[axis] - boundsMin[axis];
+		if (size > splitSize) {
+			splitAxis = axis;
+			splitSize = size;
+		}
+	});
+	return splitAxis;
+}
+
+KD_TREE_LAZY_TEMPLATE
+const typename KD_TREE_LAZY_CLASS::Subtree&
+KD_TREE_LAZY_CLASS::getSubtree(const Node& node) const
+{
+	// The subtree indexes its range of the shared points in place, the
+	// points were only reordered while the upper levels were split
+	DeferredRange& range = m_arrDeferred[node.idxDeferred];
+	call_once(range.isBuilt, [&]() {
+		range.pTree.reset(new Subtree(&m_arrPoints[node.idxBegin][0],
+			sizeof(point_t), node.idxEnd - node.idxBegin));
+		++m_numBuilt;
+	});
+	return *range.pTree;
+}
+
+KD_TREE_LAZY_TEMPLATE
+bool
+KD_TREE_LAZY_CLASS::getClosestPointTo(
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	result = ClosestPoint();
+	if (m_arrNodes.empty())
+		return false;
+
+	// Nearer sides first, a side is skipped once the closest point so far
+	// is closer than its splitting plane
+	vector<pair<uint_t, real_t> > nodeStack(1, make_pair(uint_t(0), real_t(0)));
+	while (!nodeStack.empty()) {
+		uint_t idxNode = nodeStack.back().first;
+		real_t bound2 = nodeStack.back().second;
+		nodeStack.pop_back();
+		if (bound2 >= result.distance2)
+			continue;
+
+		const Node& node = m_arrNodes[idxNode];
+		if (node.idxDeferred != IDX_NONE) {
+			ClosestPoint hint = result;
+			hint.idxNode = ClosestPoint::IDX_NONE;
+			ClosestPoint subtreeResult;
+			if (getSubtree(node).getClosestPointTo(point, hint, subtreeResult)
+				&& subtreeResult.distance2 < result.distance2)
+			{
+				result = subtreeResult;
+				result.idxNode = ClosestPoint::IDX_NONE;
+			}
+			continue;
+		}
+
+		const point_t& nodePoint = m_arrPoints[node.idxPoint];
+		real_t distance2 = getDistance2<DIM>(point, nodePoint);
+		if (distance2 < result.distance2) {
+			result.point = nodePoint;
+			result.distance2 = distance2;
+		}
+
+		real_t planeDistance = point[node.axis] - nodePoint[node.axis];
+		bool isLeftNear = planeDistance <= 0;
+		uint_t idxNear = isLeftNear ? node.idxLeft : node.idxRight;
+		uint_t idxFar = isLeftNear ? node.idxRight : node.idxLeft;
+		if (idxFar != IDX_NONE)
+			nodeStack.push_back(
+				make_pair(idxFar, planeDistance * planeDistance));
+		if (idxNear != IDX_NONE)
+			nodeStack.push_back(make_pair(idxNear, bound2));
+	}
+
+	return true;
+}
+
+#undef KD_TREE_LAZY_TEMPLATE
+#undef KD_TREE_LAZY_CLASS
+
+#endif // EPL_LAZYKDTREE_H_
@@ -0,0 +1,44 @@
+#pragma once
+#ifndef EPL_MAPPEDFILE_H_
+#define EPL_MAPPEDFILE_H_
+
+#include "stdafx.h"
+
+/// Memory-Mapped File
+/// Pages are faulted in by the OS on first access and shared with every 
+/// other process mapping the same file. Named mappings backed by the paging
+/// file share memory between processes without a file on disk.
+class MappedFile : public Uncopyable
+{
+public: // methods
+	MappedFile();
+	~MappedFile();
+
+	bool open(const string& path);
+
+	// Creates a writable named mapping of size bytes. Fails if the name is
+	// taken, the mapping lives until every process has closed it.
+	bool create(const string& name, size_t size);
+
+	// Opens a named mapping read-only
+	bool openShared(const string& name);
+
+	void close();
+
+	// Touches every page so later accesses do not fault
+	void prefetch() const;
+
+	bool isOpen() const { return m_pData != NULL; }
+	const char* getData() const { return m_pData; }
+	size_t getSize() const { return m_size; }
+	char* getWritableData() const;
+
+private: // members
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+	const char* m_pData;
+	size_t m_size;
+	bool m_isWritable;
+};
+
+#endif // EPL_MAPPEDFILE_H_
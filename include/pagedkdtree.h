@@ -0,0 +1,544 @@
+#pragma once
+#ifndef EPL_PAGEDKDTREE_H_
+#define EPL_PAGEDKDTREE_H_
+
+#include "stdafx.h"
+#include "basickdtree.h"
+
+/// @{
+/// Paged Tree Defaults
+static const size_t KD_TREE_PAGE_SIZE = 64 * 1024;
+static const int KD_TREE_PAGED_TOP_DEPTH = 12;
+/// @}
+
+/// Cached Page of a Tree File
+struct KDTreeCachePage
+{
+	vector<char> data;
+	list<size_t>::iterator itLru;
+};
+
+/// Disk-Paged KD Tree
+/// Queries a tree written by BasicPointKDTree::save() or the out-of-core
+/// builder without mapping or loading it. The file is read in fixed size
+/// pages kept in an LRU cache bounded by a byte budget. Subtrees are stored
+/// contiguously in post-order, so the pages a traversal reaches below the
+/// top levels mostly hold whole bottom subtrees. In post-order the top
+/// levels are spread over the whole file, so their nodes and points are
+/// copied out when the tree is opened and stay resident apart from pages.
+/// Files of every index width are read, nodes are widened to 64 bits.
+/// Files of refit trees are pruned by their stored extents. The tombstones
+/// of files with erased points are resident, a bit per point.
+/// NOTE: queries update the cache, so a tree must not be queried from
+///       several threads at once.
+template <int DIM = 3, typename real_t = fpreal>
+class BasicPagedPointKDTree : public Uncopyable
+{
+public: // types
+	typedef typename KDTreePointTraits<DIM, real_t>::point_t point_t;
+	typedef BasicKDTreeClosestPoint<point_t> ClosestPoint;
+	typedef KDTreeNode<uint64_t> Node;
+
+public: // static members
+	static const uint64_t IDX_NONE = InvalidIndex<uint64_t>::value;
+
+public: // methods
+	BasicPagedPointKDTree();
+
+	// cacheBytes bounds the pages held at once. The top topDepth levels of
+	// nodes and their points, and any tombstones, are held on top of that,
+	// see getPinnedBytes().
+	bool open(const string& path, size_t cacheBytes,
+		size_t pageSize = KD_TREE_PAGE_SIZE,
+		int topDepth = KD_TREE_PAGED_TOP_DEPTH);
+
+	// Live points, erased ones are skipped by queries
+	size_t getNumPoints() const
+		{ return static_cast<size_t>(m_header.numPoints - m_numErased); }
+	bool getClosestPointTo(const point_t& point, ClosestPoint& result) const;
+
+	uint64_t getCacheHits() const { return m_numHits; }
+	uint64_t getCacheMisses() const { return m_numMisses; }
+	size_t getCachedBytes() const { return m_cachedBytes; }
+	size_t getPinnedBytes() const;
+	void resetCacheCounters() { m_numHits = m_numMisses = 0; }
+
+private: // methods
+	Node getNode(uint64_t idxNode) const;
+	point_t getPoint(uint64_t idxPoint) const;
+	uint64_t getIdxNextNode(const Node& node, const point_t& point) const;
+	void walkToLeafNode(vector<uint64_t>& nodeIdxStack,
+		const point_t& point) const;
+	void updateClosestPoint(uint64_t idxNode, const point_t& point,
+		ClosestPoint& result) const;
+	bool isErased(uint64_t idxPoint) const;
+	KDTreeSplitBounds<real_t> getSplitBounds(uint64_t idxNode) const;
+	real_t getDistanceToSide2(uint64_t idxNode, const Node& node,
+		uint64_t idxSide, const point_t& point) const;
+
+	void read(uint64_t offset, size_t size, char* pOut) const;
+	const char* getPage(size_t idxPage) const;
+	void loadTopTree(int topDepth);
+
+private: // members
+	mutable ifstream m_file;
+	KDTreeFileHeader m_header;
+	size_t m_pageSize;
+	size_t m_cacheBytes;
+
+	mutable vector<KDTreeCachePage> m_pages;
+	mutable list<size_t> m_lru; // most recently used first
+	mutable size_t m_cachedBytes;
+
+	// Top levels of the tree by node and point index, sorted for lookup.
+	// Extents are only loaded from files of refit trees.
+	vector<pair<uint64_t, Node> > m_arrTopNodes;
+	vector<pair<uint64_t, point_t> > m_arrTopPoints;
+	vector<pair<uint64_t, KDTreeSplitBounds<real_t> > > m_arrTopBounds;
+
+	// Tombstone section of the file, empty without erased points
+	vector<uint8_t> m_arrErasedBits;
+	uint64_t m_numErased;
+
+	mutable uint64_t m_numHits;
+	mutable uint64_t m_numMisses;
+	mutable bool m_hasReadError;
+};
+
+#define KD_TREE_PAGED_TEMPLATE template <int DIM, typename real_t>
+#define KD_TREE_PAGED_CLASS BasicPagedPointKDTree<DIM, real_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicPagedPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_PAGED_TEMPLATE
+KD_TREE_PAGED_CLASS::BasicPagedPointKDTree()
+	: m_pageSize(KD_TREE_PAGE_SIZE)
+	, m_cacheBytes(0)
+	, m_cachedBytes(0)
+	, m_numErased(0)
+	, m_numHits(0)
+	, m_numMisses(0)
+	, m_hasReadError(false)
+{
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+#define KD_TREE_PAGED_NODE_SIZE_MATCHES(bits) \
+	|| (m_header.idxBits == bits \
+		&& m_header.nodeSize == sizeof(KDTreeNode<uint##bits##_t>))
+
+KD_TREE_PAGED_TEMPLATE
+bool
+KD_TREE_PAGED_CLASS::open(
+	const string& path,
+	size_t cacheBytes,
+	size_t pageSize,
+	int topDepth)
+{
+	assert(pageSize != 0);
+	m_file.close();
+	m_file.clear();
+	m_file.open(path.c_str(), ios::in | ios::binary);
+	if (!m_file)
+		return false;
+
+	m_file.seekg(0, ios::end);
+	uint64_t fileSize = static_cast<uint64_t>(m_file.tellg());
+	m_file.seekg(0);
+	if (fileSize < sizeof(KDTreeFileHeader)
+		|| !m_file.read(reinterpret_cast<char*>(&m_header), sizeof(m_header)))
+	{
+		return false;
+	}
+
+	if (memcmp(m_header.magic, KD_TREE_FILE_MAGIC, sizeof(m_header.magic)) != 0
+		|| m_header.version != KD_TREE_FILE_VERSION
+		|| m_header.byteOrder != KD_TREE_FILE_BYTE_ORDER
+		|| m_header.headerSize != sizeof(KDTreeFileHeader)
+		|| (m_header.flags & ~KD_TREE_FILE_ALL_FLAGS) != 0
+		|| m_header.fileSize != fileSize
+		|| !(false KD_TREE_FOREACH_IDX_SIZE(KD_TREE_PAGED_NODE_SIZE_MATCHES))
+		|| m_header.dim != DIM
+		|| m_header.realSize != sizeof(real_t)
+		|| m_header.numNodes != m_header.numPoints
+		|| m_header.pointsOffset < m_header.nodesOffset
+			+ m_header.numNodes * m_header.nodeSize
+		|| m_header.fileSize < m_header.pointsOffset
+			+ m_header.numPoints * sizeof(point_t))
+	{
+		return false;
+	}
+	if ((m_header.flags & KD_TREE_FILE_SPLIT_BOUNDS)
+		&& (m_header.boundsOffset < m_header.pointsOffset
+				+ m_header.numPoints * sizeof(point_t)
+			|| m_header.fileSize < m_header.boundsOffset
+				+ m_header.numNodes * sizeof(KDTreeSplitBounds<real_t>)))
+	{
+		return false;
+	}
+	if ((m_header.flags & KD_TREE_FILE_TOMBSTONES)
+		&& (m_header.erasedOffset < m_header.pointsOffset
+				+ m_header.numPoints * sizeof(point_t)
+			|| m_header.fileSize < m_header.erasedOffset
+				+ getErasedBitsSize(m_header.numPoints)))
+	{
+		return false;
+	}
+
+	m_pageSize = pageSize;
+	m_cacheBytes = cacheBytes;
+	m_pages.clear();
+	m_pages.resize(static_cast<size_t>((fileSize + pageSize - 1) / pageSize));
+	m_lru.clear();
+	m_cachedBytes = 0;
+	m_arrTopNodes.clear();
+	m_arrTopPoints.clear();
+	m_arrTopBounds.clear();
+	m_arrErasedBits.clear();
+	m_numErased = 0;
+	m_hasReadError = false;
+
+	// Tombstones are read directly, they would only churn the cache
+	if (m_header.flags & KD_TREE_FILE_TOMBSTONES) {
+		m_arrErasedBits.resize(static_cast<size_t>(
+			getErasedBitsSize(m_header.numPoints)));
+		m_file.seekg(m_header.erasedOffset);
+		if (!m_file.read(reinterpret_cast<char*>(&m_arrErasedBits[0]),
+			m_arrErasedBits.size()))
+		{
+			return false;
+		}
+		for (uint64_t idxPoint = 0; idxPoint < m_header.numPoints; ++idxPoint)
+			m_numErased += isErased(idxPoint) ? 1 : 0;
+	}
+
+	loadTopTree(topDepth);
+	resetCacheCounters();
+	return !m_hasReadError;
+}
+
+// Value stored for idx in an array sorted by index, NULL if there is none
+template <typename value_t>
+static inline const value_t*
+findIndexed(const vector<pair<uint64_t, value_t> >& arrSorted, uint64_t idx)
+{
+	auto it = lower_bound(begin(arrSorted), end(arrSorted), idx,
+		[](const pair<uint64_t, value_t>& entry, uint64_t idxEntry) {
+			return entry.first < idxEntry;
+		});
+	return it != end(arrSorted) && it->first == idx ? &it->second : NULL;
+}
+
+template <typename value_t>
+static inline void
+sortIndexed(vector<pair<uint64_t, value_t> >& arrIndexed)
+{
+	sort(begin(arrIndexed), end(arrIndexed),
+		[](const pair<uint64_t, value_t>& lhs,
+			const pair<uint64_t, value_t>& rhs)
+		{
+			return lhs.first < rhs.first;
+		});
+}
+
+KD_TREE_PAGED_TEMPLATE
+void
+KD_TREE_PAGED_CLASS::loadTopTree(int topDepth)
+{
+	if (m_header.numNodes == 0)
+		return;
+
+	// Breadth first from the root, the root is the last node in post-order.
+	// Nodes are read through the cache before they become resident.
+	bool hasBounds = (m_header.flags & KD_TREE_FILE_SPLIT_BOUNDS) != 0;
+	vector<uint64_t> arrLevel(1, m_header.numNodes - 1);
+	vector<uint64_t> arrNextLevel;
+	vector<pair<uint64_t, Node> > arrNodes;
+	vector<pair<uint64_t, point_t> > arrPoints;
+	vector<pair<uint64_t, KDTreeSplitBounds<real_t> > > arrBounds;
+	for (int depth = 0; depth < topDepth && !arrLevel.empty(); ++depth) {
+		arrNextLevel.clear();
+		for_each(begin(arrLevel), end(arrLevel), [&](uint64_t idxNode) {
+			Node node = getNode(idxNode);
+			arrNodes.push_back(make_pair(idxNode, node));
+			arrPoints.push_back(make_pair(node.getIdxPoint(),
+				getPoint(node.getIdxPoint())));
+			if (hasBounds)
+				arrBounds.push_back(make_pair(idxNode, getSplitBounds(idxNode)));
+
+			if (node.getIdxLeft() != IDX_NONE)
+				arrNextLevel.push_back(node.getIdxLeft());
+			if (node.getIdxRight() != IDX_NONE)
+				arrNextLevel.push_back(node.getIdxRight());
+		});
+		arrLevel.swap(arrNextLevel);
+	}
+
+	sortIndexed(arrNodes);
+	sortIndexed(arrPoints);
+	sortIndexed(arrBounds);
+	m_arrTopNodes.swap(arrNodes);
+	m_arrTopPoints.swap(arrPoints);
+	m_arrTopBounds.swap(arrBounds);
+}
+
+KD_TREE_PAGED_TEMPLATE
+size_t
+KD_TREE_PAGED_CLASS::getPinnedBytes() const
+{
+	return m_arrTopNodes.size() * sizeof(m_arrTopNodes[0])
+		+ m_arrTopPoints.size() * sizeof(m_arrTopPoints[0])
+		+ m_arrTopBounds.size() * sizeof(m_arrTopBounds[0])
+		+ m_arrErasedBits.size();
+}
+
+KD_TREE_PAGED_TEMPLATE
+const char*
+KD_TREE_PAGED_CLASS::getPage(size_t idxPage) const
+{
+	KDTreeCachePage& page = m_pages[idxPage];
+	if (!page.data.empty()) {
+		++m_numHits;
+		m_lru.splice(m_lru.begin(), m_lru, page.itLru);
+		return &page.data[0];
+	}
+
+	// At least the requested page is cached, even with a smaller budget
+	++m_numMisses;
+	while (!m_lru.empty() && m_cachedBytes + m_pageSize > m_cacheBytes) {
+		KDTreeCachePage& evicted = m_pages[m_lru.back()];
+		m_cachedBytes -= evicted.data.size();
+		vector<char>().swap(evicted.data);
+		m_lru.pop_back();
+	}
+
+	uint64_t offset = static_cast<uint64_t>(idxPage) * m_pageSize;
+	page.data.resize(static_cast<size_t>(
+		min<uint64_t>(m_pageSize, m_header.fileSize - offset)));
+	m_file.seekg(offset);
+	if (!m_file.read(&page.data[0], page.data.size())) {
+		m_file.clear();
+		m_hasReadError = true;
+		fill(begin(page.data), end(page.data), 0);
+	}
+
+	m_lru.push_front(idxPage);
+	page.itLru = m_lru.begin();
+	m_cachedBytes += page.data.size();
+	return &page.data[0];
+}
+
+KD_TREE_PAGED_TEMPLATE
+void
+KD_TREE_PAGED_CLASS::read(uint64_t offset, size_t size, char* pOut) const
+{
+	// Points need not be aligned to pages, they may span two of them
+	while (size != 0) {
+		size_t idxPage = static_cast<size_t>(offset / m_pageSize);
+		size_t offsetInPage = static_cast<size_t>(offset % m_pageSize);
+		size_t sizeInPage = min(size, m_pageSize - offsetInPage);
+		memcpy(pOut, getPage(idxPage) + offsetInPage, sizeInPage);
+
+		offset += sizeInPage;
+		size -= sizeInPage;
+		pOut += sizeInPage;
+	}
+}
+
+#define KD_TREE_PAGED_READ_NODE(bits) \
+	case bits: { \
+		KDTreeNode<uint##bits##_t> node(0, 0, 0, 0); \
+		read(offset, sizeof(node), reinterpret_cast<char*>(&node)); \
+		return Node(node.getIdxPoint(), \
+			widenIndex(node.getIdxLeft()), \
+			widenIndex(node.getIdxRight()), \
+			node.getAxis()); \
+	}
+
+template <typename uint_t>
+static inline uint64_t
+widenIndex(uint_t idx)
+{
+	return idx == InvalidIndex<uint_t>::value ?
+		InvalidIndex<uint64_t>::value : idx;
+}
+
+KD_TREE_PAGED_TEMPLATE
+typename KD_TREE_PAGED_CLASS::Node
+KD_TREE_PAGED_CLASS::getNode(uint64_t idxNode) const
+{
+	assert(idxNode < m_header.numNodes);
+	if (const Node* pTopNode = findIndexed(m_arrTopNodes, idxNode))
+		return *pTopNode;
+
+	uint64_t offset = m_header.nodesOffset + idxNode * m_header.nodeSize;
+	switch (m_header.idxBits) {
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_PAGED_READ_NODE)
+	default: assert(false && "unchecked index width"); exit(1);
+	}
+}
+
+KD_TREE_PAGED_TEMPLATE
+typename KD_TREE_PAGED_CLASS::point_t
+KD_TREE_PAGED_CLASS::getPoint(uint64_t idxPoint) const
+{
+	assert(idxPoint < m_header.numPoints);
+	if (const point_t* pTopPoint = findIndexed(m_arrTopPoints, idxPoint))
+		return *pTopPoint;
+
+	point_t point;
+	read(m_header.pointsOffset + idxPoint * sizeof(point_t), sizeof(point_t),
+		reinterpret_cast<char*>(&point));
+	return point;
+}
+
+KD_TREE_PAGED_TEMPLATE
+uint64_t
+KD_TREE_PAGED_CLASS::getIdxNextNode(
+	const Node& node,
+	const point_t& point) const
+{
+	assert(!isLeafNode(node));
+	if (node.getIdxLeft() == IDX_NONE)
+		return node.getIdxRight();
+	if (node.getIdxRight() == IDX_NONE)
+		return node.getIdxLeft();
+
+	int axis = node.getAxis();
+	const point_t nodePoint = getPoint(node.getIdxPoint());
+	return (point[axis] <= nodePoint[axis]) ?
+		node.getIdxLeft() : node.getIdxRight();
+}
+
+KD_TREE_PAGED_TEMPLATE
+void
+KD_TREE_PAGED_CLASS::walkToLeafNode(
+	vector<uint64_t>& nodeIdxStack,
+	const point_t& point) const
+{
+	for (;;) {
+		Node node = getNode(nodeIdxStack.back());
+		if (isLeafNode(node))
+			return;
+		nodeIdxStack.push_back(getIdxNextNode(node, point));
+	}
+}
+
+KD_TREE_PAGED_TEMPLATE
+void
+KD_TREE_PAGED_CLASS::updateClosestPoint(
+	uint64_t idxNode,
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	uint64_t idxPoint = getNode(idxNode).getIdxPoint();
+	if (isErased(idxPoint))
+		return;
+	const point_t nodePoint = getPoint(idxPoint);
+	real_t distance2 = getDistance2<DIM>(point, nodePoint);
+	if (distance2 < result.distance2) {
+		result.point = nodePoint;
+		result.distance2 = distance2;
+		result.idxNode = static_cast<size_t>(idxNode);
+	}
+}
+
+KD_TREE_PAGED_TEMPLATE
+bool
+KD_TREE_PAGED_CLASS::isErased(uint64_t idxPoint) const
+{
+	if (m_arrErasedBits.empty())
+		return false;
+	return ((m_arrErasedBits[static_cast<size_t>(idxPoint / 8)] 
+		>> (idxPoint % 8)) & 1) != 0;
+}
+
+KD_TREE_PAGED_TEMPLATE
+KDTreeSplitBounds<real_t>
+KD_TREE_PAGED_CLASS::getSplitBounds(uint64_t idxNode) const
+{
+	assert(idxNode < m_header.numNodes);
+	const KDTreeSplitBounds<real_t>* pTopBounds = 
+		findIndexed(m_arrTopBounds, idxNode);
+	if (pTopBounds != NULL)
+		return *pTopBounds;
+
+	KDTreeSplitBounds<real_t> bounds;
+	read(m_header.boundsOffset + idxNode * sizeof(bounds), sizeof(bounds),
+		reinterpret_cast<char*>(&bounds));
+	return bounds;
+}
+
+KD_TREE_PAGED_TEMPLATE
+real_t
+KD_TREE_PAGED_CLASS::getDistanceToSide2(
+	uint64_t idxNode,
+	const Node& node,
+	uint64_t idxSide,
+	const point_t& point) const
+{
+	// Same distances as BasicPointKDTree::getDistanceToSide2()
+	int axis = node.getAxis();
+	if (!(m_header.flags & KD_TREE_FILE_SPLIT_BOUNDS)) {
+		real_t planeDistance = point[axis] - getPoint(node.getIdxPoint())[axis];
+		return planeDistance * planeDistance;
+	}
+
+	KDTreeSplitBounds<real_t> bounds = getSplitBounds(idxNode);
+	real_t distance = (idxSide == node.getIdxLeft()) ?
+		point[axis] - bounds.leftMax : bounds.rightMin - point[axis];
+	return distance > 0 ? distance * distance : 0;
+}
+
+KD_TREE_PAGED_TEMPLATE
+bool
+KD_TREE_PAGED_CLASS::getClosestPointTo(
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	result = ClosestPoint();
+	if (getNumPoints() == 0)
+		return false;
+
+	// Same walk as BasicPointKDTree::searchSubtree(), every node and point
+	// is read through the page cache
+	vector<uint64_t> nodeIdxStack(1, m_header.numNodes - 1);
+	walkToLeafNode(nodeIdxStack, point);
+	updateClosestPoint(nodeIdxStack.back(), point, result);
+
+	uint64_t idxLastNode = IDX_NONE;
+	pop(idxLastNode, nodeIdxStack);
+	while (!nodeIdxStack.empty()) {
+		uint64_t idxNode = nodeIdxStack.back();
+		Node node = getNode(idxNode);
+		if (idxLastNode != getIdxNextNode(node, point)) {
+			pop(idxLastNode, nodeIdxStack);
+			continue;
+		}
+
+		updateClosestPoint(idxNode, point, result);
+		uint64_t idxOppositeSide = getIdxOppositeSide(idxLastNode, node);
+		if (idxOppositeSide == IDX_NONE
+			|| getDistanceToSide2(idxNode, node, idxOppositeSide, point)
+				>= result.distance2) {
+			pop(idxLastNode, nodeIdxStack);
+			continue;
+		}
+
+		nodeIdxStack.push_back(idxOppositeSide);
+		walkToLeafNode(nodeIdxStack, point);
+		updateClosestPoint(nodeIdxStack.back(), point, result);
+		pop(idxLastNode, nodeIdxStack);
+	}
+
+	return !m_hasReadError;
+}
+
+#undef KD_TREE_PAGED_NODE_SIZE_MATCHES
+#undef KD_TREE_PAGED_READ_NODE
+#undef KD_TREE_PAGED_TEMPLATE
+#undef KD_TREE_PAGED_CLASS
+
+#endif // EPL_PAGEDKDTREE_H_
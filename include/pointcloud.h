@@ -0,0 +1,26 @@
+#pragma once
+#ifndef EPL_POINTCLOUD_H_
+#define EPL_POINTCLOUD_H_
+
+#include "stdafx.h"
+
+/// @{
+/// Point Cloud Loaders
+/// Files are mapped and decoded by one thread per core, each writing its
+/// chunk of points straight into out_points. The array can then be moved
+/// into PointKDTree(vector<V3x>&&), which partitions it in place, so points
+/// are never copied between parsing and building.
+
+// Binary little or big endian PLY, the vertex element must come first and
+// have float or double x, y and z properties among any others
+bool loadPLY(const string& path, vector<V3x>& out_points);
+
+// Text with one "x y z" point per line, further columns, blank lines and
+// lines starting with '#' are ignored
+bool loadXYZ(const string& path, vector<V3x>& out_points);
+
+// Chooses the loader by the file extension
+bool loadPointCloud(const string& path, vector<V3x>& out_points);
+/// @}
+
+#endif // EPL_POINTCLOUD_H_
@@ -0,0 +1,215 @@
+#pragma once
+#ifndef EPL_POINTSCAN_H_
+#define EPL_POINTSCAN_H_
+
+#include "stdafx.h"
+#include "basickdtree.h"
+
+/// Most points a PointKDTree answers by scanning instead of walking its tree
+static const size_t KD_TREE_SCAN_MAX_POINTS = 255;
+
+/// Brute-Force Closest Point Engine
+/// Points are stored as one coordinate array per axis, padded to whole SIMD
+/// registers with points at infinity, so the kernel loads WIDTH points per
+/// axis directly and has no scalar tail. Every query is compared with every
+/// point, which beats a tree walk and its stack for a few hundred points.
+/// Distances are summed in axis order like getDistance2(), so results can
+/// serve as a reference for any tree over the same points. Points may be
+/// given the tree nodes holding them, results then carry that node.
+template <int DIM, typename real_t = fpreal>
+class BasicPointScan : public Uncopyable
+{
+public: // types
+	typedef typename KDTreePointTraits<DIM, real_t>::point_t point_t;
+	typedef BasicKDTreeClosestPoint<point_t> ClosestPoint;
+	typedef KDTreeSimd<real_t> Simd;
+
+public: // methods
+	// arrIdxNodes, if given, holds the node of each point
+	BasicPointScan(const point_t* arrPoints, size_t numPoints,
+		const size_t* arrIdxNodes = NULL);
+
+	size_t getNumPoints() const { return m_numPoints; }
+	point_t getPoint(size_t idxPoint) const;
+
+	// Removes the points inside the box, later points move down
+	size_t eraseInBox(const point_t& boxMin, const point_t& boxMax);
+
+	// Results carry no node unless nodes were given. bound2 limits the
+	// search like a hint without a node, false is returned if no point
+	// lies closer.
+	bool getClosestPointTo(const point_t& point, ClosestPoint& result) const;
+	bool getClosestPointTo(const point_t& point, real_t bound2,
+		ClosestPoint& result) const;
+	bool getClosestPointsTo(const point_t* arrQueries, size_t numQueries,
+		ClosestPoint* arrResults) const;
+
+private: // methods
+	void pad();
+
+private: // members
+	vector<real_t> m_arrCoords[DIM];
+	vector<size_t> m_arrIdxNodes; // empty if no nodes were given
+	size_t m_numPoints;
+};
+
+#define KD_TREE_SCAN_TEMPLATE template <int DIM, typename real_t>
+#define KD_TREE_SCAN_CLASS BasicPointScan<DIM, real_t>
+
+////////////////////////////////////////////////////////////////////////////////
+// BasicPointScan Methods
+////////////////////////////////////////////////////////////////////////////////
+
+KD_TREE_SCAN_TEMPLATE
+KD_TREE_SCAN_CLASS::BasicPointScan(
+	const point_t* arrPoints,
+	size_t numPoints,
+	const size_t* arrIdxNodes)
+	: m_numPoints(numPoints)
+{
+	if (arrIdxNodes != NULL)
+		m_arrIdxNodes.assign(arrIdxNodes, arrIdxNodes + numPoints);
+	forEachAxis<DIM>([&](int axis) {
+		vector<real_t>& arrCoords = m_arrCoords[axis];
+		arrCoords.reserve(numPoints + Simd::WIDTH - 1);
+		for (size_t idx = 0; idx < numPoints; ++idx)
+			arrCoords.push_back(arrPoints[idx][axis]);
+	});
+	pad();
+}
+
+KD_TREE_SCAN_TEMPLATE
+void
+KD_TREE_SCAN_CLASS::pad()
+{
+	// Any distance to a point at infinity is infinite or NaN, neither is
+	// less than the best distance so far
+	size_t numPadded = (m_numPoints + Simd::WIDTH - 1)
+		/ Simd::WIDTH * Simd::WIDTH;
+	forEachAxis<DIM>([&](int axis) {
+		m_arrCoords[axis].resize(m_numPoints);
+		m_arrCoords[axis].resize(numPadded,
+			numeric_limits<real_t>::infinity());
+	});
+}
+
+KD_TREE_SCAN_TEMPLATE
+typename KD_TREE_SCAN_CLASS::point_t
+KD_TREE_SCAN_CLASS::getPoint(size_t idxPoint) const
+{
+	assert(idxPoint < m_numPoints);
+	point_t point;
+	forEachAxis<DIM>([&](int axis) {
+		point[axis] = m_arrCoords[axis][idxPoint];
+	});
+	return point;
+}
+
+KD_TREE_SCAN_TEMPLATE
+size_t
+KD_TREE_SCAN_CLASS::eraseInBox(const point_t& boxMin, const point_t& boxMax)
+{
+	size_t numKept = 0;
+	for (size_t idx = 0; idx < m_numPoints; ++idx) {
+		bool isInside = true;
+		forEachAxis<DIM>([&](int axis) {
+			isInside &= boxMin[axis] <= m_arrCoords[axis][idx]
+				&& m_arrCoords[axis][idx] <= boxMax[axis];
+		});
+		if (isInside)
+			continue;
+		forEachAxis<DIM>([&](int axis) {
+			m_arrCoords[axis][numKept] = m_arrCoords[axis][idx];
+		});
+		if (!m_arrIdxNodes.empty())
+			m_arrIdxNodes[numKept] = m_arrIdxNodes[idx];
+		++numKept;
+	}
+
+	size_t numErased = m_numPoints - numKept;
+	m_numPoints = numKept;
+	if (!m_arrIdxNodes.empty())
+		m_arrIdxNodes.resize(numKept);
+	pad();
+	return numErased;
+}
+
+KD_TREE_SCAN_TEMPLATE
+bool
+KD_TREE_SCAN_CLASS::getClosestPointTo(
+	const point_t& point,
+	ClosestPoint& result) const
+{
+	return getClosestPointTo(point, numeric_limits<real_t>::max(), result);
+}
+
+KD_TREE_SCAN_TEMPLATE
+bool
+KD_TREE_SCAN_CLASS::getClosestPointTo(
+	const point_t& point,
+	real_t bound2,
+	ClosestPoint& result) const
+{
+	typedef typename Simd::reg_t reg_t;
+	static const size_t WIDTH = Simd::WIDTH;
+
+	result = ClosestPoint();
+	result.distance2 = bound2;
+
+	reg_t query[DIM];
+	forEachAxis<DIM>([&](int axis) {
+		query[axis] = Simd::set1(point[axis]);
+	});
+
+	size_t idxClosest = m_numPoints;
+	size_t numPadded = m_arrCoords[0].size();
+	real_t lanes[WIDTH];
+	for (size_t idx = 0; idx < numPadded; idx += WIDTH) {
+		reg_t distance2 = Simd::set1(0);
+		forEachAxis<DIM>([&](int axis) {
+			reg_t diff = Simd::sub(query[axis],
+				Simd::load(&m_arrCoords[axis][idx]));
+			distance2 = Simd::add(distance2, Simd::mul(diff, diff));
+		});
+
+		// Only lanes beating the best distance are looked at one by one
+		if (Simd::lessThan(distance2, Simd::set1(result.distance2)) == 0)
+			continue;
+		Simd::store(lanes, distance2);
+		for (size_t lane = 0; lane < WIDTH; ++lane) {
+			if (lanes[lane] < result.distance2) {
+				result.distance2 = lanes[lane];
+				idxClosest = idx + lane;
+			}
+		}
+	}
+
+	if (idxClosest == m_numPoints) {
+		result = ClosestPoint();
+		return false;
+	}
+	result.point = getPoint(idxClosest);
+	if (!m_arrIdxNodes.empty())
+		result.idxNode = m_arrIdxNodes[idxClosest];
+	return true;
+}
+
+KD_TREE_SCAN_TEMPLATE
+bool
+KD_TREE_SCAN_CLASS::getClosestPointsTo(
+	const point_t* arrQueries,
+	size_t numQueries,
+	ClosestPoint* arrResults) const
+{
+	if (m_numPoints == 0)
+		return false;
+
+	for (size_t idx = 0; idx < numQueries; ++idx)
+		getClosestPointTo(arrQueries[idx], arrResults[idx]);
+	return true;
+}
+
+#undef KD_TREE_SCAN_TEMPLATE
+#undef KD_TREE_SCAN_CLASS
+
+#endif // EPL_POINTSCAN_H_
@@ -0,0 +1,55 @@
+#pragma once
+#ifndef EPL_READEPOCHS_H_
+#define EPL_READEPOCHS_H_
+
+#include "stdafx.h"
+
+/// Grace Periods for Lock-Free Readers
+/// Readers pin the current epoch around their access to a shared pointer,
+/// a writer that has swapped the pointer calls synchronize() before it 
+/// frees the old target. Writers that must not wait instead tag the old 
+/// target with getEpoch() and free it once tryAdvance() has moved two
+/// epochs past the tag. enter() and leave() are a counter update each,
+/// readers never wait for writers or retry. Two epochs are in flight at a
+/// time, the epoch only advances once the readers of the older have left.
+class ReadEpochs : public Uncopyable
+{
+public: // methods
+	ReadEpochs();
+
+	// Returns the pinned slot to pass to leave()
+	int enter();
+	void leave(int slot);
+
+	// Writers serialise the methods below.
+	// Waits until every reader that entered before the call has left.
+	void synchronize();
+
+	// Advances the epoch unless readers of the previous one are left, an
+	// object retired in epoch e is unreachable once getEpoch() >= e + 2
+	bool tryAdvance();
+	unsigned getEpoch() const { return m_epoch; }
+
+private: // members
+	atomic<unsigned> m_epoch;
+	atomic<size_t> m_numReaders[2];
+};
+
+/// Pins a ReadEpochs for the Current Scope
+class ReadEpochPin : public Uncopyable
+{
+public: // methods
+	explicit ReadEpochPin(ReadEpochs& epochs)
+		: m_epochs(epochs)
+		, m_slot(epochs.enter())
+	{
+	}
+
+	~ReadEpochPin() { m_epochs.leave(m_slot); }
+
+private: // members
+	ReadEpochs& m_epochs;
+	const int m_slot;
+};
+
+#endif // EPL_READEPOCHS_H_
@@ -5,6 +5,7 @@
 // ILM Math Library
 #include <ImathVec.h>
 #include <ImathVecAlgo.h>
+#include <ImathBox.h>
 #include <ImathMatrix.h>
 #include <ImathMatrixAlgo.h>
 using namespace Imath;
@@ -17,25 +18,40 @@ typedef Vec4<fpreal> V4x;
 
 // STL Includes
 #include <iostream>
+#include <fstream>
 #include <algorithm>
 #include <memory>
 #include <string>
 #include <sstream>
 #include <vector>
+#include <list>
+#include <deque>
 #include <stack>
 #include <map>
 #include <iterator>
 #include <limits>
 #include <exception>
+#include <functional>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 using namespace std;
 
 // C Includes
 #include <cstdlib>
+#include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <ctime>
 #include <cassert>
 #include <cstdint>
 
+// SIMD Includes
+#include <emmintrin.h>
+#include <immintrin.h>
+
 // OS Includes
 #include <Windows.h>
 
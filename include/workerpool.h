@@ -0,0 +1,45 @@
+#pragma once
+#ifndef EPL_WORKERPOOL_H_
+#define EPL_WORKERPOOL_H_
+
+#include "stdafx.h"
+
+/// Persistent Worker Threads
+/// Runs batches of tasks on threads started by the first batch and kept
+/// for the following ones, so work repeated every frame does not pay for
+/// creating threads. The calling thread runs tasks as well and run()
+/// returns once the whole batch is done. Batches are run one at a time, a
+/// batch started while another runs, e.g. from inside a task, runs on the
+/// calling thread alone.
+class WorkerPool : public Uncopyable
+{
+public: // methods
+	WorkerPool();
+	~WorkerPool();
+
+	// Calls task(idx) for every idx below numTasks
+	void run(size_t numTasks, const function<void (size_t)>& task);
+
+	// Pool shared by the kdtrees, one thread less than the hardware runs
+	static WorkerPool& getShared();
+
+private: // methods
+	void work();
+	bool runNextTask(unique_lock<mutex>& lock);
+
+private: // members
+	mutex m_batchMutex;
+	mutex m_mutex;
+	condition_variable m_taskReady;
+	condition_variable m_batchDone;
+	vector<thread> m_arrThreads;
+
+	// Current batch, guarded by m_mutex
+	const function<void (size_t)>* m_pTask;
+	size_t m_numTasks;
+	size_t m_idxNextTask;
+	size_t m_numRunning;
+	bool m_isStopping;
+};
+
+#endif // EPL_WORKERPOOL_H_
@@ -3,74 +3,6 @@
 
 #pragma warning(push, 4)
 
-/// @{
-/// Helper Macros for Dynamic Index Precision
-/// NOTE: these helpers must all be changed to add/remove an index precision
-#define KD_TREE_EMPTY_ARGUMENT
-#define KD_TREE_FOREACH_IDX_SIZE(macro) \
-	macro(8) \
-	macro(16) \
-	macro(32) \
-	macro(64)
-#define KD_TREE_FOREACH_IDX_SIZE_ARG1(macro, arg) \
-	macro(8, arg) \
-	macro(16, arg) \
-	macro(32, arg) \
-	macro(64, arg)
-#define KD_TREE_FOREACH_IDX_SIZE_ARG2(macro, arg1, arg2) \
-	macro(8, arg1, arg2) \
-	macro(16, arg1, arg2) \
-	macro(32, arg1, arg2) \
-	macro(64, arg1, arg2)
-/// @}
-
-/// @{
-/// Invalid Index
-template <typename uint_t>
-struct InvalidIndex {
-	static const uint_t value = 0;
-};
-
-#define KD_TREE_INVALID_IDX(bits) \
-	template <> \
-	struct InvalidIndex<uint##bits##_t> { \
-		static const uint##bits##_t value = UINT##bits##_MAX; \
-	};
-
-KD_TREE_FOREACH_IDX_SIZE(KD_TREE_INVALID_IDX)
-/// @}
-
-/// KD Tree Node
-template <typename uint_t>
-class KDTreeNode
-{
-public: // types
-	typedef vector<KDTreeNode<uint_t> > KDTreeNodeList;
-
-public: // methods
-	KDTreeNode(
-		uint_t idxPoint,
-		uint_t idxLeft,
-		uint_t idxRight,
-		KDTreeAxis axis);
-
-	uint_t		getIdxPoint()  const { return m_idxPoint; }
-	KDTreeAxis	getAxis()      const { return m_axis; }
-	uint_t		getIdxLeft()   const { return m_idxLeft; }
-	uint_t		getIdxRight()  const { return m_idxRight; }
-
-	uint_t		getSize(const KDTreeNodeList& arrNodes) const;
-	bool		isBalanced(const KDTreeNodeList& arrNodes) const;
-
-	void		dump(const vector<V3x>& arrPoints, ostream& out) const;
-
-private: // members
-	KDTreeAxis m_axis;
-	uint_t m_idxPoint;
-	uint_t m_idxLeft;
-	uint_t m_idxRight;
-};
-
 #define DEFINE_IDX_TYPE(bits) \
 	IDX_TYPE_##bits,
 
@@ -80,205 +12,237 @@ enum KDTreeIndexType
 	IDX_TYPE_INVALID
 };
 
-/// KD Tree Actual Implementation 
-template <typename uint_t>
-class PointKDTreeImplImpl 
-{
-public: // types
-	typedef vector<KDTreeNode<uint_t> > KDTreeNodeList;
-
-public: // static members
-	static const uint_t IDX_NONE = InvalidIndex<uint_t>::value;
-
-public: // methods
-	PointKDTreeImplImpl(const vector<V3x>& arrPoints);
-	PointKDTreeImplImpl(vector<V3x>&& arrPoints);
-
-	uint_t buildTree(uint_t idxBegin, uint_t idxEnd);
-	bool isBalanced() const;
-	bool getClosestPointTo(const V3x& point, KDTreeClosestPoint& result) const;
-	void dump(ostream& out = cerr) const;
-
-private: // methods
-
-	void init();
-
-	KDTreeAxis chooseSplitAxis(uint_t idxBegin, uint_t idxEnd) const;
-
-	void initClosestPointStack(vector<uint_t>& nodeIdxStack) const;
-	void walkToLeafNode(vector<uint_t>& nodeIdxStack, const V3x& point) const;
-	const KDTreeNode<uint_t>* getRootNode() const;
-	uint_t getIdxRootNode() const;
-	const KDTreeNode<uint_t>& getCurrentNode(
-		vector<uint_t>& nodeIdxStack) const;
-	uint_t getIdxNextNode(const KDTreeNode<uint_t>& node,
-		const V3x& point) const;
-	bool updateClosestPoint(
-		vector<uint_t>& nodeIdxStack,
-		const V3x& point,
-		KDTreeClosestPoint& result) const;
-	fpreal getDistanceToPlane2(const KDTreeNode<uint_t>& node,
-		const V3x& point) const;
-	uint_t getIdxPointSide(const KDTreeNode<uint_t>& node, 
-		const V3x& point) const;
-
-	uint_t partitionAroundMedian(uint_t idxBegin, uint_t idxEnd,
-		KDTreeAxis axis);
-
-private: // members
-	KDTreeNodeList m_arrNodes;
-	vector<V3x> m_arrPoints;
-};
-
 /// KD Tree Implementation
 class PointKDTreeImpl : public Uncopyable
 {
 public: // methods
 	PointKDTreeImpl(const vector<V3x>& arrPoints);
 	PointKDTreeImpl(vector<V3x>&& arrPoints);
+	PointKDTreeImpl(const fpreal* pCoords, size_t byteStride,
+		size_t numPoints);
+
+	static PointKDTreeImpl* open(const shared_ptr<MappedFile>& pFile,
+		int flags);
+	static PointKDTreeImpl* merge(const PointKDTreeImpl& a,
+		const PointKDTreeImpl& b);
 
 	bool isBalanced() const;
+	size_t eraseInBox(const Box<V3x>& box);
+	size_t getNumLivePoints() const;
+	void setCompactionThreshold(double fraction);
+	bool compact();
+	bool refit();
+	void setRefitThreshold(double overlap);
+	double getRefitOverlap() const;
 	bool getClosestPointTo(
 		const V3x& point,
 		KDTreeClosestPoint& result) const;
+	bool getClosestPointTo(
+		const V3x& point,
+		const KDTreeClosestPoint& hint,
+		KDTreeClosestPoint& result) const;
+	bool getClosestPointsTo(
+		const vector<V3x>& arrQueries,
+		vector<KDTreeClosestPoint>& results) const;
 	void dump(ostream& out) const;
+	bool save(const string& path) const;
+	size_t getImageSize() const;
+	void writeImage(char* pImage) const;
+
+#define KD_TREE_IMPL_GET_TREE(bits) \
+	const BasicPointKDTree<uint##bits##_t>* getTree##bits() const \
+		{ return m_pImpl##bits.get(); }
+
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_IMPL_GET_TREE)
+
+private: // methods
+	PointKDTreeImpl();
+	template <typename points_t>
+	void initTree(points_t&& arrPoints);
+	void initScan();
 
 private: // members
 	KDTreeIndexType m_idxType;
 
+	// Answers every query instead of the tree when built from few points
+	unique_ptr<PointScan> m_pScan;
+
 #define KD_TREE_IMPL_MEMBER_PTR(bits) \
-	const unique_ptr<PointKDTreeImplImpl<uint##bits##_t> > m_pImpl##bits;
+	const unique_ptr<BasicPointKDTree<uint##bits##_t> > m_pImpl##bits;
 
 	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_IMPL_MEMBER_PTR)
 };
 
 ////////////////////////////////////////////////////////////////////////////////
-// KDTreeNode Methods
+// PointKDTreeImpl Methods
 ////////////////////////////////////////////////////////////////////////////////
 
-template <typename uint_t>
-KDTreeNode<uint_t>::KDTreeNode(
-	uint_t idxPoint,
-	uint_t idxLeft,
-	uint_t idxRight,
-	KDTreeAxis axis)
-	: m_idxPoint(idxPoint)
-	, m_idxLeft(idxLeft)
-	, m_idxRight(idxRight)
-	, m_axis(axis)
+#define KD_TREE_IDX_SIZE_IS_ENOUGH(bits) \
+	numPoints < numeric_limits<uint##bits##_t>::max()
+#define KD_TREE_INIT_IMPL(bits, arrPoints) \
+	if (KD_TREE_IDX_SIZE_IS_ENOUGH(bits)) { \
+		const_cast<unique_ptr<BasicPointKDTree<uint##bits##_t> >&> \
+			(m_pImpl##bits).reset( \
+				new BasicPointKDTree<uint##bits##_t>(arrPoints)); \
+		m_idxType = IDX_TYPE_##bits; \
+		return; \
+	}
+
+PointKDTreeImpl::PointKDTreeImpl(const vector<V3x>& arrPoints)
+	: m_idxType(IDX_TYPE_INVALID)
 {
-	assert(m_idxPoint != InvalidIndex<uint_t>::value);
+	initTree(arrPoints);
+	initScan();
 }
 
-template <typename uint_t>
-static string
-getIdxString(uint_t idx)
+PointKDTreeImpl::PointKDTreeImpl(vector<V3x>&& arrPoints)
+	: m_idxType(IDX_TYPE_INVALID)
 {
-	if (idx == InvalidIndex<uint_t>::value)
-		return "NONE";
+	initTree(move(arrPoints));
+	initScan();
+}
 
-	stringstream ss;
-	ss << static_cast<size_t>(idx);
-	return ss.str();
+template <typename points_t>
+void
+PointKDTreeImpl::initTree(points_t&& arrPoints)
+{
+	size_t numPoints = arrPoints.size();
+	KD_TREE_FOREACH_IDX_SIZE_ARG1(KD_TREE_INIT_IMPL,
+		forward<points_t>(arrPoints))
 }
 
+// Scan over the live points of tree, each carrying the node holding it
 template <typename uint_t>
-void
-KDTreeNode<uint_t>::dump(const vector<V3x>& arrPoints, ostream& out) const
+static PointScan*
+createScan(const BasicPointKDTree<uint_t>& tree)
 {
-	assert(arrPoints.size() > m_idxPoint);
+	vector<V3x> arrPoints;
+	vector<size_t> arrIdxNodes;
+	for (size_t idxNode = 0; idxNode < tree.getNumNodes(); ++idxNode) {
+		size_t idxPoint = static_cast<size_t>(
+			tree.getNode(idxNode).getIdxPoint());
+		if (tree.isErased(idxPoint))
+			continue;
+		arrPoints.push_back(tree.getPoint(idxPoint));
+		arrIdxNodes.push_back(idxNode);
+	}
+	assert(!arrPoints.empty());
+	return new PointScan(&arrPoints[0], arrPoints.size(), &arrIdxNodes[0]);
+}
+
+#define KD_TREE_CREATE_SCAN(bits) \
+	if (m_pImpl##bits) \
+		m_pScan.reset(createScan(*m_pImpl##bits));
 
-	switch (m_axis) {
-	case X_AXIS: out << "X AXIS"; break;
-	case Y_AXIS: out << "Y AXIS"; break;
-	case Z_AXIS: out << "Z AXIS"; break;
+void
+PointKDTreeImpl::initScan()
+{
+	// The tree is still built for everything but queries, e.g. visit(),
+	// save() and merge(). Results carry the tree's nodes, so they warm
+	// start queries as tree results do. External points may move, so they
+	// are never copied into a scan.
+	m_pScan.reset();
+	size_t numPoints = getNumLivePoints();
+	if (numPoints != 0 && numPoints <= KD_TREE_SCAN_MAX_POINTS) {
+		KD_TREE_FOREACH_IDX_SIZE(KD_TREE_CREATE_SCAN)
 	}
-	size_t idxPoint = static_cast<size_t>(m_idxPoint);
-	out << ", POINT " << idxPoint << ": " << arrPoints[idxPoint] << "\n";
-	out << "  CHILDREN: " << getIdxString(m_idxLeft) << " "
-		<< getIdxString(m_idxRight) << "\n";
 }
 
-template <typename uint_t>
-static inline uint_t
-getChildSize(
-	const vector<KDTreeNode<uint_t> >& arrNodes,
-	uint_t idx)
+#undef KD_TREE_CREATE_SCAN
+
+#define KD_TREE_INIT_EXTERNAL_IMPL(bits) \
+	if (KD_TREE_IDX_SIZE_IS_ENOUGH(bits)) { \
+		const_cast<unique_ptr<BasicPointKDTree<uint##bits##_t> >&> \
+			(m_pImpl##bits).reset(new BasicPointKDTree<uint##bits##_t>( \
+				pCoords, byteStride, numPoints)); \
+		m_idxType = IDX_TYPE_##bits; \
+		return; \
+	}
+
+PointKDTreeImpl::PointKDTreeImpl(
+	const fpreal* pCoords,
+	size_t byteStride,
+	size_t numPoints)
+	: m_idxType(IDX_TYPE_INVALID)
 {
-	size_t idxNode = static_cast<size_t>(idx);
-	return (idx == InvalidIndex<uint_t>::value) ?
-		0 : arrNodes[idxNode].getSize(arrNodes);
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_INIT_EXTERNAL_IMPL)
 }
 
-template <typename uint_t>
-static inline bool
-sizesAreBalanced(uint_t leftSize, uint_t rightSize)
+PointKDTreeImpl::PointKDTreeImpl()
+	: m_idxType(IDX_TYPE_INVALID)
 {
-	return leftSize <= rightSize+1 && rightSize <= leftSize+1;
 }
 
-template <typename uint_t>
-static inline bool
-subtreeIsBalanced(
-	uint_t size,
-	uint_t idx,
-	const vector<KDTreeNode<uint_t> >& arrNodes)
+#define KD_TREE_OPEN_IMPL(bits) \
+	if (header.idxBits == bits) { \
+		const_cast<unique_ptr<BasicPointKDTree<uint##bits##_t> >&> \
+			(pImpl->m_pImpl##bits) = \
+				BasicPointKDTree<uint##bits##_t>::open(pFile, flags); \
+		if (!pImpl->m_pImpl##bits) \
+			return NULL; \
+		pImpl->m_idxType = IDX_TYPE_##bits; \
+		return pImpl.release(); \
+	}
+
+PointKDTreeImpl*
+PointKDTreeImpl::open(const shared_ptr<MappedFile>& pFile, int flags)
 {
-	size_t idxNode = static_cast<size_t>(idx);
-	return (size == 0) ? true : arrNodes[idxNode].isBalanced(arrNodes);
+	// The index width is only known from the header, so the file is mapped
+	// once by the caller and handed to the tree of that width
+	KDTreeFileHeader header;
+	if (!readKDTreeFileHeader(*pFile, header))
+		return NULL;
+
+	unique_ptr<PointKDTreeImpl> pImpl(new PointKDTreeImpl());
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_OPEN_IMPL)
+	return NULL;
 }
 
-template <typename uint_t>
-bool
-KDTreeNode<uint_t>::isBalanced(const KDTreeNodeList& arrNodes) const
+// Merges a into a tree of index type uint_t, whatever the type of b
+template <typename uint_t, typename uint_a_t>
+static unique_ptr<BasicPointKDTree<uint_t> >
+mergeTrees(const BasicPointKDTree<uint_a_t>& a, const PointKDTreeImpl& b)
 {
-	uint_t leftSize = getChildSize(arrNodes, m_idxLeft);
-	uint_t rightSize = getChildSize(arrNodes, m_idxRight);
-	if (!sizesAreBalanced(leftSize, rightSize))
-		return false;
+#define KD_TREE_MERGE_WITH(bits) \
+	if (const BasicPointKDTree<uint##bits##_t>* pTreeB = b.getTree##bits()) \
+		return BasicPointKDTree<uint_t>::merge(a, *pTreeB);
 
-	return subtreeIsBalanced(leftSize, m_idxLeft, arrNodes)
-		&& subtreeIsBalanced(rightSize, m_idxRight, arrNodes);
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_MERGE_WITH)
+#undef KD_TREE_MERGE_WITH
+	return unique_ptr<BasicPointKDTree<uint_t> >();
 }
 
 template <typename uint_t>
-uint_t
-KDTreeNode<uint_t>::getSize(const KDTreeNodeList& arrNodes) const
+static unique_ptr<BasicPointKDTree<uint_t> >
+mergeTrees(const PointKDTreeImpl& a, const PointKDTreeImpl& b)
 {
-	return 1 + getChildSize(arrNodes, m_idxLeft) 
-		+ getChildSize(arrNodes, m_idxRight);
-}
+#define KD_TREE_MERGE_FROM(bits) \
+	if (const BasicPointKDTree<uint##bits##_t>* pTreeA = a.getTree##bits()) \
+		return mergeTrees<uint_t>(*pTreeA, b);
 
-////////////////////////////////////////////////////////////////////////////////
-// PointKDTreeImpl Methods
-////////////////////////////////////////////////////////////////////////////////
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_MERGE_FROM)
+#undef KD_TREE_MERGE_FROM
+	return unique_ptr<BasicPointKDTree<uint_t> >();
+}
 
-#define KD_TREE_IDX_SIZE_IS_ENOUGH(bits) \
-	numPoints < numeric_limits<uint##bits##_t>::max()
-#define KD_TREE_INIT_IMPL(bits, arrPoints) \
+#define KD_TREE_MERGE_IMPL(bits) \
 	if (KD_TREE_IDX_SIZE_IS_ENOUGH(bits)) { \
-		const_cast<unique_ptr<PointKDTreeImplImpl<uint##bits##_t> >&> \
-			(m_pImpl##bits).reset( \
-				new PointKDTreeImplImpl<uint##bits##_t>(arrPoints)); \
-		m_idxType = IDX_TYPE_##bits; \
-		return; \
+		const_cast<unique_ptr<BasicPointKDTree<uint##bits##_t> >&> \
+			(pImpl->m_pImpl##bits) = mergeTrees<uint##bits##_t>(a, b); \
+		pImpl->m_idxType = IDX_TYPE_##bits; \
+		return pImpl.release(); \
 	}
 
-PointKDTreeImpl::PointKDTreeImpl(const vector<V3x>& arrPoints)
-	: m_idxType(IDX_TYPE_INVALID)
-{
-	size_t numPoints = arrPoints.size();
-	KD_TREE_FOREACH_IDX_SIZE_ARG1(KD_TREE_INIT_IMPL, arrPoints)
-}
-
-PointKDTreeImpl::PointKDTreeImpl(vector<V3x>&& arrPoints)
-	: m_idxType(IDX_TYPE_INVALID)
+PointKDTreeImpl*
+PointKDTreeImpl::merge(const PointKDTreeImpl& a, const PointKDTreeImpl& b)
 {
-	size_t numPoints = arrPoints.size();
-	KD_TREE_FOREACH_IDX_SIZE_ARG1(KD_TREE_INIT_IMPL, move(arrPoints))
+	// The merged tree may need a wider index than either input
+	size_t numPoints = a.getNumLivePoints() + b.getNumLivePoints();
+	unique_ptr<PointKDTreeImpl> pImpl(new PointKDTreeImpl());
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_MERGE_IMPL)
+	return NULL;
 }
 
-
 #define KD_TREE_IMPL_CALL_HELPER(bits, prefix, call) \
 	case IDX_TYPE_##bits: prefix m_pImpl##bits->call; break; \
 
@@ -300,405 +264,1055 @@ PointKDTreeImpl::isBalanced() const
 	KD_TREE_IMPL_CALL_RETURN(isBalanced());
 }
 
+size_t
+PointKDTreeImpl::eraseInBox(const Box<V3x>& box)
+{
+	if (box.isEmpty())
+		return 0;
+
+	size_t numErased = 0;
+	#define ERASE_IN_BOX_WITH_ARGS eraseInBox(box.min, box.max)
+	KD_TREE_IMPL_CALL_IMPL(numErased =, ERASE_IN_BOX_WITH_ARGS)
+	#undef ERASE_IN_BOX_WITH_ARGS
+
+	// Compaction renumbers the tree's nodes, so the scan is taken again
+	if (m_pScan && numErased != 0)
+		initScan();
+	return numErased;
+}
+
+size_t
+PointKDTreeImpl::getNumLivePoints() const
+{
+	KD_TREE_IMPL_CALL_RETURN(getNumLivePoints())
+}
+
+void
+PointKDTreeImpl::setCompactionThreshold(double fraction)
+{
+	KD_TREE_IMPL_CALL(setCompactionThreshold(fraction))
+}
+
+bool
+PointKDTreeImpl::compact()
+{
+	bool isCompacted = false;
+	KD_TREE_IMPL_CALL_IMPL(isCompacted =, compact())
+	if (m_pScan && isCompacted)
+		initScan();
+	return isCompacted;
+}
+
+bool
+PointKDTreeImpl::refit()
+{
+	KD_TREE_IMPL_CALL_RETURN(refit())
+}
+
+void
+PointKDTreeImpl::setRefitThreshold(double overlap)
+{
+	KD_TREE_IMPL_CALL(setRefitThreshold(overlap))
+}
+
+double
+PointKDTreeImpl::getRefitOverlap() const
+{
+	KD_TREE_IMPL_CALL_RETURN(getRefitOverlap())
+}
+
 bool
 PointKDTreeImpl::getClosestPointTo(
 	const V3x& point,
 	KDTreeClosestPoint& result) const
 {
+	if (m_pScan)
+		return m_pScan->getClosestPointTo(point, result);
+
 	#define CLOSEST_POINT_WITH_ARGS getClosestPointTo(point, result)
 	KD_TREE_IMPL_CALL_RETURN(CLOSEST_POINT_WITH_ARGS)
 	#undef CLOSEST_POINT_WITH_ARGS
 }
 
+bool
+PointKDTreeImpl::getClosestPointTo(
+	const V3x& point,
+	const KDTreeClosestPoint& hint,
+	KDTreeClosestPoint& result) const
+{
+	// A node of the tree only bounds the tree's own search, the scan looks
+	// at every point anyway
+	if (m_pScan) {
+		return m_pScan->getClosestPointTo(point,
+			hint.idxNode == KDTreeClosestPoint::IDX_NONE ?
+				hint.distance2 : numeric_limits<fpreal>::max(),
+			result);
+	}
+
+	#define CLOSEST_POINT_WITH_HINT getClosestPointTo(point, hint, result)
+	KD_TREE_IMPL_CALL_RETURN(CLOSEST_POINT_WITH_HINT)
+	#undef CLOSEST_POINT_WITH_HINT
+}
+
+bool
+PointKDTreeImpl::getClosestPointsTo(
+	const vector<V3x>& arrQueries,
+	vector<KDTreeClosestPoint>& results) const
+{
+	results.assign(arrQueries.size(), KDTreeClosestPoint());
+	if (arrQueries.empty())
+		return true;
+	if (m_pScan) {
+		return m_pScan->getClosestPointsTo(&arrQueries[0], arrQueries.size(),
+			&results[0]);
+	}
+
+	#define CLOSEST_POINTS_WITH_ARGS \
+		getClosestPointsTo(&arrQueries[0], arrQueries.size(), &results[0])
+	KD_TREE_IMPL_CALL_RETURN(CLOSEST_POINTS_WITH_ARGS)
+	#undef CLOSEST_POINTS_WITH_ARGS
+}
+
 void
 PointKDTreeImpl::dump(ostream& out) const
 {
 	KD_TREE_IMPL_CALL(dump(out))
 }
 
+bool
+PointKDTreeImpl::save(const string& path) const
+{
+	KD_TREE_IMPL_CALL_RETURN(save(path))
+}
+
+size_t
+PointKDTreeImpl::getImageSize() const
+{
+	KD_TREE_IMPL_CALL_RETURN(getImageSize())
+}
+
+void
+PointKDTreeImpl::writeImage(char* pImage) const
+{
+	KD_TREE_IMPL_CALL(writeImage(pImage))
+}
+
 ////////////////////////////////////////////////////////////////////////////////
-// PointKDTreeImplImpl Methods
+// PointKDTree Methods
 ////////////////////////////////////////////////////////////////////////////////
 
-template <typename uint_t>
-PointKDTreeImplImpl<uint_t>::PointKDTreeImplImpl(
-	const vector<V3x>& arrPoints)
-	: m_arrPoints(arrPoints)
+PointKDTree::PointKDTree(const vector<V3x>& arrPoints)
+	: m_pImpl(new PointKDTreeImpl(arrPoints))
 {
-	init();
 }
 
-template <typename uint_t>
-PointKDTreeImplImpl<uint_t>::PointKDTreeImplImpl(
-	vector<V3x>&& arrPoints)
-	: m_arrPoints(move(arrPoints))
+
+PointKDTree::PointKDTree(vector<V3x>&& arrPoints)
+	: m_pImpl(new PointKDTreeImpl(move(arrPoints)))
 {
-	init();
 }
 
-template <typename uint_t>
-void
-PointKDTreeImplImpl<uint_t>::init()
+
+PointKDTree::PointKDTree(
+	const fpreal* pCoords,
+	size_t byteStride,
+	size_t numPoints)
+	: m_pImpl(new PointKDTreeImpl(pCoords, byteStride, numPoints))
 {
-	uint_t numPoints = static_cast<uint_t>(m_arrPoints.size());
-	m_arrNodes.reserve(m_arrPoints.size());
-	buildTree(0, numPoints);
 }
 
-template <typename uint_t>
-uint_t
-PointKDTreeImplImpl<uint_t>::partitionAroundMedian(
-	uint_t idxBegin,
-	uint_t idxEnd,
-	KDTreeAxis axis)
-{
-	uint_t halfSize = (idxEnd - idxBegin) / 2;
-	uint_t idxMedian = idxBegin + halfSize;
-
-	auto itGlobalBegin = begin(m_arrPoints);
-	auto itBegin = itGlobalBegin + static_cast<size_t>(idxBegin);
-	auto itMedian = itGlobalBegin + static_cast<size_t>(idxMedian);
-	auto itEnd = itGlobalBegin + static_cast<size_t>(idxEnd);
-	nth_element(itBegin, itMedian, itEnd, 
-		[=](const V3x& lhs, const V3x& rhs) -> bool {
-		return lhs[axis] < rhs[axis];
-	});
 
-	return idxMedian;
+PointKDTree::PointKDTree(PointKDTreeImpl* pImpl)
+	: m_pImpl(pImpl)
+{
 }
 
-template <typename uint_t>
-KDTreeAxis
-PointKDTreeImplImpl<uint_t>::chooseSplitAxis(
-	uint_t idxBegin,
-	uint_t idxEnd) const
-{
-	assert(idxBegin < idxEnd);
-
-	if (idxBegin+1 == idxEnd)
-		return X_AXIS;
-
-	V3x firstPoint = m_arrPoints[static_cast<size_t>(idxBegin)];
-	fpreal xMin = firstPoint.x;
-	fpreal yMin = firstPoint.y;
-	fpreal zMin = firstPoint.z;
-	fpreal xMax = firstPoint.x;
-	fpreal yMax = firstPoint.y;
-	fpreal zMax = firstPoint.z;
-
-	auto itGlobalBegin = begin(m_arrPoints);
-	auto itBegin = itGlobalBegin + static_cast<size_t>(idxBegin) + 1;
-	auto itEnd = itGlobalBegin + static_cast<size_t>(idxEnd);
-	for_each(itBegin, itEnd, [&](const V3x& point) {
-		xMin = min<fpreal>(point.x, xMin);
-		yMin = min<fpreal>(point.y, yMin);
-		zMin = min<fpreal>(point.z, zMin);
-		xMax = max<fpreal>(point.x, xMax);
-		yMax = max<fpreal>(point.y, yMax);
-		zMax = max<fpreal>(point.z, zMax);
-	});
 
-	fpreal xSize = xMax - xMin;
-	fpreal ySize = yMax - yMin;
-	fpreal zSize = zMax - zMin;
+PointKDTree::~PointKDTree()
+{
+	// NOTE: To allow ~unique_ptr() to see the complete PointKDTreeImpl type 
+	//       we have to create an explicit destructor for PointKDTree here,
+	//       after PointKDTreeImpl been defined.
+}
 
-	return (ySize > xSize && ySize > zSize) ? Y_AXIS :
-		(zSize > xSize && zSize > ySize) ? Z_AXIS :
-			X_AXIS;
+void
+PointKDTree::dump(ostream& out) const
+{
+	m_pImpl->dump(out);
 }
 
-template <typename uint_t>
-uint_t 
-PointKDTreeImplImpl<uint_t>::buildTree(
-	uint_t idxPtBegin,
-	uint_t idxPtEnd)
-{
-	if (idxPtBegin >= idxPtEnd)
-		return IDX_NONE;
-
-	KDTreeAxis axis = chooseSplitAxis(idxPtBegin, idxPtEnd);
-
-	// Build Leaf Node
-	uint_t size = idxPtEnd - idxPtBegin;
-	if (size == 1) {
-		m_arrNodes.emplace_back(
-			KDTreeNode<uint_t>(idxPtBegin, IDX_NONE, IDX_NONE, axis));
-		return getIdxRootNode();
+bool
+PointKDTree::save(const string& path) const
+{
+	return m_pImpl->save(path);
+}
+
+unique_ptr<PointKDTree>
+PointKDTree::open(const string& path, int flags)
+{
+	shared_ptr<MappedFile> pFile(new MappedFile());
+	if (!pFile->open(path))
+		return unique_ptr<PointKDTree>();
+	return open(pFile, flags);
+}
+
+#define KD_TREE_BUILD_FILE(bits) \
+	if (KD_TREE_IDX_SIZE_IS_ENOUGH(bits)) { \
+		BasicKDTreeFileBuilder<uint##bits##_t> builder(memoryBudget); \
+		return builder.build(inputPath, outputPath); \
 	}
 
-	// Recurse
-	uint_t idxPtMedian = partitionAroundMedian(idxPtBegin, idxPtEnd, axis);
-	uint_t idxNodeLeft = buildTree(idxPtBegin, idxPtMedian);
-	uint_t idxNodeRight = buildTree(idxPtMedian+1, idxPtEnd);
+bool
+PointKDTree::buildFile(
+	const string& inputPath,
+	const string& outputPath,
+	size_t memoryBudget)
+{
+	uint64_t numPoints;
+	if (!BasicKDTreeFileBuilder<uint64_t>::getNumPoints(inputPath, numPoints))
+		return false;
 
-	// Build Internal Node
-	m_arrNodes.emplace_back(
-		KDTreeNode<uint_t>(idxPtMedian, idxNodeLeft, idxNodeRight, axis));
-	return getIdxRootNode();
+	KD_TREE_FOREACH_IDX_SIZE(KD_TREE_BUILD_FILE)
+	return false;
 }
 
-template <typename uint_t>
-void
-PointKDTreeImplImpl<uint_t>::dump(ostream& out) const
-{
-	out << "== KD TREE IMPLEMENTATION ====\n";
-	out << "POINT COUNT: " << m_arrPoints.size() << "\n";
-	out << "NODE COUNT: " << m_arrNodes.size() << "\n\n";
-
-	out << "-- NODES ----\n";
-	auto itBegin = begin(m_arrNodes);
-	auto itEnd = end(m_arrNodes);
-	int idxNode = 0;
-	for_each(itBegin, itEnd, [&](const KDTreeNode<uint_t>& node) {
-		out << idxNode << ": ";
-		node.dump(m_arrPoints, out);
-		++idxNode;
-	});
+unique_ptr<PointKDTree>
+PointKDTree::merge(const PointKDTree& a, const PointKDTree& b)
+{
+	return unique_ptr<PointKDTree>(
+		new PointKDTree(PointKDTreeImpl::merge(*a.m_pImpl, *b.m_pImpl)));
+}
 
-	out.flush();
+unique_ptr<PointKDTree>
+PointKDTree::open(const shared_ptr<MappedFile>& pFile, int flags)
+{
+	PointKDTreeImpl* pImpl = PointKDTreeImpl::open(pFile, flags);
+	if (pImpl == NULL)
+		return unique_ptr<PointKDTree>();
+	return unique_ptr<PointKDTree>(new PointKDTree(pImpl));
 }
 
-template <typename uint_t>
+#define KD_TREE_GET_TREE(bits) \
+	const BasicPointKDTree<uint##bits##_t>* \
+	PointKDTree::getTree##bits() const \
+	{ \
+		return m_pImpl->getTree##bits(); \
+	}
+
+KD_TREE_FOREACH_IDX_SIZE(KD_TREE_GET_TREE)
+
 bool
-PointKDTreeImplImpl<uint_t>::isBalanced() const
+PointKDTree::isBalanced() const
 {
-	if (m_arrNodes.size() <= 2)
-		return true;
+	return m_pImpl->isBalanced();
+}
 
-	const KDTreeNode<uint_t>* pRoot = getRootNode();
-	assert(pRoot != NULL);
-	return pRoot->isBalanced(m_arrNodes);
+size_t
+PointKDTree::eraseInBox(const Box<V3x>& box)
+{
+	return m_pImpl->eraseInBox(box);
 }
 
-template <typename uint_t>
-const KDTreeNode<uint_t>*
-PointKDTreeImplImpl<uint_t>::getRootNode() const
+size_t
+PointKDTree::getNumLivePoints() const
 {
-	if (m_arrNodes.empty())
-		return NULL;
-	return &m_arrNodes.back();
+	return m_pImpl->getNumLivePoints();
 }
 
-template <typename uint_t>
-uint_t
-PointKDTreeImplImpl<uint_t>::getIdxRootNode() const
+void
+PointKDTree::setCompactionThreshold(double fraction)
 {
-	assert(!m_arrNodes.empty());
-	return static_cast<uint_t>(m_arrNodes.size()-1);
+	m_pImpl->setCompactionThreshold(fraction);
+}
+
+bool
+PointKDTree::compact()
+{
+	return m_pImpl->compact();
+}
+
+bool
+PointKDTree::refit()
+{
+	return m_pImpl->refit();
 }
 
-template <typename uint_t>
 void
-PointKDTreeImplImpl<uint_t>::initClosestPointStack(
-	vector<uint_t>& nodeIdxStack) const
+PointKDTree::setRefitThreshold(double overlap)
 {
-	size_t numPoints = m_arrPoints.size();
-	size_t log2NumPoints = static_cast<size_t>(
-		log(static_cast<double>(numPoints)) / log(2.0));
-	nodeIdxStack.reserve(log2NumPoints);
-	nodeIdxStack.push_back(getIdxRootNode());
+	m_pImpl->setRefitThreshold(overlap);
 }
 
-template <typename uint_t>
-static inline bool
-isLeafNode(const KDTreeNode<uint_t>& node)
+double
+PointKDTree::getRefitOverlap() const
 {
-	return node.getIdxLeft() == InvalidIndex<uint_t>::value
-		&& node.getIdxRight() == InvalidIndex<uint_t>::value;
+	return m_pImpl->getRefitOverlap();
 }
 
-template <typename uint_t>
-uint_t
-PointKDTreeImplImpl<uint_t>::getIdxNextNode(
-	const KDTreeNode<uint_t>& node,
-	const V3x& point) const
+bool
+PointKDTree::getClosestPointTo(
+	const V3x& point,
+	KDTreeClosestPoint& result) const
 {
-	assert(!isLeafNode(node));
-	uint_t idxLeft = node.getIdxLeft();
-	uint_t idxRight = node.getIdxRight();
+	return m_pImpl->getClosestPointTo(point, result);
+}
 
-	if (idxLeft == InvalidIndex<uint_t>::value)
-		return idxRight;
-	if (idxRight == InvalidIndex<uint_t>::value)
-		return idxLeft;
+bool
+PointKDTree::getClosestPointTo(
+	const V3x& point,
+	const KDTreeClosestPoint& hint,
+	KDTreeClosestPoint& result) const
+{
+	return m_pImpl->getClosestPointTo(point, hint, result);
+}
 
-	KDTreeAxis axis = node.getAxis();
-	size_t idxNodePoint = static_cast<size_t>(node.getIdxPoint());
-	const V3x& nodePoint = m_arrPoints[idxNodePoint];
-	return (point[axis] <= nodePoint[axis]) ? idxLeft : idxRight;
+bool
+PointKDTree::getClosestPointsTo(
+	const vector<V3x>& arrPoints,
+	vector<KDTreeClosestPoint>& out_results) const
+{
+	return m_pImpl->getClosestPointsTo(arrPoints, out_results);
 }
 
-template <typename uint_t>
-const KDTreeNode<uint_t>&
-PointKDTreeImplImpl<uint_t>::getCurrentNode(
-	vector<uint_t>& nodeIdxStack) const
+////////////////////////////////////////////////////////////////////////////////
+// ProgressivePointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+ProgressivePointKDTree::ProgressivePointKDTree(vector<V3x>&& arrPoints)
+	: m_arrPoints(move(arrPoints))
+	, m_pBuiltTree(NULL)
+{
+	if (m_arrPoints.empty())
+		return;
+
+	m_builder = thread([this]() {
+		m_pTree.reset(new PointKDTree(&m_arrPoints[0].x, sizeof(V3x),
+			m_arrPoints.size()));
+		m_pBuiltTree.store(m_pTree.get(), memory_order_release);
+	});
+}
+
+ProgressivePointKDTree::~ProgressivePointKDTree()
 {
-	assert(!nodeIdxStack.empty());
-	size_t idx = static_cast<size_t>(nodeIdxStack.back());
-	return m_arrNodes[idx];
+	waitUntilBuilt();
 }
 
-template <typename uint_t>
 void
-PointKDTreeImplImpl<uint_t>::walkToLeafNode(
-	vector<uint_t>& nodeIdxStack,
-	const V3x& point) const
+ProgressivePointKDTree::waitUntilBuilt()
 {
-	while (!isLeafNode(getCurrentNode(nodeIdxStack))) {
-		const KDTreeNode<uint_t>& node = getCurrentNode(nodeIdxStack);
-		nodeIdxStack.push_back(getIdxNextNode(node, point));
-	}
+	if (m_builder.joinable())
+		m_builder.join();
 }
 
-template <typename uint_t>
 bool
-PointKDTreeImplImpl<uint_t>::updateClosestPoint(
-	vector<uint_t>& nodeIdxStack,
+ProgressivePointKDTree::getClosestPointTo(
 	const V3x& point,
 	KDTreeClosestPoint& result) const
 {
-	const KDTreeNode<uint_t>& node = getCurrentNode(nodeIdxStack);
-	size_t idxPoint = static_cast<size_t>(node.getIdxPoint());
-	const V3x& nodePoint = m_arrPoints[idxPoint];
+	if (const PointKDTree* pTree = getTree())
+		return pTree->getClosestPointTo(point, result);
+
+	return m_arrPoints.empty() ? false : getClosestPointByScan<3>(
+		reinterpret_cast<const char*>(&m_arrPoints[0]), sizeof(V3x),
+		m_arrPoints.size(), point, result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// VersionedPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+/// Published Tree of a VersionedPointKDTree
+struct KDTreeVersion
+{
+	unique_ptr<PointKDTree> pTree;
+	uint64_t number;
+};
 
-	V3x diff(point);
-	diff -= nodePoint;
-	fpreal distance2 = diff.length2();
+VersionedPointKDTree::Snapshot::Snapshot(
+	const VersionedPointKDTree& versioned)
+	: m_versioned(versioned)
+	, m_slot(versioned.m_epochs.enter())
+	, m_pVersion(versioned.m_pVersion.load())
+{
+}
 
-	if (distance2 >= result.distance2)
-		return false;
+VersionedPointKDTree::Snapshot::~Snapshot()
+{
+	m_versioned.m_epochs.leave(m_slot);
+}
 
-	result.point = nodePoint;
-	result.distance2 = distance2;
-	return true;
+const PointKDTree*
+VersionedPointKDTree::Snapshot::getTree() const
+{
+	return m_pVersion != NULL ? m_pVersion->pTree.get() : NULL;
 }
 
-template <typename uint_t>
-fpreal
-PointKDTreeImplImpl<uint_t>::getDistanceToPlane2(
-	const KDTreeNode<uint_t>& node, const V3x& point) const
+uint64_t
+VersionedPointKDTree::Snapshot::getVersion() const
 {
-	auto axis = node.getAxis();
-	size_t idxNodePoint = static_cast<size_t>(node.getIdxPoint());
-	const V3x& nodePoint = m_arrPoints[idxNodePoint];
-	fpreal sqrtResult = point[axis] - nodePoint[axis];
-	return sqrtResult * sqrtResult;
+	return m_pVersion != NULL ? m_pVersion->number : 0;
 }
 
-template <typename uint_t>
-static inline void 
-pop(uint_t& idxLastNode, vector<uint_t>& nodeIdxStack)
+VersionedPointKDTree::VersionedPointKDTree()
+	: m_pVersion(NULL)
 {
-	assert(!nodeIdxStack.empty());
-	idxLastNode = nodeIdxStack.back();
-	nodeIdxStack.pop_back();
 }
 
-template <typename uint_t>
-static uint_t
-getIdxOppositeSide(uint_t idxLastNode, const KDTreeNode<uint_t>& node)
+VersionedPointKDTree::~VersionedPointKDTree()
 {
-	assert(idxLastNode != IDX_NONE);
-	uint_t idxLeft = node.getIdxLeft();
-	uint_t idxRight = node.getIdxRight();
-	assert(idxLastNode == idxLeft || idxLastNode == idxRight);
-	return (idxLastNode == idxLeft) ? idxRight : idxLeft;
+	for_each(begin(m_arrRetired), end(m_arrRetired), 
+		[](const pair<const KDTreeVersion*, unsigned>& retired) {
+			delete retired.first;
+		});
+	delete m_pVersion.load();
 }
 
-template <typename uint_t>
-uint_t
-PointKDTreeImplImpl<uint_t>::getIdxPointSide(
-	const KDTreeNode<uint_t>& node,
-	const V3x& point) const
+uint64_t
+VersionedPointKDTree::publish(unique_ptr<PointKDTree> pTree)
 {
-	size_t idxNodePoint = static_cast<size_t>(node.getIdxPoint());
-	const V3x& nodePoint = m_arrPoints[idxNodePoint];
-	KDTreeAxis axis = node.getAxis();
-	return (point[axis] < nodePoint[axis]) ? node.getIdxLeft() : node.getIdxRight();
+	KDTreeVersion* pVersion = new KDTreeVersion();
+	pVersion->pTree = move(pTree);
+	uint64_t number = 1;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		const KDTreeVersion* pOldVersion = m_pVersion;
+		if (pOldVersion != NULL)
+			number = pOldVersion->number + 1;
+		pVersion->number = number;
+
+		// Tagged with the epoch of the swap, snapshots taken later see the 
+		// new version
+		m_pVersion = pVersion;
+		if (pOldVersion != NULL) {
+			m_arrRetired.push_back(
+				make_pair(pOldVersion, m_epochs.getEpoch()));
+		}
+	}
+	reclaim();
+	return number;
+}
+
+void
+VersionedPointKDTree::reclaim()
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	// Versions retired two epochs back are no longer held by any snapshot
+	if (m_epochs.tryAdvance())
+		m_epochs.tryAdvance();
+	unsigned epoch = m_epochs.getEpoch();
+	auto itReclaimable = partition(begin(m_arrRetired), end(m_arrRetired),
+		[epoch](const pair<const KDTreeVersion*, unsigned>& retired) {
+			return epoch - retired.second < 2;
+		});
+	for_each(itReclaimable, end(m_arrRetired), 
+		[](const pair<const KDTreeVersion*, unsigned>& retired) {
+			delete retired.first;
+		});
+	m_arrRetired.erase(itReclaimable, end(m_arrRetired));
+}
+
+uint64_t
+VersionedPointKDTree::getVersion() const
+{
+	Snapshot snapshot(*this);
+	return snapshot.getVersion();
 }
 
-template <typename uint_t>
 bool
-PointKDTreeImplImpl<uint_t>::getClosestPointTo(
+VersionedPointKDTree::getClosestPointTo(
 	const V3x& point,
 	KDTreeClosestPoint& result) const
 {
-	if (m_arrNodes.empty())
-		return false;
+	Snapshot snapshot(*this);
+	const PointKDTree* pTree = snapshot.getTree();
+	return pTree != NULL && pTree->getClosestPointTo(point, result);
+}
 
-	vector<uint_t> nodeIdxStack;
-	initClosestPointStack(nodeIdxStack);
-	walkToLeafNode(nodeIdxStack, point);
-	updateClosestPoint(nodeIdxStack, point, result);
-
-	uint_t idxLastNode = IDX_NONE;
-	pop(idxLastNode, nodeIdxStack);
-	while (!nodeIdxStack.empty()) {
-		updateClosestPoint(nodeIdxStack, point, result);
-		const KDTreeNode<uint_t>& node = getCurrentNode(nodeIdxStack);
-		if (getDistanceToPlane2(node, point) >= result.distance2) {
-			pop(idxLastNode, nodeIdxStack);
-			continue;
-		}
+////////////////////////////////////////////////////////////////////////////////
+// Queries over Several Trees
+////////////////////////////////////////////////////////////////////////////////
 
-		uint_t idxOppositeSide = getIdxOppositeSide(idxLastNode, node);
-		if (idxOppositeSide == getIdxPointSide(node, point)) {
-			pop(idxLastNode, nodeIdxStack);
-			continue;
-		}
+/// Tree Searched by getClosestPointInTrees() and a Lower Bound of its
+/// Distance to the Query
+typedef pair<fpreal, const PointKDTree*> KDTreeBoundedTree;
 
-		if (idxOppositeSide != IDX_NONE) {
-			walkToLeafNode(nodeIdxStack, point);
-			continue;
-		}
+static fpreal
+getDistanceToBox2(const V3x& point, const Box<V3x>& box)
+{
+	V3x offset(0);
+	for (int axis = 0; axis < 3; ++axis) {
+		if (point[axis] < box.min[axis])
+			offset[axis] = box.min[axis] - point[axis];
+		else if (point[axis] > box.max[axis])
+			offset[axis] = point[axis] - box.max[axis];
+	}
+	return offset.length2();
+}
+
+// Searches the nearest trees first, each bounded by the closest point found
+// so far, and stops at the first tree that cannot hold a closer one
+static bool
+getClosestPointInTrees(
+	const V3x& point,
+	vector<KDTreeBoundedTree>& arrTrees,
+	KDTreeClosestPoint& result)
+{
+	sort(begin(arrTrees), end(arrTrees));
+
+	result = KDTreeClosestPoint();
+	for (size_t idx = 0; idx < arrTrees.size(); ++idx) {
+		if (arrTrees[idx].first >= result.distance2)
+			break;
+
+		KDTreeClosestPoint treeResult;
+		if (arrTrees[idx].second->getClosestPointTo(point, result, treeResult))
+			result = treeResult;
+		result.idxNode = KDTreeClosestPoint::IDX_NONE;
+	}
+	return result.distance2 != numeric_limits<fpreal>::max();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// WindowedPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+/// Time Interval of a WindowedPointKDTree
+struct KDTreeTimeBin
+{
+	KDTreeTimeBin() : numPoints(0), isMerged(false) {}
+	~KDTreeTimeBin() { waitUntilMerged(); }
+
+	void waitUntilMerged()
+	{
+		if (merger.joinable())
+			merger.join();
+	}
+
+	int64_t idxInterval;
+	size_t numPoints;
+	Box<V3x> bounds;
+
+	// One tree per frame until the merger thread has combined them into
+	// pMerged, which then replaces them
+	vector<unique_ptr<PointKDTree> > arrTrees;
+	unique_ptr<PointKDTree> pMerged; // written by the merger thread only
+	atomic<bool> isMerged;
+	thread merger;
+};
 
-		pop(idxLastNode, nodeIdxStack);
+// Merges neighbouring trees pairwise, an odd one out joins the last pair
+static void
+mergeTreePairs(
+	const vector<unique_ptr<PointKDTree> >& arrTrees,
+	vector<unique_ptr<PointKDTree> >& out_arrMerged)
+{
+	assert(arrTrees.size() > 1);
+	out_arrMerged.clear();
+	for (size_t idx = 0; idx + 1 < arrTrees.size(); idx += 2) {
+		unique_ptr<PointKDTree> pMerged = 
+			PointKDTree::merge(*arrTrees[idx], *arrTrees[idx + 1]);
+		if (idx + 3 == arrTrees.size())
+			pMerged = PointKDTree::merge(*pMerged, *arrTrees[idx + 2]);
+		out_arrMerged.push_back(move(pMerged));
 	}
+}
+
+WindowedPointKDTree::WindowedPointKDTree(double window, double binDuration)
+	: m_window(window)
+	, m_binDuration(binDuration)
+	, m_time(-numeric_limits<double>::max())
+{
+	assert(binDuration > 0);
+}
+
+WindowedPointKDTree::~WindowedPointKDTree()
+{
+}
+
+int64_t
+WindowedPointKDTree::getInterval(double time) const
+{
+	return static_cast<int64_t>(floor(time / m_binDuration));
+}
+
+bool
+WindowedPointKDTree::addFrame(double time, const vector<V3x>& arrPoints)
+{
+	if (time < m_time)
+		return false;
 
+	advanceTo(time);
+	if (arrPoints.empty())
+		return true;
+
+	int64_t idxInterval = getInterval(time);
+	if (m_bins.empty() || m_bins.back()->idxInterval != idxInterval) {
+		closeNewestBin();
+		m_bins.push_back(unique_ptr<KDTreeTimeBin>(new KDTreeTimeBin()));
+		m_bins.back()->idxInterval = idxInterval;
+	}
+
+	KDTreeTimeBin& bin = *m_bins.back();
+	bin.arrTrees.push_back(unique_ptr<PointKDTree>(new PointKDTree(arrPoints)));
+	bin.numPoints += arrPoints.size();
+	for_each(begin(arrPoints), end(arrPoints), 
+		[&](const V3x& point) { bin.bounds.extendBy(point); });
 	return true;
 }
 
+void
+WindowedPointKDTree::closeNewestBin()
+{
+	if (m_bins.empty())
+		return;
+
+	// The frame trees are merged level by level on a thread of the bin's
+	// own, queries keep reading them meanwhile. Frames that barely overlap
+	// are grafted, see PointKDTree::merge().
+	KDTreeTimeBin& bin = *m_bins.back();
+	if (bin.arrTrees.size() < 2)
+		return;
+	bin.merger = thread([&bin]() {
+		vector<unique_ptr<PointKDTree> > arrLevel, arrNextLevel;
+		mergeTreePairs(bin.arrTrees, arrLevel);
+		while (arrLevel.size() > 1) {
+			mergeTreePairs(arrLevel, arrNextLevel);
+			arrLevel.swap(arrNextLevel);
+		}
+		bin.pMerged = move(arrLevel.front());
+		bin.isMerged.store(true, memory_order_release);
+	});
+}
+
+void
+WindowedPointKDTree::adoptMergedBins()
+{
+	for_each(begin(m_bins), end(m_bins), 
+		[](const unique_ptr<KDTreeTimeBin>& pBin) {
+			if (!pBin->isMerged.load(memory_order_acquire) || !pBin->pMerged)
+				return;
+			pBin->waitUntilMerged();
+			pBin->arrTrees.clear();
+			pBin->arrTrees.push_back(move(pBin->pMerged));
+		});
+}
+
+void
+WindowedPointKDTree::waitUntilMerged()
+{
+	for_each(begin(m_bins), end(m_bins), 
+		[](const unique_ptr<KDTreeTimeBin>& pBin) {
+			pBin->waitUntilMerged();
+		});
+	adoptMergedBins();
+}
+
+size_t
+WindowedPointKDTree::getNumTrees() const
+{
+	size_t numTrees = 0;
+	for_each(begin(m_bins), end(m_bins), 
+		[&](const unique_ptr<KDTreeTimeBin>& pBin) {
+			numTrees += pBin->arrTrees.size();
+		});
+	return numTrees;
+}
+
+void
+WindowedPointKDTree::advanceTo(double time)
+{
+	m_time = max(m_time, time);
+
+	// A bin is kept while any part of its interval is inside the window,
+	// dropping one still merging waits for its merger
+	int64_t idxOldestInterval = getInterval(m_time - m_window);
+	while (!m_bins.empty() && m_bins.front()->idxInterval < idxOldestInterval)
+		m_bins.pop_front();
+	adoptMergedBins();
+}
+
+size_t
+WindowedPointKDTree::getNumPoints() const
+{
+	size_t numPoints = 0;
+	for_each(begin(m_bins), end(m_bins), 
+		[&](const unique_ptr<KDTreeTimeBin>& pBin) {
+			numPoints += pBin->numPoints;
+		});
+	return numPoints;
+}
+
+bool
+WindowedPointKDTree::getClosestPointTo(
+	const V3x& point,
+	KDTreeClosestPoint& result) const
+{
+	// Every tree of a bin shares the bin's bounds as its lower bound
+	vector<KDTreeBoundedTree> arrTrees;
+	for_each(begin(m_bins), end(m_bins), 
+		[&](const unique_ptr<KDTreeTimeBin>& pBin) {
+			fpreal distance2 = getDistanceToBox2(point, pBin->bounds);
+			for_each(begin(pBin->arrTrees), end(pBin->arrTrees), 
+				[&](const unique_ptr<PointKDTree>& pTree) {
+					arrTrees.push_back(make_pair(distance2, pTree.get()));
+				});
+		});
+	return getClosestPointInTrees(point, arrTrees, result);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
-// PointKDTree Methods
+// NUMA Placement
 ////////////////////////////////////////////////////////////////////////////////
 
-PointKDTree::PointKDTree(const vector<V3x>& arrPoints)
-	: m_pImpl(new PointKDTreeImpl(arrPoints))
+// Processors of every NUMA node with their processor group, so nodes past
+// the calling thread's group of 64 are told apart too. Nodes without
+// processors, e.g. memory-only ones, get an empty mask. The list is empty
+// without NUMA information.
+static void
+getNumaNodeAffinities(vector<GROUP_AFFINITY>& out_arrAffinities)
 {
+	out_arrAffinities.clear();
+	ULONG highestNode = 0;
+	if (!GetNumaHighestNodeNumber(&highestNode))
+		return;
+	for (ULONG node = 0; node <= highestNode; ++node) {
+		GROUP_AFFINITY affinity = {};
+		if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity))
+			affinity.Mask = 0;
+		out_arrAffinities.push_back(affinity);
+	}
 }
 
+// NUMA node of the processor the calling thread currently runs on, in
+// whichever processor group
+static bool
+getCurrentNumaNode(USHORT& out_node)
+{
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+	return GetNumaProcessorNodeEx(&processor, &out_node) != 0;
+}
 
-PointKDTree::PointKDTree(vector<V3x>&& arrPoints)
-	: m_pImpl(new PointKDTreeImpl(move(arrPoints)))
+////////////////////////////////////////////////////////////////////////////////
+// ShardedPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+typedef vector<size_t>::iterator KDTreeShardIt;
+
+// Splits the points indexed by [itBegin, itEnd) at the median of their
+// widest axis, recursively and in proportion to the shards each side
+// receives
+static void
+partitionShards(
+	const vector<V3x>& arrPoints,
+	KDTreeShardIt itBegin,
+	KDTreeShardIt itEnd,
+	size_t numShards,
+	vector<pair<KDTreeShardIt, KDTreeShardIt> >& out_ranges)
 {
+	if (numShards == 1 || itBegin == itEnd) {
+		out_ranges.push_back(make_pair(itBegin, itEnd));
+		out_ranges.resize(out_ranges.size() + numShards - 1, 
+			make_pair(itEnd, itEnd));
+		return;
+	}
+
+	Box<V3x> bounds;
+	for_each(itBegin, itEnd, 
+		[&](size_t idxPoint) { bounds.extendBy(arrPoints[idxPoint]); });
+	int axis = static_cast<int>(bounds.majorAxis());
+
+	size_t numLeft = numShards / 2;
+	KDTreeShardIt itSplit = itBegin 
+		+ static_cast<ptrdiff_t>((itEnd - itBegin) * numLeft / numShards);
+	nth_element(itBegin, itSplit, itEnd, [&](size_t lhs, size_t rhs) { 
+		return arrPoints[lhs][axis] < arrPoints[rhs][axis]; 
+	});
+	partitionShards(arrPoints, itBegin, itSplit, numLeft, out_ranges);
+	partitionShards(arrPoints, itSplit, itEnd, numShards - numLeft, 
+		out_ranges);
 }
 
+ShardedPointKDTree::ShardedPointKDTree(
+	const vector<V3x>& arrPoints,
+	size_t numShards)
+	: m_shards(max<size_t>(1, numShards))
+	, m_shardBounds(m_shards.size())
+{
+	// Shards are split over indices, so each point is copied only once,
+	// into the shard that is built over it
+	vector<size_t> arrOrder(arrPoints.size());
+	for (size_t idx = 0; idx < arrOrder.size(); ++idx)
+		arrOrder[idx] = idx;
+	vector<pair<KDTreeShardIt, KDTreeShardIt> > arrRanges;
+	partitionShards(arrPoints, begin(arrOrder), end(arrOrder), 
+		m_shards.size(), arrRanges);
+
+	// Shards are dealt to the NUMA nodes with processors in turn. Pages are
+	// placed on the node of the thread that first touches them, so each
+	// builder gathers its points and grows the nodes on its shard's node.
+	vector<GROUP_AFFINITY> arrNodes, arrAffinities;
+	getNumaNodeAffinities(arrNodes);
+	copy_if(begin(arrNodes), end(arrNodes), back_inserter(arrAffinities),
+		[](const GROUP_AFFINITY& affinity) { return affinity.Mask != 0; });
+
+	// One thread per shard
+	vector<thread> arrBuilders;
+	for (size_t idx = 0; idx < m_shards.size(); ++idx) {
+		arrBuilders.push_back(thread([&, idx]() {
+			if (!arrAffinities.empty()) {
+				SetThreadGroupAffinity(GetCurrentThread(), 
+					&arrAffinities[idx % arrAffinities.size()], NULL);
+			}
+			vector<V3x> arrShardPoints;
+			arrShardPoints.reserve(static_cast<size_t>(
+				arrRanges[idx].second - arrRanges[idx].first));
+			for_each(arrRanges[idx].first, arrRanges[idx].second, 
+				[&](size_t idxPoint) {
+					arrShardPoints.push_back(arrPoints[idxPoint]);
+				});
+			rebuildShard(idx, move(arrShardPoints));
+		}));
+	}
+	for_each(begin(arrBuilders), end(arrBuilders), 
+		[](thread& builder) { builder.join(); });
+}
 
-PointKDTree::~PointKDTree()
+ShardedPointKDTree::~ShardedPointKDTree()
 {
-	// NOTE: To allow ~unique_ptr() to see the complete PointKDTreeImpl type 
-	//       we have to create an explicit destructor for PointKDTree here,
-	//       after PointKDTreeImpl been defined.
 }
 
 void
-PointKDTree::dump(ostream& out) const
+ShardedPointKDTree::rebuildShard(size_t idxShard, vector<V3x>&& arrPoints)
 {
-	m_pImpl->dump(out);
+	assert(idxShard < m_shards.size());
+	Box<V3x> bounds;
+	for_each(begin(arrPoints), end(arrPoints), 
+		[&](const V3x& point) { bounds.extendBy(point); });
+	m_shardBounds[idxShard] = bounds;
+	m_shards[idxShard].reset(new PointKDTree(move(arrPoints)));
+}
+
+size_t
+ShardedPointKDTree::getNumPoints() const
+{
+	size_t numPoints = 0;
+	for_each(begin(m_shards), end(m_shards), 
+		[&](const unique_ptr<PointKDTree>& pShard) {
+			numPoints += pShard->getNumLivePoints();
+		});
+	return numPoints;
 }
 
 bool
-PointKDTree::isBalanced() const
+ShardedPointKDTree::getClosestPointTo(
+	const V3x& point,
+	KDTreeClosestPoint& result) const
 {
-	return m_pImpl->isBalanced();
+	vector<KDTreeBoundedTree> arrShards;
+	arrShards.reserve(m_shards.size());
+	for (size_t idx = 0; idx < m_shards.size(); ++idx) {
+		if (!m_shardBounds[idx].isEmpty()) {
+			arrShards.push_back(make_pair(
+				getDistanceToBox2(point, m_shardBounds[idx]), 
+				m_shards[idx].get()));
+		}
+	}
+	return getClosestPointInTrees(point, arrShards, result);
 }
 
 bool
-PointKDTree::getClosestPointTo(
+ShardedPointKDTree::getClosestPointsTo(
+	const vector<V3x>& arrPoints,
+	vector<KDTreeClosestPoint>& results) const
+{
+	// Queries fan out over the shards independently, so the batch is split
+	// into contiguous chunks, one per thread
+	results.resize(arrPoints.size());
+	size_t numThreads = min<size_t>(
+		max<size_t>(1, thread::hardware_concurrency()), 
+		(arrPoints.size() + MIN_QUERIES_PER_THREAD - 1) 
+			/ MIN_QUERIES_PER_THREAD);
+	atomic<bool> isFound(true);
+	auto findChunk = [&](size_t idxChunk) {
+		size_t idxBegin = arrPoints.size() * idxChunk / numThreads;
+		size_t idxEnd = arrPoints.size() * (idxChunk + 1) / numThreads;
+		for (size_t idx = idxBegin; idx < idxEnd; ++idx) {
+			if (!getClosestPointTo(arrPoints[idx], results[idx]))
+				isFound = false;
+		}
+	};
+
+	vector<thread> arrThreads;
+	for (size_t idxChunk = 1; idxChunk < numThreads; ++idxChunk)
+		arrThreads.push_back(thread(findChunk, idxChunk));
+	if (numThreads != 0)
+		findChunk(0);
+	for_each(begin(arrThreads), end(arrThreads), 
+		[](thread& t) { t.join(); });
+	return isFound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ReplicatedPointKDTree Methods
+////////////////////////////////////////////////////////////////////////////////
+
+ReplicatedPointKDTree::ReplicatedPointKDTree(const vector<V3x>& arrPoints)
+{
+	// Nodes without processors, e.g. memory-only ones, share the first
+	// replica. Without NUMA information a single unbound replica is built.
+	vector<GROUP_AFFINITY> arrNodes, arrAffinities;
+	getNumaNodeAffinities(arrNodes);
+	for_each(begin(arrNodes), end(arrNodes), 
+		[&](const GROUP_AFFINITY& affinity) {
+			if (affinity.Mask == 0) {
+				m_nodeReplicas.push_back(0);
+				return;
+			}
+			m_nodeReplicas.push_back(arrAffinities.size());
+			arrAffinities.push_back(affinity);
+		});
+	if (arrAffinities.empty()) {
+		GROUP_AFFINITY unbound = {};
+		arrAffinities.push_back(unbound);
+	}
+
+	// Pages are placed on the node of the thread that first touches them,
+	// so each builder copies the points and grows the nodes on its node
+	m_replicas.resize(arrAffinities.size());
+	vector<thread> arrBuilders;
+	for (size_t idx = 0; idx < arrAffinities.size(); ++idx) {
+		arrBuilders.push_back(thread([&, idx]() {
+			if (arrAffinities[idx].Mask != 0) {
+				SetThreadGroupAffinity(GetCurrentThread(), 
+					&arrAffinities[idx], NULL);
+			}
+			m_replicas[idx].reset(new PointKDTree(arrPoints));
+		}));
+	}
+	for_each(begin(arrBuilders), end(arrBuilders), 
+		[](thread& builder) { builder.join(); });
+}
+
+ReplicatedPointKDTree::~ReplicatedPointKDTree()
+{
+}
+
+size_t
+ReplicatedPointKDTree::getIdxLocalReplica() const
+{
+	USHORT node = 0;
+	if (!getCurrentNumaNode(node) || node >= m_nodeReplicas.size())
+		return 0;
+	return m_nodeReplicas[node];
+}
+
+bool
+ReplicatedPointKDTree::getClosestPointTo(
 	const V3x& point,
 	KDTreeClosestPoint& result) const
 {
-	return m_pImpl->getClosestPointTo(point, result);
+	return getLocalReplica().getClosestPointTo(point, result);
+}
+
+bool
+ReplicatedPointKDTree::getClosestPointsTo(
+	const vector<V3x>& arrPoints,
+	vector<KDTreeClosestPoint>& results) const
+{
+	return getLocalReplica().getClosestPointsTo(arrPoints, results);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Shared Memory Publication
+////////////////////////////////////////////////////////////////////////////////
+
+/// Control Segment of a Published Name
+/// generation is written with InterlockedExchange and read as an aligned
+/// volatile LONG, which is atomic and ordered on every Windows target.
+struct KDTreeSharedControl
+{
+	volatile LONG generation;
+};
+
+static string
+getSharedSegmentName(const string& name, uint32_t generation)
+{
+	ostringstream segmentName;
+	segmentName << name << "." << generation;
+	return segmentName.str();
+}
+
+PointKDTreePublisher::PointKDTreePublisher(const string& name)
+	: m_name(name)
+	, m_generation(0)
+{
+	// Fresh mappings are zero filled, so subscribers start at generation 0
+	m_control.create(name, sizeof(KDTreeSharedControl));
+}
+
+bool
+PointKDTreePublisher::publish(const PointKDTree& tree)
+{
+	if (!isValid())
+		return false;
+
+	// Reuses the slot of the generation before last, workers that mapped it
+	// keep it alive until they release their trees
+	uint32_t generation = m_generation + 1;
+	MappedFile& segment = m_segments[generation % 2];
+	segment.close();
+	if (!segment.create(getSharedSegmentName(m_name, generation),
+		tree.m_pImpl->getImageSize()))
+	{
+		return false;
+	}
+	tree.m_pImpl->writeImage(segment.getWritableData());
+
+	// Full barrier, the image is visible before the new generation is
+	KDTreeSharedControl* pControl = 
+		reinterpret_cast<KDTreeSharedControl*>(m_control.getWritableData());
+	InterlockedExchange(&pControl->generation, static_cast<LONG>(generation));
+	m_generation = generation;
+	return true;
+}
+
+PointKDTreeSubscriber::PointKDTreeSubscriber(const string& name)
+	: m_name(name)
+{
+	m_control.openShared(name);
+}
+
+uint32_t
+PointKDTreeSubscriber::getGeneration() const
+{
+	if (!isValid())
+		return 0;
+	const KDTreeSharedControl* pControl = 
+		reinterpret_cast<const KDTreeSharedControl*>(m_control.getData());
+	return static_cast<uint32_t>(pControl->generation);
+}
+
+unique_ptr<PointKDTree>
+PointKDTreeSubscriber::attach(int flags, uint32_t* out_generation) const
+{
+	for (;;) {
+		uint32_t generation = getGeneration();
+		if (generation == 0)
+			return unique_ptr<PointKDTree>();
+
+		shared_ptr<MappedFile> pSegment(new MappedFile());
+		if (pSegment->openShared(getSharedSegmentName(m_name, generation))) {
+			if (out_generation != NULL)
+				*out_generation = generation;
+			return PointKDTree::open(pSegment, flags);
+		}
+
+		// The segment was retired while attaching, retry with the newer one
+		if (getGeneration() == generation)
+			return unique_ptr<PointKDTree>();
+	}
 }
 
 #pragma warning(pop)
@@ -0,0 +1,159 @@
+#include "stdafx.h"
+#include "largepages.h"
+
+#pragma warning(push, 4)
+
+////////////////////////////////////////////////////////////////////////////////
+// Large Page Memory
+////////////////////////////////////////////////////////////////////////////////
+
+// VirtualAlloc2 and its parameter came with Windows 10 1803, later than
+// the SDK of the toolset, so they are declared here and looked up at run
+// time. The layout matches MEM_EXTENDED_PARAMETER.
+struct KDTreeMemExtendedParameter
+{
+	DWORD64 type : 8;
+	DWORD64 reserved : 56;
+	DWORD64 value;
+};
+
+typedef PVOID (WINAPI *VirtualAlloc2Func)(HANDLE, PVOID, SIZE_T, ULONG, ULONG,
+	KDTreeMemExtendedParameter*, ULONG);
+
+// MemExtendedParameterAttributeFlags, MEM_EXTENDED_PARAMETER_NONPAGED_HUGE
+static const DWORD64 MEM_PARAMETER_ATTRIBUTE_FLAGS = 5;
+static const DWORD64 MEM_ATTRIBUTE_NONPAGED_HUGE = 0x10;
+
+static once_flag s_isLargePageSizeSet;
+static size_t s_largePageSize = 0;
+static size_t s_hugePageSize = 0;
+static VirtualAlloc2Func s_pVirtualAlloc2 = NULL;
+
+// Large page blocks by address, anything else came from the heap
+static mutex s_blocksMutex;
+static map<void*, size_t> s_largePageBlocks;
+static size_t s_largePageBytes = 0;
+
+static bool
+enableLockMemoryPrivilege()
+{
+	HANDLE hToken = NULL;
+	if (!OpenProcessToken(GetCurrentProcess(),
+		TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+	{
+		return false;
+	}
+
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	// AdjustTokenPrivileges succeeds even if the account lacks the
+	// privilege, only the last error tells
+	bool isEnabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege",
+			&privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;
+	CloseHandle(hToken);
+	return isEnabled;
+}
+
+static void
+initPageSizes()
+{
+	call_once(s_isLargePageSizeSet, []() {
+		if (!enableLockMemoryPrivilege())
+			return;
+		s_largePageSize = GetLargePageMinimum();
+
+		// 1 GB pages need a 64 bit process
+		HMODULE hKernelBase = GetModuleHandleA("kernelbase.dll");
+		if (sizeof(void*) == 8 && hKernelBase != NULL) {
+			s_pVirtualAlloc2 = reinterpret_cast<VirtualAlloc2Func>(
+				GetProcAddress(hKernelBase, "VirtualAlloc2"));
+			if (s_pVirtualAlloc2 != NULL)
+				s_hugePageSize = size_t(1) << 30;
+		}
+	});
+}
+
+// Commits size rounded up to whole pages, NULL for blocks below half a 
+// page or if no contiguous pages of the size are left
+static void*
+commitPages(size_t size, size_t pageSize, bool isHuge)
+{
+	if (pageSize == 0 || size < pageSize / 2 || size > SIZE_MAX - pageSize)
+		return NULL;
+
+	size_t pagesSize = (size + pageSize - 1) / pageSize * pageSize;
+	void* pData = NULL;
+	if (isHuge) {
+		KDTreeMemExtendedParameter parameter = {};
+		parameter.type = MEM_PARAMETER_ATTRIBUTE_FLAGS;
+		parameter.value = MEM_ATTRIBUTE_NONPAGED_HUGE;
+		pData = s_pVirtualAlloc2(GetCurrentProcess(), NULL, pagesSize,
+			MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE,
+			&parameter, 1);
+	} else {
+		pData = VirtualAlloc(NULL, pagesSize,
+			MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	}
+	if (pData != NULL) {
+		lock_guard<mutex> lock(s_blocksMutex);
+		s_largePageBlocks[pData] = pagesSize;
+		s_largePageBytes += pagesSize;
+	}
+	return pData;
+}
+
+size_t
+getLargePageSize()
+{
+	initPageSizes();
+	return s_largePageSize;
+}
+
+size_t
+getHugePageSize()
+{
+	initPageSizes();
+	return s_hugePageSize;
+}
+
+void*
+allocateLargePages(size_t size)
+{
+	initPageSizes();
+	void* pData = commitPages(size, s_hugePageSize, true);
+	if (pData == NULL)
+		pData = commitPages(size, s_largePageSize, false);
+	return pData != NULL ? pData : ::operator new(size);
+}
+
+void
+freeLargePages(void* pData)
+{
+	if (pData == NULL)
+		return;
+
+	{
+		lock_guard<mutex> lock(s_blocksMutex);
+		auto itBlock = s_largePageBlocks.find(pData);
+		if (itBlock != s_largePageBlocks.end()) {
+			s_largePageBytes -= itBlock->second;
+			s_largePageBlocks.erase(itBlock);
+			VirtualFree(pData, 0, MEM_RELEASE);
+			return;
+		}
+	}
+	::operator delete(pData);
+}
+
+size_t
+getLargePageBytes()
+{
+	lock_guard<mutex> lock(s_blocksMutex);
+	return s_largePageBytes;
+}
+
+#pragma warning(pop)
@@ -0,0 +1,146 @@
+#include "stdafx.h"
+#include "mappedfile.h"
+
+#pragma warning(push, 4)
+
+////////////////////////////////////////////////////////////////////////////////
+// MappedFile Methods
+////////////////////////////////////////////////////////////////////////////////
+
+MappedFile::MappedFile()
+	: m_hFile(INVALID_HANDLE_VALUE)
+	, m_hMapping(NULL)
+	, m_pData(NULL)
+	, m_size(0)
+	, m_isWritable(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool
+MappedFile::open(const string& path)
+{
+	close();
+
+	m_hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(m_hFile, &fileSize) || fileSize.QuadPart == 0
+		|| static_cast<uint64_t>(fileSize.QuadPart) > SIZE_MAX) 
+	{
+		close();
+		return false;
+	}
+
+	m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_hMapping == NULL) {
+		close();
+		return false;
+	}
+
+	m_pData = static_cast<const char*>(
+		MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+	if (m_pData == NULL) {
+		close();
+		return false;
+	}
+
+	m_size = static_cast<size_t>(fileSize.QuadPart);
+	return true;
+}
+
+bool
+MappedFile::create(const string& name, size_t size)
+{
+	close();
+
+	uint64_t size64 = size;
+	m_hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		static_cast<DWORD>(size64 >> 32), static_cast<DWORD>(size64), 
+		name.c_str());
+	if (m_hMapping == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+		close();
+		return false;
+	}
+
+	m_pData = static_cast<const char*>(
+		MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0));
+	if (m_pData == NULL) {
+		close();
+		return false;
+	}
+
+	m_size = size;
+	m_isWritable = true;
+	return true;
+}
+
+bool
+MappedFile::openShared(const string& name)
+{
+	close();
+
+	m_hMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+	if (m_hMapping == NULL)
+		return false;
+
+	m_pData = static_cast<const char*>(
+		MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+	if (m_pData == NULL) {
+		close();
+		return false;
+	}
+
+	// The view covers the whole mapping rounded up to pages
+	MEMORY_BASIC_INFORMATION info;
+	if (VirtualQuery(m_pData, &info, sizeof(info)) == 0) {
+		close();
+		return false;
+	}
+	m_size = info.RegionSize;
+	return true;
+}
+
+char*
+MappedFile::getWritableData() const
+{
+	assert(m_isWritable);
+	return const_cast<char*>(m_pData);
+}
+
+void
+MappedFile::close()
+{
+	if (m_pData != NULL)
+		UnmapViewOfFile(m_pData);
+	if (m_hMapping != NULL)
+		CloseHandle(m_hMapping);
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hFile);
+
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+	m_pData = NULL;
+	m_size = 0;
+	m_isWritable = false;
+}
+
+void
+MappedFile::prefetch() const
+{
+	static const size_t PAGE_SIZE = 4096;
+
+	volatile char sink = 0;
+	for (size_t offset = 0; offset < m_size; offset += PAGE_SIZE)
+		sink ^= m_pData[offset];
+	UNUSED(sink);
+}
+
+#pragma warning(pop)
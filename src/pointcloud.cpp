@@ -0,0 +1,316 @@
+#include "stdafx.h"
+#include "pointcloud.h"
+#include "mappedfile.h"
+
+#pragma warning(push, 4)
+
+////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t
+getNumLoaderThreads()
+{
+	return max<size_t>(1, thread::hardware_concurrency());
+}
+
+// Calls func(idxChunk) for every chunk, one thread per chunk
+template <typename func_t>
+static void
+parallelForChunks(size_t numChunks, func_t func)
+{
+	vector<thread> arrThreads;
+	arrThreads.reserve(numChunks);
+	for (size_t idxChunk = 1; idxChunk < numChunks; ++idxChunk)
+		arrThreads.push_back(thread(func, idxChunk));
+	func(0);
+	for_each(begin(arrThreads), end(arrThreads), [](thread& t) { t.join(); });
+}
+
+static bool
+hasSuffix(const string& str, const string& suffix)
+{
+	if (str.size() < suffix.size())
+		return false;
+	string tail = str.substr(str.size() - suffix.size());
+	transform(begin(tail), end(tail), begin(tail), ::tolower);
+	return tail == suffix;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PLY
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t
+getPLYTypeSize(const string& type)
+{
+	if (type == "char" || type == "uchar" || type == "int8" || type == "uint8")
+		return 1;
+	if (type == "short" || type == "ushort" 
+		|| type == "int16" || type == "uint16")
+	{
+		return 2;
+	}
+	if (type == "int" || type == "uint" || type == "float"
+		|| type == "int32" || type == "uint32" || type == "float32")
+	{
+		return 4;
+	}
+	if (type == "double" || type == "float64")
+		return 8;
+	return 0;
+}
+
+/// Layout of the x, y and z properties within a PLY vertex
+struct PLYVertexLayout
+{
+	size_t stride;
+	size_t offsets[3];
+	size_t sizes[3];   // 4 for float, 8 for double
+	bool isBigEndian;
+};
+
+static bool
+readPLYHeader(
+	const char* pData,
+	size_t size,
+	PLYVertexLayout& layout,
+	size_t& out_numVertices,
+	size_t& out_headerSize)
+{
+	static const char END_HEADER[] = "end_header";
+	const char* pEnd = search(pData, pData + size, 
+		END_HEADER, END_HEADER + sizeof(END_HEADER) - 1);
+	const char* pBody = find(pEnd, pData + size, '\n');
+	if (pBody == pData + size)
+		return false;
+	out_headerSize = static_cast<size_t>(pBody + 1 - pData);
+
+	istringstream header(string(pData, pEnd));
+	string line;
+	getline(header, line);
+	if (line.compare(0, 3, "ply") != 0)
+		return false;
+
+	memset(&layout, 0, sizeof(layout));
+	bool isVertexElement = false;
+	bool hasFormat = false;
+	int numCoords = 0;
+	out_numVertices = 0;
+
+	while (getline(header, line)) {
+		istringstream words(line);
+		string keyword;
+		words >> keyword;
+
+		if (keyword == "format") {
+			string format;
+			words >> format;
+			if (format != "binary_little_endian" 
+				&& format != "binary_big_endian")
+			{
+				return false;
+			}
+			layout.isBigEndian = format == "binary_big_endian";
+			hasFormat = true;
+		} else if (keyword == "element") {
+			// Points are read from the start of the body, so the vertex
+			// element has to be the first one
+			string name;
+			words >> name;
+			if (isVertexElement || name != "vertex")
+				return isVertexElement && numCoords == 3 && hasFormat;
+			words >> out_numVertices;
+			isVertexElement = true;
+		} else if (keyword == "property" && isVertexElement) {
+			string type, name;
+			words >> type >> name;
+			size_t typeSize = getPLYTypeSize(type);
+			if (typeSize == 0)
+				return false;
+
+			int axis = (name == "x") ? 0 : (name == "y") ? 1 : 
+				(name == "z") ? 2 : -1;
+			if (axis >= 0) {
+				if (type != "float" && type != "float32" 
+					&& type != "double" && type != "float64")
+				{
+					return false;
+				}
+				layout.offsets[axis] = layout.stride;
+				layout.sizes[axis] = typeSize;
+				++numCoords;
+			}
+			layout.stride += typeSize;
+		}
+	}
+
+	return isVertexElement && numCoords == 3 && hasFormat;
+}
+
+static fpreal
+readPLYCoord(const char* pData, size_t size, bool isBigEndian)
+{
+	char bytes[8];
+	memcpy(bytes, pData, size);
+	if (isBigEndian)
+		reverse(bytes, bytes + size);
+
+	if (size == sizeof(float)) {
+		float value;
+		memcpy(&value, bytes, sizeof(value));
+		return value;
+	}
+	double value;
+	memcpy(&value, bytes, sizeof(value));
+	return static_cast<fpreal>(value);
+}
+
+bool
+loadPLY(const string& path, vector<V3x>& out_points)
+{
+	out_points.clear();
+
+	MappedFile file;
+	PLYVertexLayout layout;
+	size_t numVertices, headerSize;
+	if (!file.open(path)
+		|| !readPLYHeader(file.getData(), file.getSize(), layout, 
+			numVertices, headerSize)
+		|| (file.getSize() - headerSize) / layout.stride < numVertices)
+	{
+		return false;
+	}
+
+	// Vertices have a fixed size, so each thread decodes a range of them
+	out_points.resize(numVertices);
+	const char* pBody = file.getData() + headerSize;
+	size_t numChunks = min(getNumLoaderThreads(), max<size_t>(1, numVertices));
+	parallelForChunks(numChunks, [&](size_t idxChunk) {
+		size_t idxBegin = numVertices * idxChunk / numChunks;
+		size_t idxEnd = numVertices * (idxChunk + 1) / numChunks;
+		for (size_t idx = idxBegin; idx < idxEnd; ++idx) {
+			const char* pVertex = pBody + idx * layout.stride;
+			for (int axis = 0; axis < 3; ++axis) {
+				out_points[idx][axis] = readPLYCoord(
+					pVertex + layout.offsets[axis], layout.sizes[axis], 
+					layout.isBigEndian);
+			}
+		}
+	});
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// XYZ
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+isXYZPointLine(const char* pLine, const char* pEnd)
+{
+	while (pLine != pEnd && (*pLine == ' ' || *pLine == '\t' || *pLine == '\r'))
+		++pLine;
+	return pLine != pEnd && *pLine != '\n' && *pLine != '#';
+}
+
+static bool
+parseXYZLine(const char* pLine, const char* pEnd, V3x& out_point)
+{
+	// strtod needs a terminated string, lines are short enough to copy
+	char buffer[256];
+	size_t size = min<size_t>(pEnd - pLine, sizeof(buffer) - 1);
+	memcpy(buffer, pLine, size);
+	buffer[size] = '\0';
+
+	char* pCursor = buffer;
+	for (int axis = 0; axis < 3; ++axis) {
+		char* pNumberEnd;
+		out_point[axis] = strtod(pCursor, &pNumberEnd);
+		if (pNumberEnd == pCursor)
+			return false;
+		pCursor = pNumberEnd;
+	}
+	return true;
+}
+
+bool
+loadXYZ(const string& path, vector<V3x>& out_points)
+{
+	out_points.clear();
+
+	MappedFile file;
+	if (!file.open(path))
+		return false;
+
+	// Chunks are cut after a newline, so every line belongs to one chunk
+	const char* pData = file.getData();
+	const char* pEnd = pData + file.getSize();
+	size_t numChunks = getNumLoaderThreads();
+	vector<const char*> arrChunkBegins(numChunks + 1, pEnd);
+	arrChunkBegins[0] = pData;
+	for (size_t idxChunk = 1; idxChunk < numChunks; ++idxChunk) {
+		const char* pCut = pData + file.getSize() * idxChunk / numChunks;
+		pCut = max(pCut, arrChunkBegins[idxChunk-1]);
+		const char* pNewline = find(pCut, pEnd, '\n');
+		arrChunkBegins[idxChunk] = (pNewline == pEnd) ? pEnd : pNewline + 1;
+	}
+
+	auto forEachLine = [&](size_t idxChunk, 
+		function<void (const char*, const char*)> func) 
+	{
+		const char* pLine = arrChunkBegins[idxChunk];
+		const char* pChunkEnd = arrChunkBegins[idxChunk+1];
+		while (pLine < pChunkEnd) {
+			const char* pLineEnd = find(pLine, pChunkEnd, '\n');
+			if (isXYZPointLine(pLine, pLineEnd))
+				func(pLine, pLineEnd);
+			pLine = pLineEnd + 1;
+		}
+	};
+
+	// First pass counts the points of each chunk to find where its points
+	// go, the second decodes them in place
+	vector<size_t> arrChunkPoints(numChunks + 1, 0);
+	parallelForChunks(numChunks, [&](size_t idxChunk) {
+		size_t numPoints = 0;
+		forEachLine(idxChunk, [&](const char*, const char*) { ++numPoints; });
+		arrChunkPoints[idxChunk+1] = numPoints;
+	});
+	partial_sum(begin(arrChunkPoints), end(arrChunkPoints), 
+		begin(arrChunkPoints));
+
+	out_points.resize(arrChunkPoints[numChunks]);
+	vector<char> arrChunkValid(numChunks, 1);
+	parallelForChunks(numChunks, [&](size_t idxChunk) {
+		size_t idxPoint = arrChunkPoints[idxChunk];
+		forEachLine(idxChunk, [&](const char* pLine, const char* pLineEnd) {
+			if (!parseXYZLine(pLine, pLineEnd, out_points[idxPoint++]))
+				arrChunkValid[idxChunk] = 0;
+		});
+	});
+
+	if (find(begin(arrChunkValid), end(arrChunkValid), 0) 
+		!= end(arrChunkValid)) 
+	{
+		out_points.clear();
+		return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Point Cloud
+////////////////////////////////////////////////////////////////////////////////
+
+bool
+loadPointCloud(const string& path, vector<V3x>& out_points)
+{
+	if (hasSuffix(path, ".ply"))
+		return loadPLY(path, out_points);
+	if (hasSuffix(path, ".xyz") || hasSuffix(path, ".txt"))
+		return loadXYZ(path, out_points);
+	return false;
+}
+
+#pragma warning(pop)
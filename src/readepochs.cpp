@@ -0,0 +1,61 @@
+#include "stdafx.h"
+#include "readepochs.h"
+
+#pragma warning(push, 4)
+
+////////////////////////////////////////////////////////////////////////////////
+// ReadEpochs Methods
+////////////////////////////////////////////////////////////////////////////////
+
+ReadEpochs::ReadEpochs()
+{
+	m_epoch = 0;
+	m_numReaders[0] = 0;
+	m_numReaders[1] = 0;
+}
+
+int
+ReadEpochs::enter()
+{
+	// A reader that read the epoch just before it advanced is counted in
+	// the older slot. Writers only rely on having seen each slot empty
+	// after they unlinked an object, which a reader that could still reach
+	// it prevents whichever slot it is counted in, so it merely delays
+	// the next advance.
+	int slot = static_cast<int>(m_epoch & 1);
+	++m_numReaders[slot];
+	return slot;
+}
+
+void
+ReadEpochs::leave(int slot)
+{
+	--m_numReaders[slot];
+}
+
+void
+ReadEpochs::synchronize()
+{
+	// Readers entering from now on see whatever was published before the
+	// call, only those counted in the current and previous epoch may not
+	unsigned epoch = m_epoch;
+	while (m_numReaders[(epoch + 1) & 1] != 0)
+		this_thread::yield();
+	m_epoch = epoch + 1;
+	while (m_numReaders[epoch & 1] != 0)
+		this_thread::yield();
+}
+
+bool
+ReadEpochs::tryAdvance()
+{
+	// The next epoch shares its slot with the previous one
+	unsigned epoch = m_epoch;
+	if (m_numReaders[(epoch + 1) & 1] != 0)
+		return false;
+
+	m_epoch = epoch + 1;
+	return true;
+}
+
+#pragma warning(pop)
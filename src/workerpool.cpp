@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "workerpool.h"
+
+#pragma warning(push, 4)
+
+// Constructed before main() runs, its threads start with the first batch
+static WorkerPool s_sharedPool;
+
+////////////////////////////////////////////////////////////////////////////////
+// WorkerPool Methods
+////////////////////////////////////////////////////////////////////////////////
+
+WorkerPool::WorkerPool()
+	: m_pTask(NULL)
+	, m_numTasks(0)
+	, m_idxNextTask(0)
+	, m_numRunning(0)
+	, m_isStopping(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_isStopping = true;
+	}
+	m_taskReady.notify_all();
+	for_each(begin(m_arrThreads), end(m_arrThreads),
+		[](thread& worker) { worker.join(); });
+}
+
+WorkerPool&
+WorkerPool::getShared()
+{
+	return s_sharedPool;
+}
+
+void
+WorkerPool::run(
+	size_t numTasks,
+	const function<void (size_t)>& task)
+{
+	unique_lock<mutex> batchLock(m_batchMutex, try_to_lock);
+	if (!batchLock.owns_lock() || numTasks == 1) {
+		for (size_t idx = 0; idx < numTasks; ++idx)
+			task(idx);
+		return;
+	}
+
+	size_t numThreads = max<unsigned>(1, thread::hardware_concurrency()) - 1;
+	while (m_arrThreads.size() < numThreads)
+		m_arrThreads.push_back(thread([this]() { work(); }));
+
+	unique_lock<mutex> lock(m_mutex);
+	m_pTask = &task;
+	m_numTasks = numTasks;
+	m_idxNextTask = 0;
+	m_taskReady.notify_all();
+
+	// Every task is taken once the caller runs out, some may still run
+	while (runNextTask(lock))
+		;
+	while (m_numRunning != 0)
+		m_batchDone.wait(lock);
+	m_pTask = NULL;
+}
+
+void
+WorkerPool::work()
+{
+	unique_lock<mutex> lock(m_mutex);
+	for (;;) {
+		if (runNextTask(lock))
+			continue;
+		if (m_isStopping)
+			return;
+		m_taskReady.wait(lock);
+	}
+}
+
+bool
+WorkerPool::runNextTask(unique_lock<mutex>& lock)
+{
+	if (m_pTask == NULL || m_idxNextTask == m_numTasks)
+		return false;
+
+	const function<void (size_t)>& task = *m_pTask;
+	size_t idx = m_idxNextTask++;
+	++m_numRunning;
+	lock.unlock();
+	task(idx);
+	lock.lock();
+	if (--m_numRunning == 0 && m_idxNextTask == m_numTasks)
+		m_batchDone.notify_all();
+	return true;
+}
+
+#pragma warning(pop)